@@ -0,0 +1,94 @@
+/* $Id$ */
+/* Copyright (c) 2011-2020 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+#ifndef DESKTOP_PHONE_MODEMS_PHONE_PURPLE_H
+# define DESKTOP_PHONE_MODEMS_PHONE_PURPLE_H
+
+# include <stddef.h>
+# include <time.h>
+
+
+/* Purple */
+/* types */
+/* requests specific to the Purple modem plug-in: sent as
+ * MODEM_REQUEST_UNSUPPORTED, and reported as MODEM_EVENT_TYPE_UNSUPPORTED,
+ * with these numbers as request */
+typedef enum _PurpleModemRequest
+{
+	PURPLE_MODEM_REQUEST_HISTORY = 0,	/* arg: PurpleModemHistory */
+	PURPLE_MODEM_REQUEST_TRANSFER,		/* data: PurpleModemTransfer */
+	PURPLE_MODEM_REQUEST_TRANSFER_ACCEPT,	/* arg: PurpleModemTransfer */
+	PURPLE_MODEM_REQUEST_TRANSFER_CANCEL,	/* arg: PurpleModemTransfer */
+	PURPLE_MODEM_REQUEST_TRANSFER_SEND,	/* arg: PurpleModemTransfer */
+	PURPLE_MODEM_REQUEST_STARTUP		/* data: PurpleModemStartup */
+} PurpleModemRequest;
+
+typedef struct _PurpleModemHistory
+{
+	char const * number;
+	/* only messages older than this date (0 for the latest) */
+	time_t before;
+	size_t count;
+} PurpleModemHistory;
+
+typedef enum _PurpleModemTransferStatus
+{
+	PURPLE_MODEM_TRANSFER_STATUS_OFFERED = 0,
+	PURPLE_MODEM_TRANSFER_STATUS_PROGRESS,
+	PURPLE_MODEM_TRANSFER_STATUS_COMPLETED,
+	PURPLE_MODEM_TRANSFER_STATUS_CANCELLED
+} PurpleModemTransferStatus;
+
+typedef struct _PurpleModemTransfer
+{
+	unsigned int id;
+	PurpleModemTransferStatus status;
+	int incoming;
+	char const * number;
+	/* local file name (to accept or send) */
+	char const * filename;
+	size_t size;
+	size_t done;
+	/* in bytes per second */
+	size_t rate;
+} PurpleModemTransfer;
+
+/* reported once libpurple is initialized */
+typedef enum _PurpleModemStartupStep
+{
+	PURPLE_MODEM_STARTUP_STEP_CORE = 0,
+	PURPLE_MODEM_STARTUP_STEP_BLIST,
+	PURPLE_MODEM_STARTUP_STEP_PREFS,
+	PURPLE_MODEM_STARTUP_STEP_PROBE,
+	PURPLE_MODEM_STARTUP_STEP_PLUGINS,
+	PURPLE_MODEM_STARTUP_STEP_POUNCES,
+	PURPLE_MODEM_STARTUP_STEP_HISTORY
+} PurpleModemStartupStep;
+# define PURPLE_MODEM_STARTUP_STEP_COUNT \
+	(PURPLE_MODEM_STARTUP_STEP_HISTORY + 1)
+
+typedef struct _PurpleModemStartup
+{
+	/* the plug-ins not loaded thanks to the manifest */
+	unsigned int plugins_skipped;
+	/* the time they took to load when last probed, in microseconds */
+	unsigned long plugins_saved;
+	/* the time spent on each step, in microseconds */
+	unsigned long timings[PURPLE_MODEM_STARTUP_STEP_COUNT];
+} PurpleModemStartup;
+
+#endif /* !DESKTOP_PHONE_MODEMS_PHONE_PURPLE_H */
@@ -15,12 +15,24 @@
 
 
 
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <System.h>
 #include <Desktop/Phone/modem.h>
 #include <purple.h>
+#include "phone-purple.h"
 #include "../../../config.h"
 
 
@@ -36,19 +48,274 @@
 /* Purple */
 /* private */
 /* types */
+typedef enum _PurpleInitStep
+{
+	PURPLE_INIT_STEP_CORE = PURPLE_MODEM_STARTUP_STEP_CORE,
+	PURPLE_INIT_STEP_BLIST = PURPLE_MODEM_STARTUP_STEP_BLIST,
+	PURPLE_INIT_STEP_PREFS = PURPLE_MODEM_STARTUP_STEP_PREFS,
+	PURPLE_INIT_STEP_PROBE = PURPLE_MODEM_STARTUP_STEP_PROBE,
+	PURPLE_INIT_STEP_PLUGINS = PURPLE_MODEM_STARTUP_STEP_PLUGINS,
+	PURPLE_INIT_STEP_POUNCES = PURPLE_MODEM_STARTUP_STEP_POUNCES,
+	PURPLE_INIT_STEP_HISTORY = PURPLE_MODEM_STARTUP_STEP_HISTORY,
+	PURPLE_INIT_STEP_DONE
+} PurpleInitStep;
+#define PURPLE_INIT_STEP_COUNT	PURPLE_MODEM_STARTUP_STEP_COUNT
+
+typedef struct _PurpleInput
+{
+	/* must be first */
+	GSource source;
+
+	GPollFD poll;
+	PurpleInputCondition condition;
+	PurpleInputFunction function;
+	gpointer data;
+} PurpleInput;
+
+typedef enum _PurpleLoginState
+{
+	PURPLE_LOGIN_STATE_IDLE = 0,
+	PURPLE_LOGIN_STATE_QUEUED,
+	PURPLE_LOGIN_STATE_CONNECTING,
+	PURPLE_LOGIN_STATE_ONLINE
+} PurpleLoginState;
+
+typedef struct _PurpleLogin
+{
+	struct _ModemPlugin * purple;
+	PurpleAccount * account;
+	PurpleLoginState state;
+	/* failed attempts in a row */
+	unsigned int attempts;
+	/* before trying again */
+	guint source;
+} PurpleLogin;
+
+typedef struct _PurpleResolve
+{
+	PurpleDnsQueryData * query;
+	PurpleDnsQueryResolvedCallback resolved;
+	PurpleDnsQueryFailedCallback failed;
+	gchar * host;
+	unsigned short port;
+	/* set from the main thread only */
+	volatile gint cancelled;
+
+	/* results, as pairs of lengths and addresses */
+	int error;
+	GSList * hosts;
+} PurpleResolve;
+
+typedef struct _PurpleResolved
+{
+	gint64 expires;
+	GSList * hosts;
+} PurpleResolved;
+
+/* history files start with this header */
+typedef struct _PurpleHistoryHeader
+{
+	uint32_t magic;
+	uint32_t count;		/* keys in the index */
+	uint64_t size;		/* of the log described by the index */
+} PurpleHistoryHeader;
+
+/* indexes are sorted by hash and date */
+typedef struct _PurpleHistoryKey
+{
+	uint32_t hash;
+	uint32_t offset;
+	int64_t date;
+} PurpleHistoryKey;
+
+/* followed by the number, sender and message, nul-terminated and padded
+ * to eight bytes */
+typedef struct _PurpleHistoryRecord
+{
+	int64_t date;
+	uint32_t size;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t number;
+	uint32_t sender;
+	uint32_t message;
+} PurpleHistoryRecord;
+
+typedef struct _PurpleHistorySegment
+{
+	unsigned int id;
+	unsigned char * data;
+	size_t size;
+	void * index;
+	size_t index_size;
+	PurpleHistoryKey const * keys;
+	size_t keys_cnt;
+} PurpleHistorySegment;
+
+typedef struct _PurpleHistoryCompaction
+{
+	struct _ModemPlugin * purple;
+	GThread * thread;
+	gchar * path;
+	unsigned int * ids;
+	size_t ids_cnt;
+	int error;
+} PurpleHistoryCompaction;
+
+typedef struct _PurpleTransfer
+{
+	unsigned int id;
+	PurpleXfer * xfer;
+	int fd;
+	/* data received so far, renamed once complete */
+	gchar * partial;
+	off_t offset;
+
+	/* progress, reported at a limited rate */
+	gint64 reported;
+	size_t reported_done;
+	size_t rate;
+} PurpleTransfer;
+
+typedef struct _PurpleEntry
+{
+	unsigned int id;
+	/* NULL once removed */
+	PurpleBuddy * buddy;
+	/* last synchronisation this entry was queued for */
+	unsigned int generation;
+	/* last state sent */
+	gboolean sent;
+	ModemContactStatus status;
+	gchar * name;
+} PurpleEntry;
+
+typedef struct _PurpleMessage
+{
+	gchar * number;
+	time_t date;
+	gchar * content;
+} PurpleMessage;
+
 typedef struct _ModemPlugin
 {
 	ModemPluginHelper * helper;
 
 	PurpleCoreUiOps ops_ui;
 	PurpleEventLoopUiOps ops_glib;
+	PurpleDnsQueryUiOps ops_dns;
+	PurpleXferUiOps ops_xfer;
+
+	/* initialisation, deferred until started */
+	PurpleInitStep step;
+	guint source;
+	/* time spent on each step (in microseconds) */
+	gint64 timings[PURPLE_INIT_STEP_COUNT];
+	/* plug-ins not probed thanks to the manifest */
+	unsigned int plugins_skipped;
+	gint64 plugins_saved;
+
+	/* logins, by account */
+	GHashTable * logins;
+	GQueue * logins_queue;
+	unsigned int logins_active;
+	guint logins_source;
+
+	/* conversations, by number */
+	GHashTable * conversations;
+	/* errors are written to the conversation while sending */
+	gboolean sending;
+	gboolean sending_failed;
+
+	/* incoming messages, delivered once per main loop iteration */
+	GQueue * messages;
+	guint messages_source;
+
+	/* contacts, by buddy */
+	GHashTable * entries;
+	unsigned int entries_id;
+	/* changes, sent at most once per interval */
+	GList * entries_queue;
+	unsigned int generation;
+	guint entries_source;
+	unsigned int entries_interval;
+	/* send the entries even if unchanged */
+	gboolean entries_force;
+
+	/* name resolution */
+	GThreadPool * resolver;
+	GHashTable * resolves;		/* pending, by query */
+	GHashTable * resolved;		/* cache, by host name */
+	/* results ready, delivered from the main loop */
+	GMutex results_mutex;
+	GQueue * results;
+	guint results_source;
+
+	/* file transfers, by identifier */
+	GHashTable * transfers;
+	unsigned int transfers_id;
+
+	/* message history */
+	gchar * history;
+	PurpleHistorySegment * segments;
+	size_t segments_cnt;
+	PurpleHistoryCompaction * compaction;
+	/* current segment */
+	int history_fd;
+	unsigned int history_id;
+	size_t history_size;
+	GHashTable * history_keys;	/* arrays of keys, by hash */
 } Purple;
 
 
+/* constants */
+/* conditions as in the GLib event loop of Pidgin */
+#define PURPLE_INPUT_READ_COND	(G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_INPUT_WRITE_COND	(G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+/* contacts */
+/* delay between updates (in milliseconds) */
+#define PURPLE_PRESENCE_INTERVAL	500
+
+/* name resolution */
+#define PURPLE_DNS_THREADS	4
+/* lifetime of the results cached (in seconds) */
+#define PURPLE_DNS_TTL		300
+
+/* plug-ins */
+#define PURPLE_PLUGINS_MANIFEST	"phone-plugins.conf"
+
+/* logins */
+/* handshakes at a time */
+#define PURPLE_LOGIN_CONCURRENT	2
+/* delay between logins (in milliseconds) */
+#define PURPLE_LOGIN_STAGGER	750
+/* delay before connecting again (in seconds) */
+#define PURPLE_LOGIN_BACKOFF	2
+#define PURPLE_LOGIN_BACKOFF_MAX	600
+
+/* file transfers */
+#define PURPLE_TRANSFER_PARTIAL	".part"
+/* minimum delay between progress events (in microseconds) */
+#define PURPLE_TRANSFER_PROGRESS	250000
+
+/* message history */
+#define PURPLE_HISTORY_MAGIC	0x31485050
+#define PURPLE_HISTORY_SEGMENT	1048576
+/* segments compacted together */
+#define PURPLE_HISTORY_SEGMENTS	8
+#define PURPLE_HISTORY_COMPACTED	(PURPLE_HISTORY_SEGMENT \
+		* PURPLE_HISTORY_SEGMENTS)
+
+
 /* variables */
+/* libpurple only supports one instance */
+static Purple * _purple = NULL;
+
 static ModemConfig _purple_config[] =
 {
 	{ "username",		"Username",	MCT_STRING	},
+	{ "presence_interval",	"Presence (ms)",	MCT_UINT32	},
 	{ NULL,			NULL,		MCT_NONE	}
 };
 
@@ -60,9 +327,120 @@ static int _purple_start(ModemPlugin * modem, unsigned int retry);
 static int _purple_stop(ModemPlugin * modem);
 static int _purple_request(ModemPlugin * modem, ModemRequest * request);
 
+/* useful */
+static PurpleAccount * _purple_account(Purple * purple);
+static PurpleConversation * _purple_conversation(Purple * purple,
+		char const * number);
+static void _purple_entry_free(gpointer data);
+static unsigned int _purple_entry_interval(Purple * purple);
+static void _purple_entry_queue(Purple * purple, PurpleBuddy * buddy);
+static void _purple_entry_queue_all(Purple * purple);
+static void _purple_message_queue(Purple * purple, char const * number,
+		char const * message);
+
+/* plugins */
+static int _purple_plugins_probe(Purple * purple);
+
+/* logins */
+static void _purple_login_free(gpointer data);
+static int _purple_login_queue(Purple * purple, PurpleAccount * account);
+static void _purple_login_schedule(Purple * purple);
+
+/* dnsquery */
+static void _purple_dnsquery_destroy(PurpleDnsQueryData * query);
+static gboolean _purple_dnsquery_resolve_host(PurpleDnsQueryData * query,
+		PurpleDnsQueryResolvedCallback resolved,
+		PurpleDnsQueryFailedCallback failed);
+static void _dnsquery_deliver(Purple * purple, PurpleResolve * resolve);
+static GSList * _dnsquery_hosts_copy(GSList * hosts, unsigned short port);
+static void _dnsquery_hosts_free(GSList * hosts);
+static void _dnsquery_resolve_free(PurpleResolve * resolve);
+static void _dnsquery_resolved_free(gpointer data);
+
+/* history */
+static void _purple_history_close(Purple * purple);
+static int _purple_history_open(Purple * purple);
+static int _purple_history_page(Purple * purple,
+		PurpleModemHistory const * history);
+static ssize_t _purple_history_write(Purple * purple, PurpleLogType type,
+		PurpleMessageFlags flags, char const * number,
+		char const * sender, time_t date, char const * message);
+static void _history_compact(Purple * purple);
+static gchar * _history_filename(char const * path, unsigned int id,
+		char const * extension);
+static void _history_keys_add(Purple * purple, PurpleHistoryKey const * key);
+static void _history_keys_free(gpointer data);
+static PurpleHistoryRecord const * _history_record(unsigned char const * data,
+		size_t size, size_t offset);
+static void _history_segment_unmap(PurpleHistorySegment * segment);
+
+/* transfers */
+static void _purple_transfer_event(Purple * purple, PurpleTransfer * transfer,
+		PurpleModemTransferStatus status);
+static void _purple_transfer_free(gpointer data);
+static int _purple_transfer_open(PurpleTransfer * transfer);
+
+/* xfer */
+static void _purple_xfer_cancel(PurpleXfer * xfer);
+static void _purple_xfer_data_not_sent(PurpleXfer * xfer,
+		guchar const * buffer, gsize size);
+static void _purple_xfer_destroy(PurpleXfer * xfer);
+static void _purple_xfer_new(PurpleXfer * xfer);
+static gssize _purple_xfer_read(PurpleXfer * xfer, guchar ** buffer,
+		gssize size);
+static void _purple_xfer_update_progress(PurpleXfer * xfer, double percent);
+static gssize _purple_xfer_write(PurpleXfer * xfer, guchar const * buffer,
+		gssize size);
+
+/* eventloop */
+static guint _purple_eventloop_input_add(int fd,
+		PurpleInputCondition condition, PurpleInputFunction function,
+		gpointer data);
+static int _purple_eventloop_input_get_error(int fd, int * error);
+static gboolean _purple_eventloop_input_remove(guint handle);
+static guint _purple_eventloop_timeout_add(guint interval,
+		GSourceFunc function, gpointer data);
+static guint _purple_eventloop_timeout_add_seconds(guint interval,
+		GSourceFunc function, gpointer data);
+static gboolean _purple_eventloop_timeout_remove(guint handle);
+
 /* callbacks */
+static void _purple_on_blist_node_aliased(PurpleBlistNode * node,
+		char const * alias, gpointer data);
+static void _purple_on_buddy_added(PurpleBuddy * buddy, gpointer data);
+static void _purple_on_buddy_changed(PurpleBuddy * buddy, gpointer data);
+static void _purple_on_buddy_idle_changed(PurpleBuddy * buddy,
+		gboolean previous, gboolean idle, gpointer data);
+static void _purple_on_buddy_removed(PurpleBuddy * buddy, gpointer data);
+static void _purple_on_buddy_status_changed(PurpleBuddy * buddy,
+		PurpleStatus * previous, PurpleStatus * status, gpointer data);
+static void _purple_on_connection_error(PurpleConnection * gc,
+		PurpleConnectionError reason, char const * description,
+		gpointer data);
+static void _purple_on_deleting_conversation(PurpleConversation * conv,
+		gpointer data);
+static gboolean _purple_on_entries(gpointer data);
+static void _purple_on_file_recv_request(PurpleXfer * xfer, gpointer data);
+static void _purple_on_file_send_start(PurpleXfer * xfer, gpointer data);
+static gboolean _purple_on_history_compacted(gpointer data);
+static gboolean _purple_on_init(gpointer data);
+static gboolean _purple_on_login(gpointer data);
+static gboolean _purple_on_login_retry(gpointer data);
+static gboolean _purple_on_messages(gpointer data);
+static gboolean _purple_on_resolved(gpointer data);
+static void _purple_on_received_chat_msg(PurpleAccount * account,
+		char * sender, char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data);
+static void _purple_on_received_im_msg(PurpleAccount * account,
+		char * sender, char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data);
+static void _purple_on_signed_off(PurpleConnection * gc, gpointer data);
+static void _purple_on_signed_on(PurpleConnection * gc, gpointer data);
 static void _purple_on_ui_init(void);
 static void _purple_on_ui_prefs_init(void);
+static void _purple_on_wrote_msg(PurpleAccount * account, char const * who,
+		char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data);
 
 
 /* public */
@@ -87,8 +465,6 @@ ModemPluginDefinition plugin =
 static ModemPlugin * _purple_init(ModemPluginHelper * helper)
 {
 	Purple * purple;
-	char const * homedir;
-	char * p;
 
 	if((purple = object_new(sizeof(*purple))) == NULL)
 		return NULL;
@@ -96,64 +472,162 @@ static ModemPlugin * _purple_init(ModemPluginHelper * helper)
 	purple->helper = helper;
 	purple->ops_ui.ui_prefs_init = _purple_on_ui_prefs_init;
 	purple->ops_ui.ui_init = _purple_on_ui_init;
-	if((homedir = getenv("HOME")) == NULL)
-		homedir = g_get_home_dir();
-	p = g_build_filename(homedir, ".purple", NULL);
-	purple_util_set_user_dir(p);
-	g_free(p);
-	purple_debug_set_enabled(FALSE);
-	purple_core_set_ui_ops(&purple->ops_ui);
-	purple_eventloop_set_ui_ops(&purple->ops_glib);
-	p = g_build_filename(purple_user_dir(), "plugins", NULL);
-	purple_plugins_add_search_path(p);
-	g_free(p);
-	purple_plugins_add_search_path(LIBDIR);
-	if(purple_core_init("phone") == 0)
-	{
-		_purple_destroy(purple);
-		return NULL;
-	}
-	purple_set_blist(purple_blist_new());
-	purple_blist_load();
-	purple_prefs_load();
-	purple_plugins_load_saved("/phone/plugins/loaded");
-	purple_pounces_load();
+	purple->ops_glib.timeout_add = _purple_eventloop_timeout_add;
+	purple->ops_glib.timeout_remove = _purple_eventloop_timeout_remove;
+	purple->ops_glib.input_add = _purple_eventloop_input_add;
+	purple->ops_glib.input_remove = _purple_eventloop_input_remove;
+	purple->ops_glib.input_get_error = _purple_eventloop_input_get_error;
+	purple->ops_glib.timeout_add_seconds
+		= _purple_eventloop_timeout_add_seconds;
+	purple->ops_dns.resolve_host = _purple_dnsquery_resolve_host;
+	purple->ops_dns.destroy = _purple_dnsquery_destroy;
+	purple->ops_xfer.new_xfer = _purple_xfer_new;
+	purple->ops_xfer.destroy = _purple_xfer_destroy;
+	purple->ops_xfer.update_progress = _purple_xfer_update_progress;
+	purple->ops_xfer.cancel_local = _purple_xfer_cancel;
+	purple->ops_xfer.cancel_remote = _purple_xfer_cancel;
+	purple->ops_xfer.ui_write = _purple_xfer_write;
+	purple->ops_xfer.ui_read = _purple_xfer_read;
+	purple->ops_xfer.data_not_sent = _purple_xfer_data_not_sent;
+	purple->step = PURPLE_INIT_STEP_CORE;
+	purple->source = 0;
+	purple->plugins_skipped = 0;
+	purple->plugins_saved = 0;
+	purple->logins = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, _purple_login_free);
+	purple->logins_queue = g_queue_new();
+	purple->logins_active = 0;
+	purple->logins_source = 0;
+	purple->conversations = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+	purple->sending = FALSE;
+	purple->sending_failed = FALSE;
+	purple->messages = g_queue_new();
+	purple->messages_source = 0;
+	purple->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, _purple_entry_free);
+	purple->entries_id = 0;
+	purple->entries_queue = NULL;
+	purple->generation = 0;
+	purple->entries_source = 0;
+	purple->entries_interval = 0;
+	purple->entries_force = FALSE;
+	purple->resolver = NULL;
+	g_mutex_init(&purple->results_mutex);
+	purple->results = g_queue_new();
+	purple->results_source = 0;
+	purple->resolves = g_hash_table_new(g_direct_hash, g_direct_equal);
+	purple->resolved = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, _dnsquery_resolved_free);
+	purple->transfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, _purple_transfer_free);
+	purple->transfers_id = 0;
+	purple->history = NULL;
+	purple->segments = NULL;
+	purple->segments_cnt = 0;
+	purple->compaction = NULL;
+	purple->history_fd = -1;
+	purple->history_id = 0;
+	purple->history_size = 0;
+	purple->history_keys = NULL;
+	_purple = purple;
 	return purple;
 }
 
 
 /* purple_destroy */
+static void _destroy_resolves_foreach(gpointer key, gpointer value,
+		gpointer data);
+
 static void _purple_destroy(ModemPlugin * modem)
 {
 	Purple * purple = modem;
+	PurpleResolve * resolve;
 
 	_purple_stop(modem);
+	if(purple->step > PURPLE_INIT_STEP_CORE)
+		purple_signals_disconnect_by_handle(purple);
+	g_queue_free(purple->messages);
+	g_hash_table_destroy(purple->entries);
+	/* cancel the pending resolutions, and wait for the workers */
+	g_hash_table_foreach(purple->resolves, _destroy_resolves_foreach,
+			NULL);
+	g_hash_table_destroy(purple->resolves);
+	if(purple->resolver != NULL)
+		g_thread_pool_free(purple->resolver, FALSE, TRUE);
+	/* no worker is left: release the results not delivered yet */
+	if(purple->results_source != 0)
+		g_source_remove(purple->results_source);
+	while((resolve = g_queue_pop_head(purple->results)) != NULL)
+		_dnsquery_resolve_free(resolve);
+	g_queue_free(purple->results);
+	g_mutex_clear(&purple->results_mutex);
+	g_hash_table_destroy(purple->resolved);
+	g_hash_table_destroy(purple->transfers);
+	_purple_history_close(purple);
+	_purple = NULL;
+	g_hash_table_destroy(purple->conversations);
+	g_queue_free(purple->logins_queue);
+	g_hash_table_destroy(purple->logins);
 	object_delete(purple);
 }
 
 
+static void _destroy_resolves_foreach(gpointer key, gpointer value,
+		gpointer data)
+{
+	PurpleResolve * resolve = value;
+	(void) key;
+	(void) data;
+
+	g_atomic_int_set(&resolve->cancelled, 1);
+}
+
+
 /* purple_start */
+static int _start_protocols(Purple * purple);
+
 static int _purple_start(ModemPlugin * modem, unsigned int retry)
 {
 	Purple * purple = modem;
-	PurplePlugin * plugin;
-	PurplePluginInfo * info;
-	GList * list;
 
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s()\n", __func__);
 #endif
-	list = purple_plugins_get_protocols();
-	for(; list != NULL; list = list->next)
+	if(purple->step == PURPLE_INIT_STEP_DONE)
+		return _start_protocols(purple);
+	/* initialise libpurple one step at a time when idle */
+	if(purple->source == 0)
+		purple->source = g_idle_add_full(G_PRIORITY_LOW,
+				_purple_on_init, purple, NULL);
+	return 0;
+}
+
+static int _start_protocols(Purple * purple)
+{
+	ModemPluginHelper * helper = purple->helper;
+	PurpleAccount * account;
+	GList * l;
+	size_t cnt = 0;
+
+	/* the logins are staggered from there */
+	for(l = purple_accounts_get_all(); l != NULL; l = l->next)
 	{
-		plugin = list->data;
-		info = plugin->info;
+		account = l->data;
+		if(purple_account_get_enabled(account, "phone")
+				&& _purple_login_queue(purple, account) == 0)
+			cnt++;
 	}
-	return -1;
+	if(cnt == 0)
+		return -helper->error(helper->modem, "No account enabled", 1);
+	return 0;
 }
 
 
 /* purple_stop */
+static void _stop_logins_foreach(gpointer key, gpointer value,
+		gpointer data);
+
 static int _purple_stop(ModemPlugin * modem)
 {
 	Purple * purple = modem;
@@ -161,13 +635,57 @@ static int _purple_stop(ModemPlugin * modem)
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s()\n", __func__);
 #endif
+	/* the initialisation resumes from there when started again */
+	if(purple->source != 0)
+		g_source_remove(purple->source);
+	purple->source = 0;
+	/* cancel the logins and the attempts pending */
+	if(purple->logins_source != 0)
+		g_source_remove(purple->logins_source);
+	purple->logins_source = 0;
+	g_queue_clear(purple->logins_queue);
+	g_hash_table_foreach(purple->logins, _stop_logins_foreach, NULL);
+	purple->logins_active = 0;
+	/* deliver the pending messages and contacts */
+	if(purple->messages_source != 0)
+	{
+		g_source_remove(purple->messages_source);
+		_purple_on_messages(purple);
+	}
+	if(purple->entries_source != 0)
+	{
+		g_source_remove(purple->entries_source);
+		_purple_on_entries(purple);
+	}
+	/* the configuration may have changed when started again */
+	purple->entries_interval = 0;
 	return 0;
 }
 
 
+static void _stop_logins_foreach(gpointer key, gpointer value, gpointer data)
+{
+	PurpleLogin * login = value;
+	PurpleLoginState state = login->state;
+	(void) key;
+	(void) data;
+
+	if(login->source != 0)
+		g_source_remove(login->source);
+	login->source = 0;
+	login->attempts = 0;
+	login->state = PURPLE_LOGIN_STATE_IDLE;
+	if(state == PURPLE_LOGIN_STATE_CONNECTING
+			|| state == PURPLE_LOGIN_STATE_ONLINE)
+		purple_account_disconnect(login->account);
+}
+
+
 /* purple_request */
 static int _request_call(ModemPlugin * modem, ModemRequest * request);
+static int _request_contact_list(ModemPlugin * modem);
 static int _request_message_send(ModemPlugin * modem, ModemRequest * request);
+static int _request_unsupported(ModemPlugin * modem, ModemRequest * request);
 
 static int _purple_request(ModemPlugin * modem, ModemRequest * request)
 {
@@ -175,8 +693,12 @@ static int _purple_request(ModemPlugin * modem, ModemRequest * request)
 	{
 		case MODEM_REQUEST_CALL:
 			return _request_call(modem, request);
+		case MODEM_REQUEST_CONTACT_LIST:
+			return _request_contact_list(modem);
 		case MODEM_REQUEST_MESSAGE_SEND:
 			return _request_message_send(modem, request);
+		case MODEM_REQUEST_UNSUPPORTED:
+			return _request_unsupported(modem, request);
 #ifndef DEBUG
 		default:
 			break;
@@ -186,36 +708,2531 @@ static int _purple_request(ModemPlugin * modem, ModemRequest * request)
 }
 
 static int _request_call(ModemPlugin * modem, ModemRequest * request)
+{
+	Purple * purple = modem;
+	ModemPluginHelper * helper = purple->helper;
+	PurpleConversation * conv;
+	PurpleAccount * account;
+
+	if(purple->step != PURPLE_INIT_STEP_DONE)
+		return -helper->error(helper->modem, "Not started", 1);
+	if((conv = _purple_conversation(purple, request->call.number)) != NULL)
+		account = purple_conversation_get_account(conv);
+	else
+		account = _purple_account(purple);
+	if(account == NULL || purple_prpl_initiate_media(account,
+				request->call.number, PURPLE_MEDIA_AUDIO)
+			!= TRUE)
+		return -helper->error(helper->modem, "Could not call", 1);
+	return 0;
+}
+
+static int _request_contact_list(ModemPlugin * modem)
 {
 	Purple * purple = modem;
 
-	/* FIXME implement */
-	return -1;
+	if(purple->step != PURPLE_INIT_STEP_DONE)
+		return 0;
+	_purple_entry_queue_all(purple);
+	return 0;
 }
 
 static int _request_message_send(ModemPlugin * modem, ModemRequest * request)
 {
 	Purple * purple = modem;
+	ModemPluginHelper * helper = purple->helper;
+	PurpleConversation * conv;
+	ModemEvent mevent;
+	gchar * p;
 
-	return -1;
+	if(purple->step != PURPLE_INIT_STEP_DONE)
+		return -helper->error(helper->modem, "Not started", 1);
+	if((conv = _purple_conversation(purple, request->message_send.number))
+			== NULL)
+		return -helper->error(helper->modem, "Could not send message",
+				1);
+	if(purple_conversation_get_gc(conv) == NULL)
+		return -helper->error(helper->modem, "Not connected", 1);
+	/* libpurple expects nul-terminated strings */
+	if((p = g_strndup(request->message_send.content,
+					request->message_send.length)) == NULL)
+		return -helper->error(helper->modem, "Could not send message",
+				1);
+	purple->sending = TRUE;
+	purple->sending_failed = FALSE;
+	if(purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT)
+		purple_conv_chat_send(PURPLE_CONV_CHAT(conv), p);
+	else
+		purple_conv_im_send(PURPLE_CONV_IM(conv), p);
+	purple->sending = FALSE;
+	g_free(p);
+	if(purple->sending_failed)
+		return -helper->error(helper->modem, "Could not send message",
+				1);
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_MESSAGE_SENT;
+	helper->event(helper->modem, &mevent);
+	return 0;
 }
 
 
-/* callbacks */
-/* purple_on_ui_init */
-static void _purple_on_ui_init(void)
+static int _unsupported_transfer_accept(Purple * purple,
+		PurpleModemTransfer const * transfer);
+static int _unsupported_transfer_cancel(Purple * purple,
+		PurpleModemTransfer const * transfer);
+static int _unsupported_transfer_send(Purple * purple,
+		PurpleModemTransfer const * transfer);
+
+static int _request_unsupported(ModemPlugin * modem, ModemRequest * request)
 {
-#ifdef DEBUG
-	fprintf(stderr, "DEBUG: %s()\n", __func__);
-#endif
+	Purple * purple = modem;
+
+	if(request->unsupported.modem != NULL
+			&& strcmp(request->unsupported.modem, plugin.name) != 0)
+		return 0;
+	switch(request->unsupported.request)
+	{
+		case PURPLE_MODEM_REQUEST_HISTORY:
+			return _purple_history_page(purple,
+					request->unsupported.arg);
+		case PURPLE_MODEM_REQUEST_TRANSFER_ACCEPT:
+			return _unsupported_transfer_accept(purple,
+					request->unsupported.arg);
+		case PURPLE_MODEM_REQUEST_TRANSFER_CANCEL:
+			return _unsupported_transfer_cancel(purple,
+					request->unsupported.arg);
+		case PURPLE_MODEM_REQUEST_TRANSFER_SEND:
+			return _unsupported_transfer_send(purple,
+					request->unsupported.arg);
+	}
+	return 0;
 }
 
+static int _unsupported_transfer_accept(Purple * purple,
+		PurpleModemTransfer const * transfer)
+{
+	ModemPluginHelper * helper = purple->helper;
+	PurpleTransfer * t;
+	gchar * filename;
 
-/* purple_on_ui_prefs_init */
-static void _purple_on_ui_prefs_init(void)
+	if(transfer == NULL || (t = g_hash_table_lookup(purple->transfers,
+					GUINT_TO_POINTER(transfer->id))) == NULL
+			|| purple_xfer_get_type(t->xfer) != PURPLE_XFER_RECEIVE)
+		return -helper->error(helper->modem, "Unknown transfer", 1);
+	if(transfer->filename != NULL)
+		filename = g_strdup(transfer->filename);
+	else
+		/* default to the home directory */
+		filename = g_build_filename(g_get_home_dir(),
+				purple_xfer_get_filename(t->xfer), NULL);
+	/* fail at once if the file cannot be stored */
+	purple_xfer_set_local_filename(t->xfer, filename);
+	if(_purple_transfer_open(t) != 0)
+	{
+		g_free(filename);
+		purple_xfer_request_denied(t->xfer);
+		return -helper->error(helper->modem, "Could not store the file",
+				1);
+	}
+	purple_xfer_request_accepted(t->xfer, filename);
+	g_free(filename);
+	/* libpurple waits for the UI as it reads and writes the file */
+	purple_xfer_ui_ready(t->xfer);
+	return 0;
+}
+
+static int _unsupported_transfer_cancel(Purple * purple,
+		PurpleModemTransfer const * transfer)
+{
+	ModemPluginHelper * helper = purple->helper;
+	PurpleTransfer * t;
+
+	if(transfer == NULL || (t = g_hash_table_lookup(purple->transfers,
+					GUINT_TO_POINTER(transfer->id))) == NULL)
+		return -helper->error(helper->modem, "Unknown transfer", 1);
+	switch(purple_xfer_get_status(t->xfer))
+	{
+		case PURPLE_XFER_STATUS_UNKNOWN:
+		case PURPLE_XFER_STATUS_NOT_STARTED:
+			purple_xfer_request_denied(t->xfer);
+			break;
+		default:
+			purple_xfer_cancel_local(t->xfer);
+			break;
+	}
+	return 0;
+}
+
+static int _unsupported_transfer_send(Purple * purple,
+		PurpleModemTransfer const * transfer)
+{
+	ModemPluginHelper * helper = purple->helper;
+	PurpleAccount * account;
+	PurpleConnection * gc;
+
+	if(transfer == NULL || transfer->number == NULL
+			|| transfer->filename == NULL)
+		return -helper->error(helper->modem, "Invalid request", 1);
+	if(purple->step != PURPLE_INIT_STEP_DONE)
+		return -helper->error(helper->modem, "Not started", 1);
+	if((account = _purple_account(purple)) == NULL
+			|| (gc = purple_account_get_connection(account))
+			== NULL)
+		return -helper->error(helper->modem, "Not connected", 1);
+	serv_send_file(gc, transfer->number, transfer->filename);
+	return 0;
+}
+
+
+/* useful */
+/* purple_account */
+static PurpleAccount * _purple_account(Purple * purple)
+{
+	ModemPluginHelper * helper = purple->helper;
+	PurpleAccount * account = NULL;
+	char const * username;
+	GList * list;
+
+	if((username = helper->config_get(helper->modem, "username")) != NULL
+			&& username[0] != '\0')
+		return purple_accounts_find(username, NULL);
+	/* default to the first active account */
+	if((list = purple_accounts_get_all_active()) != NULL)
+		account = list->data;
+	g_list_free(list);
+	return account;
+}
+
+
+/* purple_conversation */
+static PurpleConversation * _purple_conversation(Purple * purple,
+		char const * number)
+{
+	PurpleConversation * conv;
+	PurpleAccount * account;
+
+	if((conv = g_hash_table_lookup(purple->conversations, number)) != NULL)
+		return conv;
+	if((account = _purple_account(purple)) == NULL)
+		return NULL;
+	if((conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM,
+					number, account)) == NULL
+			&& (conv = purple_conversation_new(PURPLE_CONV_TYPE_IM,
+					account, number)) == NULL)
+		return NULL;
+	g_hash_table_insert(purple->conversations, g_strdup(number), conv);
+	return conv;
+}
+
+
+/* purple_entry_free */
+static void _purple_entry_free(gpointer data)
+{
+	PurpleEntry * entry = data;
+
+	g_free(entry->name);
+	object_delete(entry);
+}
+
+
+/* purple_entry_interval */
+static unsigned int _purple_entry_interval(Purple * purple)
+{
+	ModemPluginHelper * helper = purple->helper;
+	char const * p;
+	unsigned long interval;
+
+	if(purple->entries_interval == 0)
+	{
+		if((p = helper->config_get(helper->modem, "presence_interval"))
+				== NULL || p[0] == '\0')
+			interval = PURPLE_PRESENCE_INTERVAL;
+		else
+			interval = strtoul(p, NULL, 10);
+		/* 0 means once per main loop iteration */
+		purple->entries_interval = interval + 1;
+	}
+	return purple->entries_interval - 1;
+}
+
+
+/* purple_entry_queue */
+static void _purple_entry_queue(Purple * purple, PurpleBuddy * buddy)
+{
+	PurpleEntry * entry;
+	unsigned int interval;
+
+	/* the whole list is queued once loaded */
+	if(purple->step != PURPLE_INIT_STEP_DONE)
+		return;
+	if((entry = g_hash_table_lookup(purple->entries, buddy)) == NULL)
+	{
+		if((entry = object_new(sizeof(*entry))) == NULL)
+			return;
+		entry->id = ++purple->entries_id;
+		entry->buddy = buddy;
+		entry->generation = 0;
+		entry->sent = FALSE;
+		entry->status = MODEM_CONTACT_STATUS_OFFLINE;
+		entry->name = NULL;
+		g_hash_table_insert(purple->entries, buddy, entry);
+	}
+	/* queue every entry at most once per synchronisation */
+	if(entry->generation == purple->generation + 1)
+		return;
+	entry->generation = purple->generation + 1;
+	purple->entries_queue = g_list_prepend(purple->entries_queue, entry);
+	if(purple->entries_source != 0)
+		return;
+	/* coalesce the changes, as they come in bursts when signing on */
+	if((interval = _purple_entry_interval(purple)) == 0)
+		purple->entries_source = g_idle_add(_purple_on_entries, purple);
+	else
+		purple->entries_source = g_timeout_add(interval,
+				_purple_on_entries, purple);
+}
+
+
+/* purple_entry_queue_all */
+static void _purple_entry_queue_all(Purple * purple)
+{
+	GSList * buddies;
+	GSList * l;
+
+	purple->entries_force = TRUE;
+	buddies = purple_blist_get_buddies();
+	for(l = buddies; l != NULL; l = l->next)
+		_purple_entry_queue(purple, l->data);
+	g_slist_free(buddies);
+}
+
+
+/* purple_message_queue */
+static void _purple_message_queue(Purple * purple, char const * number,
+		char const * message)
+{
+	PurpleMessage * m;
+
+	if((m = object_new(sizeof(*m))) == NULL)
+		return;
+	m->number = g_strdup(number);
+	m->date = time(NULL);
+	if((m->content = purple_markup_strip_html(message)) == NULL)
+		m->content = g_strdup(message);
+	g_queue_push_tail(purple->messages, m);
+	if(purple->messages_source == 0)
+		purple->messages_source = g_idle_add(_purple_on_messages,
+				purple);
+}
+
+
+/* plugins */
+/* purple_plugins_probe */
+static void _probe_directory(Purple * purple, Config * manifest,
+		Config * updated, GHashTable * needed, GList * extensions,
+		char const * directory);
+static int _probe_extension(char const * name, GList * extensions);
+static GList * _probe_extensions(void);
+
+static int _purple_plugins_probe(Purple * purple)
 {
+	Config * manifest;
+	Config * updated;
+	GHashTable * needed;
+	GList * extensions;
+	GList * l;
+	gchar * filename;
+	gchar * p;
+	int ret;
+
+	if((manifest = config_new()) == NULL)
+		return -1;
+	if((updated = config_new()) == NULL)
+	{
+		config_delete(manifest);
+		return -1;
+	}
+	filename = g_build_filename(purple_user_dir(), PURPLE_PLUGINS_MANIFEST,
+			NULL);
+	/* the manifest may not exist yet */
+	config_load(manifest, filename);
+	/* only the protocols of the accounts are needed */
+	needed = g_hash_table_new(g_str_hash, g_str_equal);
+	for(l = purple_accounts_get_all(); l != NULL; l = l->next)
+		if((p = (gchar *)purple_account_get_protocol_id(l->data))
+				!= NULL)
+			g_hash_table_insert(needed, p, p);
+	p = g_build_filename(purple_user_dir(), "plugins", NULL);
+	_probe_directory(purple, manifest, updated, needed, NULL, p);
+	_probe_directory(purple, manifest, updated, needed, NULL, LIBDIR);
+	/* then the scripts, once their loaders are known */
+	if((extensions = _probe_extensions()) != NULL)
+	{
+		_probe_directory(purple, manifest, updated, needed, extensions,
+				p);
+		_probe_directory(purple, manifest, updated, needed, extensions,
+				LIBDIR);
+		g_list_free(extensions);
+	}
+	purple_plugins_add_search_path(p);
+	g_free(p);
+	purple_plugins_add_search_path(LIBDIR);
+	g_hash_table_destroy(needed);
+	/* only keep the plug-ins still found */
+	ret = config_save(updated, filename);
+	g_free(filename);
+	config_delete(updated);
+	config_delete(manifest);
 #ifdef DEBUG
-	fprintf(stderr, "DEBUG: %s()\n", __func__);
+	fprintf(stderr, "DEBUG: %s() %u plug-ins skipped, %lu us saved\n",
+			__func__, purple->plugins_skipped,
+			(unsigned long)purple->plugins_saved);
 #endif
-	purple_prefs_add_path_list("/phone/plugins/loaded", NULL);
+	return ret;
+}
+
+static void _probe_directory(Purple * purple, Config * manifest,
+		Config * updated, GHashTable * needed, GList * extensions,
+		char const * directory)
+{
+	GDir * dir;
+	char const * name;
+	gchar * path;
+	struct stat st;
+	char mtime[32];
+	char size[32];
+	char probe[32];
+	char const * id;
+	char const * type;
+	char const * p;
+	PurplePlugin * plugin;
+	gint64 t;
+
+	if((dir = g_dir_open(directory, 0, NULL)) == NULL)
+		return;
+	while((name = g_dir_read_name(dir)) != NULL)
+	{
+		if(!_probe_extension(name, extensions))
+			continue;
+		path = g_build_filename(directory, name, NULL);
+		if(stat(path, &st) != 0)
+		{
+			g_free(path);
+			continue;
+		}
+		snprintf(mtime, sizeof(mtime), "%lld", (long long)st.st_mtime);
+		snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+		/* skip the plug-ins known and not needed */
+		if((p = config_get(manifest, path, "mtime")) != NULL
+				&& strcmp(p, mtime) == 0
+				&& (p = config_get(manifest, path, "size"))
+				!= NULL && strcmp(p, size) == 0
+				&& (id = config_get(manifest, path, "id"))
+				!= NULL
+				&& (type = config_get(manifest, path, "type"))
+				!= NULL
+				&& (p = config_get(manifest, path, "probe"))
+				!= NULL
+				&& strcmp(type, "loader") != 0
+				&& (strcmp(type, "protocol") != 0
+					|| g_hash_table_lookup(needed, id)
+					== NULL))
+		{
+			config_set(updated, path, "mtime", mtime);
+			config_set(updated, path, "size", size);
+			config_set(updated, path, "id", id);
+			config_set(updated, path, "type", type);
+			config_set(updated, path, "probe", p);
+			purple->plugins_skipped++;
+			purple->plugins_saved += strtoll(p, NULL, 10);
+			g_free(path);
+			continue;
+		}
+		t = g_get_monotonic_time();
+		plugin = purple_plugin_probe(path);
+		snprintf(probe, sizeof(probe), "%lld", (long long)(
+					g_get_monotonic_time() - t));
+		id = "";
+		type = "";
+		if(plugin != NULL && plugin->info != NULL)
+		{
+			if(plugin->info->id != NULL)
+				id = plugin->info->id;
+			switch(plugin->info->type)
+			{
+				case PURPLE_PLUGIN_PROTOCOL:
+					type = "protocol";
+					break;
+				case PURPLE_PLUGIN_LOADER:
+					type = "loader";
+					break;
+				case PURPLE_PLUGIN_STANDARD:
+					type = "standard";
+					break;
+				default:
+					break;
+			}
+		}
+		config_set(updated, path, "mtime", mtime);
+		config_set(updated, path, "size", size);
+		config_set(updated, path, "id", id);
+		config_set(updated, path, "type", type);
+		config_set(updated, path, "probe", probe);
+		g_free(path);
+	}
+	g_dir_close(dir);
+}
+
+static int _probe_extension(char const * name, GList * extensions)
+{
+	char const * p;
+
+	/* the modules themselves by default */
+	if(extensions == NULL)
+		return g_str_has_suffix(name, "." G_MODULE_SUFFIX);
+	if((p = strrchr(name, '.')) == NULL)
+		return 0;
+	for(; extensions != NULL; extensions = extensions->next)
+		if(strcmp(p + 1, extensions->data) == 0)
+			return 1;
+	return 0;
+}
+
+static GList * _probe_extensions(void)
+{
+	GList * ret = NULL;
+	GList * l;
+	GList * e;
+	PurplePlugin * plugin;
+
+	/* the extensions of the scripts handled by the loaders */
+	for(l = purple_plugins_get_all(); l != NULL; l = l->next)
+	{
+		plugin = l->data;
+		if(plugin->info == NULL
+				|| plugin->info->type != PURPLE_PLUGIN_LOADER
+				|| !purple_plugin_is_loaded(plugin))
+			continue;
+		for(e = PURPLE_PLUGIN_LOADER_INFO(plugin)->exts; e != NULL;
+				e = e->next)
+			ret = g_list_prepend(ret, e->data);
+	}
+	return ret;
+}
+
+
+/* logins */
+/* purple_login_free */
+static void _purple_login_free(gpointer data)
+{
+	PurpleLogin * login = data;
+
+	if(login->source != 0)
+		g_source_remove(login->source);
+	object_delete(login);
+}
+
+
+/* purple_login_queue */
+static int _purple_login_queue(Purple * purple, PurpleAccount * account)
+{
+	PurpleLogin * login;
+
+	if((login = g_hash_table_lookup(purple->logins, account)) == NULL)
+	{
+		if((login = object_new(sizeof(*login))) == NULL)
+			return -1;
+		login->purple = purple;
+		login->account = account;
+		login->state = PURPLE_LOGIN_STATE_IDLE;
+		login->attempts = 0;
+		login->source = 0;
+		g_hash_table_insert(purple->logins, account, login);
+	}
+	/* already queued, connecting or waiting to try again */
+	if(login->state != PURPLE_LOGIN_STATE_IDLE || login->source != 0)
+		return 0;
+	login->state = PURPLE_LOGIN_STATE_QUEUED;
+	g_queue_push_tail(purple->logins_queue, login);
+	_purple_login_schedule(purple);
+	return 0;
+}
+
+
+/* purple_login_schedule */
+static void _purple_login_schedule(Purple * purple)
+{
+	if(purple->logins_source != 0
+			|| g_queue_is_empty(purple->logins_queue)
+			|| purple->logins_active >= PURPLE_LOGIN_CONCURRENT)
+		return;
+	/* the first login is not delayed */
+	purple->logins_source = g_timeout_add((purple->logins_active == 0)
+			? 0 : PURPLE_LOGIN_STAGGER, _purple_on_login, purple);
+}
+
+
+/* dnsquery */
+/* purple_dnsquery_destroy */
+static void _purple_dnsquery_destroy(PurpleDnsQueryData * query)
+{
+	Purple * purple = _purple;
+	PurpleResolve * resolve;
+
+	/* the callbacks must not be called anymore */
+	if(purple == NULL || (resolve = g_hash_table_lookup(purple->resolves,
+					query)) == NULL)
+		return;
+	g_atomic_int_set(&resolve->cancelled, 1);
+	g_hash_table_remove(purple->resolves, query);
+}
+
+
+/* purple_dnsquery_resolve_host */
+static void _dnsquery_thread(gpointer data, gpointer user);
+
+static gboolean _purple_dnsquery_resolve_host(PurpleDnsQueryData * query,
+		PurpleDnsQueryResolvedCallback resolved,
+		PurpleDnsQueryFailedCallback failed)
+{
+	Purple * purple = _purple;
+	PurpleResolve * resolve;
+	PurpleResolved * cached;
+
+	if(purple == NULL)
+		return FALSE;
+	if(purple->resolver == NULL && (purple->resolver = g_thread_pool_new(
+					_dnsquery_thread, purple,
+					PURPLE_DNS_THREADS, FALSE, NULL))
+			== NULL)
+		return FALSE;
+	if((resolve = object_new(sizeof(*resolve))) == NULL)
+		return FALSE;
+	resolve->query = query;
+	resolve->resolved = resolved;
+	resolve->failed = failed;
+	resolve->host = g_strdup(purple_dnsquery_get_host(query));
+	resolve->port = purple_dnsquery_get_port(query);
+	resolve->cancelled = 0;
+	resolve->error = 0;
+	resolve->hosts = NULL;
+	g_hash_table_insert(purple->resolves, query, resolve);
+	/* the results are always delivered from the main loop */
+	if((cached = g_hash_table_lookup(purple->resolved, resolve->host))
+			!= NULL && cached->expires > g_get_monotonic_time())
+	{
+		resolve->hosts = _dnsquery_hosts_copy(cached->hosts,
+				resolve->port);
+		_dnsquery_deliver(purple, resolve);
+	}
+	else if(g_thread_pool_push(purple->resolver, resolve, NULL) != TRUE)
+	{
+		g_hash_table_remove(purple->resolves, query);
+		_dnsquery_resolve_free(resolve);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void _dnsquery_thread(gpointer data, gpointer user)
+{
+	Purple * purple = user;
+	PurpleResolve * resolve = data;
+	struct addrinfo hints;
+	struct addrinfo * res;
+	struct addrinfo * ai;
+	struct sockaddr * sa;
+	char port[6];
+
+	if(g_atomic_int_get(&resolve->cancelled) == 0)
+	{
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_ADDRCONFIG;
+		snprintf(port, sizeof(port), "%u", resolve->port);
+		if((resolve->error = getaddrinfo(resolve->host, port, &hints,
+						&res)) == 0)
+		{
+			for(ai = res; ai != NULL; ai = ai->ai_next)
+			{
+				if((sa = g_malloc(ai->ai_addrlen)) == NULL)
+					continue;
+				memcpy(sa, ai->ai_addr, ai->ai_addrlen);
+				resolve->hosts = g_slist_prepend(resolve->hosts,
+						GINT_TO_POINTER(ai->ai_addrlen));
+				resolve->hosts = g_slist_prepend(resolve->hosts,
+						sa);
+			}
+			freeaddrinfo(res);
+			/* the length comes first */
+			resolve->hosts = g_slist_reverse(resolve->hosts);
+		}
+	}
+	_dnsquery_deliver(purple, resolve);
+}
+
+
+/* dnsquery_deliver */
+static void _dnsquery_deliver(Purple * purple, PurpleResolve * resolve)
+{
+	/* called from the workers as well: the source is tracked for destroy */
+	g_mutex_lock(&purple->results_mutex);
+	g_queue_push_tail(purple->results, resolve);
+	if(purple->results_source == 0)
+		purple->results_source = g_idle_add(_purple_on_resolved,
+				purple);
+	g_mutex_unlock(&purple->results_mutex);
+}
+
+
+/* dnsquery_hosts_copy */
+static GSList * _dnsquery_hosts_copy(GSList * hosts, unsigned short port)
+{
+	GSList * ret = NULL;
+	size_t len;
+	struct sockaddr * sa;
+
+	for(; hosts != NULL && hosts->next != NULL;
+			hosts = hosts->next->next)
+	{
+		len = GPOINTER_TO_INT(hosts->data);
+		if((sa = g_malloc(len)) == NULL)
+			continue;
+		memcpy(sa, hosts->next->data, len);
+		if(sa->sa_family == AF_INET)
+			((struct sockaddr_in *)sa)->sin_port = htons(port);
+		else if(sa->sa_family == AF_INET6)
+			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+		ret = g_slist_prepend(ret, GINT_TO_POINTER(len));
+		ret = g_slist_prepend(ret, sa);
+	}
+	/* the length comes first */
+	return g_slist_reverse(ret);
+}
+
+
+/* dnsquery_hosts_free */
+static void _dnsquery_hosts_free(GSList * hosts)
+{
+	GSList * l;
+
+	for(l = hosts; l != NULL && l->next != NULL; l = l->next->next)
+		g_free(l->next->data);
+	g_slist_free(hosts);
+}
+
+
+/* dnsquery_resolve_free */
+static void _dnsquery_resolve_free(PurpleResolve * resolve)
+{
+	_dnsquery_hosts_free(resolve->hosts);
+	g_free(resolve->host);
+	object_delete(resolve);
+}
+
+
+/* dnsquery_resolved_free */
+static void _dnsquery_resolved_free(gpointer data)
+{
+	PurpleResolved * resolved = data;
+
+	_dnsquery_hosts_free(resolved->hosts);
+	object_delete(resolved);
+}
+
+
+/* history */
+/* purple_history_close */
+static void _purple_history_close(Purple * purple)
+{
+	size_t i;
+
+	if(purple->compaction != NULL)
+	{
+		/* the results are discarded */
+		g_thread_join(purple->compaction->thread);
+		g_idle_remove_by_data(purple->compaction);
+		g_free(purple->compaction->ids);
+		g_free(purple->compaction->path);
+		object_delete(purple->compaction);
+	}
+	purple->compaction = NULL;
+	for(i = 0; i < purple->segments_cnt; i++)
+		_history_segment_unmap(&purple->segments[i]);
+	free(purple->segments);
+	purple->segments = NULL;
+	purple->segments_cnt = 0;
+	if(purple->history_fd >= 0)
+		close(purple->history_fd);
+	purple->history_fd = -1;
+	if(purple->history_keys != NULL)
+		g_hash_table_destroy(purple->history_keys);
+	purple->history_keys = NULL;
+	g_free(purple->history);
+	purple->history = NULL;
+}
+
+
+/* purple_history_open */
+static int _history_active_open(Purple * purple, unsigned int id);
+static int _history_compare_ids(void const * a, void const * b);
+static int _history_seal(Purple * purple);
+static int _history_segment_add(Purple * purple, unsigned int id);
+static int _history_segment_map(char const * path, unsigned int id,
+		PurpleHistorySegment * segment);
+
+static int _purple_history_open(Purple * purple)
+{
+	GDir * dir;
+	char const * name;
+	unsigned int id;
+	char ext[4];
+	GArray * ids;
+	guint i;
+
+	purple->history = g_build_filename(purple_user_dir(), "logs", "phone",
+			NULL);
+	purple->history_keys = g_hash_table_new_full(g_direct_hash,
+			g_direct_equal, NULL, _history_keys_free);
+	if(g_mkdir_with_parents(purple->history, 0700) != 0
+			|| (dir = g_dir_open(purple->history, 0, NULL))
+			== NULL)
+		return -1;
+	ids = g_array_new(FALSE, FALSE, sizeof(id));
+	while((name = g_dir_read_name(dir)) != NULL)
+		if(strlen(name) == 12 && sscanf(name, "%8x.%3s", &id, ext) == 2
+				&& strcmp(ext, "log") == 0)
+			g_array_append_val(ids, id);
+	g_dir_close(dir);
+	qsort(ids->data, ids->len, sizeof(id), _history_compare_ids);
+	for(i = 0; i < ids->len; i++)
+	{
+		id = g_array_index(ids, unsigned int, i);
+		purple->history_id = id + 1;
+		if(_history_segment_add(purple, id) == 0)
+			continue;
+		/* the index is missing or stale, rebuild it */
+		if(_history_active_open(purple, id) == 0 && i + 1 < ids->len)
+			_history_seal(purple);
+	}
+	g_array_free(ids, TRUE);
+	return 0;
+}
+
+static int _history_compare_ids(void const * a, void const * b)
+{
+	unsigned int const * ia = a;
+	unsigned int const * ib = b;
+
+	return (*ia < *ib) ? -1 : ((*ia > *ib) ? 1 : 0);
+}
+
+
+/* purple_history_page */
+static size_t _history_page_keys(PurpleHistoryKey const * keys, size_t cnt,
+		unsigned char const * data, size_t size, uint32_t hash,
+		char const * number, int64_t before,
+		PurpleHistoryRecord const ** records, size_t count);
+
+static int _purple_history_page(Purple * purple,
+		PurpleModemHistory const * history)
+{
+	ModemPluginHelper * helper = purple->helper;
+	ModemEvent mevent;
+	PurpleHistoryRecord const ** records;
+	PurpleHistoryRecord const * record;
+	PurpleHistorySegment * segment;
+	GArray * keys;
+	unsigned char * active = MAP_FAILED;
+	uint32_t hash;
+	int64_t before;
+	char const * p;
+	gchar * q;
+	size_t n = 0;
+	size_t i;
+
+	if(history == NULL || history->number == NULL || history->count == 0)
+		return -helper->error(helper->modem, "Invalid request", 1);
+	if(purple->history == NULL)
+		return -helper->error(helper->modem, "Not started", 1);
+	if((records = g_try_malloc(sizeof(*records) * history->count)) == NULL)
+		return -helper->error(helper->modem, "Out of memory", 1);
+	hash = g_str_hash(history->number);
+	before = (history->before != 0) ? history->before : INT64_MAX;
+	/* from the most recent segment to the oldest */
+	if(purple->history_fd >= 0 && (keys = g_hash_table_lookup(
+					purple->history_keys,
+					GUINT_TO_POINTER(hash))) != NULL
+			&& (active = mmap(NULL, purple->history_size, PROT_READ,
+					MAP_SHARED, purple->history_fd, 0))
+			!= MAP_FAILED)
+		n = _history_page_keys((PurpleHistoryKey *)keys->data,
+				keys->len, active, purple->history_size, hash,
+				history->number, before, records,
+				history->count);
+	for(i = purple->segments_cnt; i > 0 && n < history->count; i--)
+	{
+		segment = &purple->segments[i - 1];
+		n += _history_page_keys(segment->keys, segment->keys_cnt,
+				segment->data, segment->size, hash,
+				history->number, before, &records[n],
+				history->count - n);
+	}
+	/* in chronological order */
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_MESSAGE;
+	mevent.message.status = MODEM_MESSAGE_STATUS_READ;
+	mevent.message.encoding = MODEM_MESSAGE_ENCODING_UTF8;
+	mevent.message.number = history->number;
+	for(i = n; i > 0; i--)
+	{
+		record = records[i - 1];
+		p = (char const *)(record + 1);
+		mevent.message.date = record->date;
+		mevent.message.folder = (record->flags & PURPLE_MESSAGE_SEND)
+			? MODEM_MESSAGE_FOLDER_OUTBOX
+			: MODEM_MESSAGE_FOLDER_INBOX;
+		q = NULL;
+		if(record->type == PURPLE_LOG_CHAT && record->sender > 0)
+			q = g_strdup_printf("%s: %s", &p[record->number + 1],
+					&p[record->number + record->sender
+					+ 2]);
+		mevent.message.content = (q != NULL) ? q
+			: &p[record->number + record->sender + 2];
+		mevent.message.length = strlen(mevent.message.content);
+		helper->event(helper->modem, &mevent);
+		g_free(q);
+	}
+	if(active != MAP_FAILED)
+		munmap(active, purple->history_size);
+	g_free(records);
+	return 0;
+}
+
+static size_t _history_page_keys(PurpleHistoryKey const * keys, size_t cnt,
+		unsigned char const * data, size_t size, uint32_t hash,
+		char const * number, int64_t before,
+		PurpleHistoryRecord const ** records, size_t count)
+{
+	size_t lo = 0;
+	size_t hi = cnt;
+	size_t mid;
+	size_t n = 0;
+	PurpleHistoryRecord const * record;
+
+	/* look for the first key past the messages wanted */
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(keys[mid].hash < hash || (keys[mid].hash == hash
+					&& keys[mid].date < before))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo > 0 && n < count && keys[lo - 1].hash == hash; lo--)
+		if((record = _history_record(data, size, keys[lo - 1].offset))
+				!= NULL && strcmp((char const *)(record + 1),
+					number) == 0)
+			records[n++] = record;
+	return n;
+}
+
+
+/* purple_history_write */
+static ssize_t _purple_history_write(Purple * purple, PurpleLogType type,
+		PurpleMessageFlags flags, char const * number,
+		char const * sender, time_t date, char const * message)
+{
+	PurpleHistoryRecord record;
+	PurpleHistoryKey key;
+	struct iovec iov[5];
+	static const char padding[8] = { 0 };
+	size_t len;
+	ssize_t ret;
+
+	if(purple->history == NULL)
+		return -1;
+	if(purple->history_fd < 0 && _history_active_open(purple,
+				purple->history_id++) != 0)
+		return -1;
+	if(sender == NULL)
+		sender = "";
+	record.date = date;
+	record.type = type;
+	record.flags = flags;
+	record.number = strlen(number);
+	record.sender = strlen(sender);
+	record.message = strlen(message);
+	len = sizeof(record) + record.number + record.sender + record.message
+		+ 3;
+	record.size = (len + 7) & ~7;
+	/* write the whole record at once */
+	iov[0].iov_base = &record;
+	iov[0].iov_len = sizeof(record);
+	iov[1].iov_base = (void *)number;
+	iov[1].iov_len = record.number + 1;
+	iov[2].iov_base = (void *)sender;
+	iov[2].iov_len = record.sender + 1;
+	iov[3].iov_base = (void *)message;
+	iov[3].iov_len = record.message + 1;
+	iov[4].iov_base = (void *)padding;
+	iov[4].iov_len = record.size - len;
+	if((ret = writev(purple->history_fd, iov, 5)) != (ssize_t)record.size)
+	{
+		/* drop what may have been written */
+		if(ftruncate(purple->history_fd, purple->history_size) != 0)
+		{
+			/* reopening drops the incomplete record instead */
+			close(purple->history_fd);
+			purple->history_fd = -1;
+			_history_active_open(purple, purple->history_id - 1);
+		}
+		return -1;
+	}
+	key.hash = g_str_hash(number);
+	key.offset = purple->history_size;
+	key.date = date;
+	_history_keys_add(purple, &key);
+	purple->history_size += record.size;
+	if(purple->history_size >= PURPLE_HISTORY_SEGMENT)
+		_history_seal(purple);
+	return ret;
+}
+
+
+/* history_active_open */
+static int _history_active_open(Purple * purple, unsigned int id)
+{
+	PurpleHistoryHeader header;
+	PurpleHistoryRecord const * record;
+	PurpleHistoryKey key;
+	gchar * filename;
+	struct stat st;
+	unsigned char * data;
+	size_t offset;
+
+	filename = _history_filename(purple->history, id, "log");
+	purple->history_fd = open(filename, O_RDWR | O_CREAT | O_APPEND,
+			0600);
+	g_free(filename);
+	if(purple->history_fd < 0)
+		return -1;
+	if(fstat(purple->history_fd, &st) != 0)
+	{
+		close(purple->history_fd);
+		purple->history_fd = -1;
+		return -1;
+	}
+	g_hash_table_remove_all(purple->history_keys);
+	purple->history_id = MAX(purple->history_id, id + 1);
+	if(st.st_size < (off_t)sizeof(header))
+	{
+		/* a new segment */
+		header.magic = PURPLE_HISTORY_MAGIC;
+		header.count = 0;
+		header.size = 0;
+		if(ftruncate(purple->history_fd, 0) != 0
+				|| write(purple->history_fd, &header,
+					sizeof(header)) != sizeof(header))
+		{
+			close(purple->history_fd);
+			purple->history_fd = -1;
+			return -1;
+		}
+		purple->history_size = sizeof(header);
+		return 0;
+	}
+	/* rebuild the keys of an existing segment */
+	if((data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					purple->history_fd, 0)) == MAP_FAILED)
+	{
+		close(purple->history_fd);
+		purple->history_fd = -1;
+		return -1;
+	}
+	for(offset = sizeof(header); (record = _history_record(data,
+					st.st_size, offset)) != NULL;
+			offset += record->size)
+	{
+		key.hash = g_str_hash((char const *)(record + 1));
+		key.offset = offset;
+		key.date = record->date;
+		_history_keys_add(purple, &key);
+	}
+	munmap(data, st.st_size);
+	/* drop any incomplete record */
+	if(offset < (size_t)st.st_size)
+		if(ftruncate(purple->history_fd, offset) != 0)
+			offset = st.st_size;
+	purple->history_size = offset;
+	return 0;
+}
+
+
+/* history_compact */
+static gpointer _history_compact_thread(gpointer data);
+
+static void _history_compact(Purple * purple)
+{
+	PurpleHistoryCompaction * compaction;
+	size_t i;
+	size_t j;
+
+	if(purple->compaction != NULL)
+		return;
+	/* look for the latest segments not compacted yet */
+	for(i = purple->segments_cnt; i > 0 && purple->segments[i - 1].size
+			< PURPLE_HISTORY_COMPACTED; i--);
+	if(purple->segments_cnt - i < PURPLE_HISTORY_SEGMENTS)
+		return;
+	if((compaction = object_new(sizeof(*compaction))) == NULL)
+		return;
+	compaction->purple = purple;
+	compaction->path = g_strdup(purple->history);
+	compaction->ids_cnt = purple->segments_cnt - i;
+	compaction->ids = g_new(unsigned int, compaction->ids_cnt);
+	for(j = 0; j < compaction->ids_cnt; j++)
+		compaction->ids[j] = purple->segments[i + j].id;
+	compaction->error = 0;
+	if((compaction->thread = g_thread_try_new("history",
+					_history_compact_thread, compaction,
+					NULL)) == NULL)
+	{
+		g_free(compaction->ids);
+		g_free(compaction->path);
+		object_delete(compaction);
+		return;
+	}
+	purple->compaction = compaction;
+}
+
+static int _compact_compare(void const * a, void const * b);
+static int _compact_segments(PurpleHistoryCompaction * compaction,
+		PurpleHistorySegment * segments);
+
+static gpointer _history_compact_thread(gpointer data)
+{
+	PurpleHistoryCompaction * compaction = data;
+	PurpleHistorySegment * segments;
+	size_t i;
+
+	/* the segments are mapped again, and never modified */
+	if((segments = g_try_malloc0(sizeof(*segments) * compaction->ids_cnt))
+			== NULL)
+		compaction->error = -1;
+	for(i = 0; compaction->error == 0 && i < compaction->ids_cnt; i++)
+		compaction->error = _history_segment_map(compaction->path,
+				compaction->ids[i], &segments[i]);
+	if(compaction->error == 0)
+		compaction->error = _compact_segments(compaction, segments);
+	for(i = 0; segments != NULL && i < compaction->ids_cnt; i++)
+		_history_segment_unmap(&segments[i]);
+	g_free(segments);
+	g_idle_add(_purple_on_history_compacted, compaction);
+	return NULL;
+}
+
+typedef struct _CompactKey
+{
+	PurpleHistoryKey key;
+	size_t segment;
+} CompactKey;
+
+static int _compact_compare(void const * a, void const * b)
+{
+	CompactKey const * ka = a;
+	CompactKey const * kb = b;
+
+	if(ka->key.hash != kb->key.hash)
+		return (ka->key.hash < kb->key.hash) ? -1 : 1;
+	if(ka->key.date != kb->key.date)
+		return (ka->key.date < kb->key.date) ? -1 : 1;
+	if(ka->segment != kb->segment)
+		return (ka->segment < kb->segment) ? -1 : 1;
+	return (ka->key.offset < kb->key.offset) ? -1
+		: ((ka->key.offset > kb->key.offset) ? 1 : 0);
+}
+
+static int _compact_segments(PurpleHistoryCompaction * compaction,
+		PurpleHistorySegment * segments)
+{
+	int ret = -1;
+	CompactKey * keys;
+	PurpleHistoryHeader * header;
+	PurpleHistoryKey * index;
+	PurpleHistoryRecord const * record;
+	size_t cnt = 0;
+	size_t i;
+	size_t j;
+	size_t offset;
+	gchar * filename;
+	gchar * tmp[2];
+	FILE * fp;
+
+	for(i = 0; i < compaction->ids_cnt; i++)
+		cnt += segments[i].keys_cnt;
+	if((keys = g_try_malloc(sizeof(*keys) * cnt + 1)) == NULL)
+		return -1;
+	if((header = g_try_malloc(sizeof(*header) + sizeof(*index) * cnt))
+			== NULL)
+	{
+		g_free(keys);
+		return -1;
+	}
+	index = (PurpleHistoryKey *)(header + 1);
+	for(i = 0, cnt = 0; i < compaction->ids_cnt; i++)
+		for(j = 0; j < segments[i].keys_cnt; j++)
+		{
+			keys[cnt].key = segments[i].keys[j];
+			keys[cnt++].segment = i;
+		}
+	/* group the messages by conversation */
+	qsort(keys, cnt, sizeof(*keys), _compact_compare);
+	tmp[0] = _history_filename(compaction->path, compaction->ids[0],
+			"log.tmp");
+	tmp[1] = _history_filename(compaction->path, compaction->ids[0],
+			"idx.tmp");
+	if((fp = fopen(tmp[0], "w")) != NULL)
+	{
+		header->magic = PURPLE_HISTORY_MAGIC;
+		header->count = 0;
+		header->size = 0;
+		offset = sizeof(*header);
+		if(fwrite(header, sizeof(*header), 1, fp) == 1)
+			for(i = 0; i < cnt; i++)
+			{
+				if((record = _history_record(
+								segments[keys[i].segment].data,
+								segments[keys[i].segment].size,
+								keys[i].key.offset)) == NULL)
+					continue;
+				if(fwrite(record, record->size, 1, fp) != 1)
+					break;
+				index[header->count] = keys[i].key;
+				index[header->count++].offset = offset;
+				offset += record->size;
+			}
+		header->size = offset;
+		if(fclose(fp) == 0 && i == cnt && g_file_set_contents(tmp[1],
+					(gchar *)header, sizeof(*header)
+					+ sizeof(*index) * header->count,
+					NULL) == TRUE)
+			ret = 0;
+	}
+	g_free(keys);
+	g_free(header);
+	/* replace the first segment, then remove the others */
+	filename = _history_filename(compaction->path, compaction->ids[0],
+			"log");
+	if(ret == 0 && rename(tmp[0], filename) != 0)
+		ret = -1;
+	g_free(filename);
+	filename = _history_filename(compaction->path, compaction->ids[0],
+			"idx");
+	if(ret == 0 && rename(tmp[1], filename) != 0)
+		ret = -1;
+	g_free(filename);
+	unlink(tmp[0]);
+	unlink(tmp[1]);
+	g_free(tmp[0]);
+	g_free(tmp[1]);
+	for(i = 1; ret == 0 && i < compaction->ids_cnt; i++)
+	{
+		filename = _history_filename(compaction->path,
+				compaction->ids[i], "idx");
+		unlink(filename);
+		g_free(filename);
+		filename = _history_filename(compaction->path,
+				compaction->ids[i], "log");
+		unlink(filename);
+		g_free(filename);
+	}
+	return ret;
+}
+
+
+/* history_filename */
+static gchar * _history_filename(char const * path, unsigned int id,
+		char const * extension)
+{
+	return g_strdup_printf("%s/%08x.%s", path, id, extension);
+}
+
+
+/* history_keys_add */
+static void _history_keys_add(Purple * purple, PurpleHistoryKey const * key)
+{
+	GArray * keys;
+	PurpleHistoryKey const * k;
+	guint lo;
+	guint hi;
+	guint mid;
+
+	if((keys = g_hash_table_lookup(purple->history_keys,
+					GUINT_TO_POINTER(key->hash))) == NULL)
+	{
+		keys = g_array_new(FALSE, FALSE, sizeof(*key));
+		g_hash_table_insert(purple->history_keys,
+				GUINT_TO_POINTER(key->hash), keys);
+	}
+	/* kept sorted by date, as the messages may not be logged in order */
+	k = (PurpleHistoryKey const *)keys->data;
+	for(lo = 0, hi = keys->len; lo < hi;)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(k[mid].date <= key->date)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	g_array_insert_vals(keys, lo, key, 1);
+}
+
+
+/* history_keys_free */
+static void _history_keys_free(gpointer data)
+{
+	g_array_free(data, TRUE);
+}
+
+
+/* history_record */
+static PurpleHistoryRecord const * _history_record(unsigned char const * data,
+		size_t size, size_t offset)
+{
+	PurpleHistoryRecord const * record;
+	char const * p;
+
+	if(offset % 8 != 0 || offset + sizeof(*record) > size)
+		return NULL;
+	record = (PurpleHistoryRecord const *)&data[offset];
+	if(record->size % 8 != 0 || record->size > size - offset
+			|| (uint64_t)record->number + record->sender
+			+ record->message + 3
+			> record->size - sizeof(*record))
+		return NULL;
+	p = (char const *)(record + 1);
+	if(p[record->number] != '\0'
+			|| p[record->number + record->sender + 1] != '\0'
+			|| p[record->number + record->sender + record->message
+			+ 2] != '\0')
+		return NULL;
+	return record;
+}
+
+
+/* history_seal */
+static int _seal_compare(void const * a, void const * b);
+
+static int _history_seal(Purple * purple)
+{
+	PurpleHistoryHeader * header;
+	PurpleHistoryKey * index;
+	GHashTableIter iter;
+	gpointer value;
+	GArray * keys;
+	size_t cnt = 0;
+	gchar * filename;
+	int ret;
+
+	/* write the index of the current segment */
+	g_hash_table_iter_init(&iter, purple->history_keys);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+		cnt += ((GArray *)value)->len;
+	if((header = g_try_malloc(sizeof(*header) + sizeof(*index) * cnt))
+			== NULL)
+		return -1;
+	header->magic = PURPLE_HISTORY_MAGIC;
+	header->count = 0;
+	header->size = purple->history_size;
+	index = (PurpleHistoryKey *)(header + 1);
+	g_hash_table_iter_init(&iter, purple->history_keys);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		keys = value;
+		memcpy(&index[header->count], keys->data,
+				sizeof(*index) * keys->len);
+		header->count += keys->len;
+	}
+	qsort(index, cnt, sizeof(*index), _seal_compare);
+	filename = _history_filename(purple->history, purple->history_id - 1,
+			"idx");
+	ret = (g_file_set_contents(filename, (gchar *)header, sizeof(*header)
+				+ sizeof(*index) * cnt, NULL) == TRUE) ? 0 : -1;
+	g_free(filename);
+	g_free(header);
+	if(ret != 0)
+		return -1;
+	/* the next message will start a new segment */
+	close(purple->history_fd);
+	purple->history_fd = -1;
+	g_hash_table_remove_all(purple->history_keys);
+	if((ret = _history_segment_add(purple, purple->history_id - 1)) == 0)
+		_history_compact(purple);
+	return ret;
+}
+
+static int _seal_compare(void const * a, void const * b)
+{
+	PurpleHistoryKey const * ka = a;
+	PurpleHistoryKey const * kb = b;
+
+	if(ka->hash != kb->hash)
+		return (ka->hash < kb->hash) ? -1 : 1;
+	if(ka->date != kb->date)
+		return (ka->date < kb->date) ? -1 : 1;
+	return (ka->offset < kb->offset) ? -1
+		: ((ka->offset > kb->offset) ? 1 : 0);
+}
+
+
+/* history_segment_add */
+static int _history_segment_add(Purple * purple, unsigned int id)
+{
+	PurpleHistorySegment * p;
+
+	if((p = realloc(purple->segments, sizeof(*p)
+					* (purple->segments_cnt + 1))) == NULL)
+		return -1;
+	purple->segments = p;
+	if(_history_segment_map(purple->history, id,
+				&p[purple->segments_cnt]) != 0)
+		return -1;
+	purple->segments_cnt++;
+	return 0;
+}
+
+
+/* history_segment_map */
+static void * _segment_map_file(char const * path, unsigned int id,
+		char const * extension, size_t * size);
+
+static int _history_segment_map(char const * path, unsigned int id,
+		PurpleHistorySegment * segment)
+{
+	PurpleHistoryHeader const * header;
+
+	memset(segment, 0, sizeof(*segment));
+	segment->id = id;
+	if((segment->index = _segment_map_file(path, id, "idx",
+					&segment->index_size)) == NULL)
+		return -1;
+	header = segment->index;
+	/* the index may be stale if compacting was interrupted */
+	if(header->count > (segment->index_size - sizeof(*header))
+			/ sizeof(*segment->keys)
+			|| (segment->data = _segment_map_file(path, id, "log",
+					&segment->size)) == NULL
+			|| header->size != segment->size)
+	{
+		_history_segment_unmap(segment);
+		return -1;
+	}
+	segment->keys = (PurpleHistoryKey const *)(header + 1);
+	segment->keys_cnt = header->count;
+	return 0;
+}
+
+static void * _segment_map_file(char const * path, unsigned int id,
+		char const * extension, size_t * size)
+{
+	gchar * filename;
+	int fd;
+	struct stat st;
+	void * ret;
+
+	filename = _history_filename(path, id, extension);
+	fd = open(filename, O_RDONLY);
+	g_free(filename);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(
+				PurpleHistoryHeader)
+			|| (ret = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	if(((PurpleHistoryHeader *)ret)->magic != PURPLE_HISTORY_MAGIC)
+	{
+		munmap(ret, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return ret;
+}
+
+
+/* history_segment_unmap */
+static void _history_segment_unmap(PurpleHistorySegment * segment)
+{
+	if(segment->data != NULL)
+		munmap(segment->data, segment->size);
+	segment->data = NULL;
+	if(segment->index != NULL)
+		munmap(segment->index, segment->index_size);
+	segment->index = NULL;
+	segment->keys = NULL;
+	segment->keys_cnt = 0;
+}
+
+
+/* transfers */
+/* purple_transfer_event */
+static void _purple_transfer_event(Purple * purple, PurpleTransfer * transfer,
+		PurpleModemTransferStatus status)
+{
+	ModemPluginHelper * helper = purple->helper;
+	ModemEvent mevent;
+	PurpleModemTransfer event;
+	PurpleXfer * xfer = transfer->xfer;
+
+	event.id = transfer->id;
+	event.status = status;
+	event.incoming = (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE)
+		? 1 : 0;
+	event.number = purple_xfer_get_remote_user(xfer);
+	if((event.filename = purple_xfer_get_local_filename(xfer)) == NULL)
+		event.filename = purple_xfer_get_filename(xfer);
+	event.size = purple_xfer_get_size(xfer);
+	event.done = purple_xfer_get_bytes_sent(xfer);
+	event.rate = transfer->rate;
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_UNSUPPORTED;
+	mevent.unsupported.modem = plugin.name;
+	mevent.unsupported.request = PURPLE_MODEM_REQUEST_TRANSFER;
+	mevent.unsupported.data = &event;
+	mevent.unsupported.size = sizeof(event);
+	helper->event(helper->modem, &mevent);
+}
+
+
+/* purple_transfer_free */
+static void _purple_transfer_free(gpointer data)
+{
+	PurpleTransfer * transfer = data;
+
+	transfer->xfer->ui_data = NULL;
+	if(transfer->fd >= 0)
+		close(transfer->fd);
+	g_free(transfer->partial);
+	object_delete(transfer);
+}
+
+
+/* purple_transfer_open */
+static int _purple_transfer_open(PurpleTransfer * transfer)
+{
+	PurpleXfer * xfer = transfer->xfer;
+	char const * filename;
+	size_t size;
+	int res = 0;
+
+	if(transfer->fd >= 0)
+		return 0;
+	if((filename = purple_xfer_get_local_filename(xfer)) == NULL)
+		return -1;
+	/* start from where the protocol resumed the transfer, if it did */
+	transfer->offset = purple_xfer_get_bytes_sent(xfer);
+	if(purple_xfer_get_type(xfer) == PURPLE_XFER_SEND)
+	{
+		if((transfer->fd = open(filename, O_RDONLY)) < 0)
+			return -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(transfer->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		return 0;
+	}
+	/* keep the data received until complete */
+	if(transfer->partial == NULL)
+		transfer->partial = g_strdup_printf("%s%s", filename,
+				PURPLE_TRANSFER_PARTIAL);
+	if((transfer->fd = open(transfer->partial, O_WRONLY | O_CREAT,
+					0600)) < 0)
+		return -1;
+	if(ftruncate(transfer->fd, transfer->offset) != 0)
+		res = -1;
+	/* reserve the space needed at once */
+	else if((size = purple_xfer_get_size(xfer)) > (size_t)transfer->offset)
+		res = posix_fallocate(transfer->fd, transfer->offset,
+				size - transfer->offset);
+	/* the file system may not support it, but must have the room */
+	if(res != 0 && res != EINVAL && res != EOPNOTSUPP)
+	{
+		close(transfer->fd);
+		transfer->fd = -1;
+		unlink(transfer->partial);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* xfer */
+/* purple_xfer_cancel */
+static void _purple_xfer_cancel(PurpleXfer * xfer)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+
+	if(_purple == NULL || transfer == NULL)
+		return;
+	/* the partial data cannot be resumed */
+	if(transfer->fd >= 0)
+		close(transfer->fd);
+	transfer->fd = -1;
+	if(transfer->partial != NULL)
+		unlink(transfer->partial);
+	_purple_transfer_event(_purple, transfer,
+			PURPLE_MODEM_TRANSFER_STATUS_CANCELLED);
+}
+
+
+/* purple_xfer_data_not_sent */
+static void _purple_xfer_data_not_sent(PurpleXfer * xfer,
+		guchar const * buffer, gsize size)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+	(void) buffer;
+
+	/* read it again next time */
+	if(transfer != NULL)
+		transfer->offset -= size;
+}
+
+
+/* purple_xfer_destroy */
+static void _purple_xfer_destroy(PurpleXfer * xfer)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+
+	if(_purple != NULL && transfer != NULL)
+		g_hash_table_remove(_purple->transfers,
+				GUINT_TO_POINTER(transfer->id));
+}
+
+
+/* purple_xfer_new */
+static void _purple_xfer_new(PurpleXfer * xfer)
+{
+	PurpleTransfer * transfer;
+
+	if(_purple == NULL || (transfer = object_new(sizeof(*transfer)))
+			== NULL)
+		return;
+	transfer->id = ++_purple->transfers_id;
+	transfer->xfer = xfer;
+	transfer->fd = -1;
+	transfer->partial = NULL;
+	transfer->offset = 0;
+	transfer->reported = g_get_monotonic_time();
+	transfer->reported_done = 0;
+	transfer->rate = 0;
+	xfer->ui_data = transfer;
+	g_hash_table_insert(_purple->transfers, GUINT_TO_POINTER(transfer->id),
+			transfer);
+}
+
+
+/* purple_xfer_read */
+static gssize _purple_xfer_read(PurpleXfer * xfer, guchar ** buffer,
+		gssize size)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+	ssize_t res;
+	gssize ret = 0;
+
+	if(transfer == NULL || size < 0 || _purple_transfer_open(transfer)
+			!= 0)
+		return -1;
+	/* libpurple releases the buffer */
+	if((*buffer = g_try_malloc(size)) == NULL)
+		return -1;
+	/* straight from the page cache */
+	while(ret < size)
+		if((res = pread(transfer->fd, *buffer + ret, size - ret,
+						transfer->offset + ret)) > 0)
+			ret += res;
+		else if(res == 0)
+			break;
+		else if(errno != EINTR)
+		{
+			g_free(*buffer);
+			*buffer = NULL;
+			return -1;
+		}
+	transfer->offset += ret;
+	/* libpurple waits for the UI again before every buffer */
+	if(ret > 0)
+		purple_xfer_ui_ready(xfer);
+	return ret;
+}
+
+
+/* purple_xfer_update_progress */
+static void _purple_xfer_update_progress(PurpleXfer * xfer, double percent)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+	gint64 now;
+	size_t done;
+	size_t rate;
+	char const * filename;
+	(void) percent;
+
+	if(_purple == NULL || transfer == NULL)
+		return;
+	if(purple_xfer_is_completed(xfer))
+	{
+		if(transfer->fd >= 0)
+			close(transfer->fd);
+		transfer->fd = -1;
+		if(transfer->partial != NULL && (filename
+					= purple_xfer_get_local_filename(xfer))
+				!= NULL)
+			rename(transfer->partial, filename);
+		_purple_transfer_event(_purple, transfer,
+				PURPLE_MODEM_TRANSFER_STATUS_COMPLETED);
+		return;
+	}
+	/* libpurple calls this for every buffer transferred */
+	if((now = g_get_monotonic_time()) - transfer->reported
+			< PURPLE_TRANSFER_PROGRESS)
+		return;
+	done = purple_xfer_get_bytes_sent(xfer);
+	rate = (done > transfer->reported_done)
+		? (done - transfer->reported_done) * G_USEC_PER_SEC
+		/ (now - transfer->reported) : 0;
+	/* smooth the rate over the last reports */
+	transfer->rate = (transfer->rate == 0) ? rate
+		: (transfer->rate * 3 + rate) / 4;
+	transfer->reported = now;
+	transfer->reported_done = done;
+	_purple_transfer_event(_purple, transfer,
+			PURPLE_MODEM_TRANSFER_STATUS_PROGRESS);
+}
+
+
+/* purple_xfer_write */
+static gssize _purple_xfer_write(PurpleXfer * xfer, guchar const * buffer,
+		gssize size)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+	ssize_t res;
+	gssize ret = 0;
+
+	if(transfer == NULL || size < 0 || _purple_transfer_open(transfer)
+			!= 0)
+		return -1;
+	/* without going through the buffers of stdio */
+	while(ret < size)
+		if((res = pwrite(transfer->fd, buffer + ret, size - ret,
+						transfer->offset + ret)) >= 0)
+			ret += res;
+		else if(errno != EINTR)
+			return -1;
+	transfer->offset += ret;
+	/* ready for the next buffer */
+	purple_xfer_ui_ready(xfer);
+	return ret;
+}
+
+
+/* eventloop */
+/* purple_eventloop_input_add */
+static gboolean _input_prepare(GSource * source, gint * timeout);
+static gboolean _input_check(GSource * source);
+static gboolean _input_dispatch(GSource * source, GSourceFunc callback,
+		gpointer data);
+
+static GSourceFuncs _input_funcs =
+{
+	_input_prepare,
+	_input_check,
+	_input_dispatch,
+	NULL,
+	NULL,
+	NULL
+};
+
+static guint _purple_eventloop_input_add(int fd,
+		PurpleInputCondition condition, PurpleInputFunction function,
+		gpointer data)
+{
+	GSource * source;
+	PurpleInput * input;
+	guint ret;
+
+	/* the source holds everything needed to dispatch the callback */
+	if((source = g_source_new(&_input_funcs, sizeof(*input))) == NULL)
+		return 0;
+	input = (PurpleInput *)source;
+	input->poll.fd = fd;
+	input->poll.events = 0;
+	input->poll.revents = 0;
+	if(condition & PURPLE_INPUT_READ)
+		input->poll.events |= PURPLE_INPUT_READ_COND;
+	if(condition & PURPLE_INPUT_WRITE)
+		input->poll.events |= PURPLE_INPUT_WRITE_COND;
+	input->condition = condition;
+	input->function = function;
+	input->data = data;
+	g_source_add_poll(source, &input->poll);
+	ret = g_source_attach(source, NULL);
+	g_source_unref(source);
+	return ret;
+}
+
+static gboolean _input_prepare(GSource * source, gint * timeout)
+{
+	(void) source;
+
+	*timeout = -1;
+	return FALSE;
+}
+
+static gboolean _input_check(GSource * source)
+{
+	PurpleInput * input = (PurpleInput *)source;
+
+	return (input->poll.revents & input->poll.events) ? TRUE : FALSE;
+}
+
+static gboolean _input_dispatch(GSource * source, GSourceFunc callback,
+		gpointer data)
+{
+	PurpleInput * input = (PurpleInput *)source;
+	PurpleInputCondition condition = 0;
+	(void) callback;
+	(void) data;
+
+	if((input->condition & PURPLE_INPUT_READ)
+			&& (input->poll.revents & PURPLE_INPUT_READ_COND))
+		condition |= PURPLE_INPUT_READ;
+	if((input->condition & PURPLE_INPUT_WRITE)
+			&& (input->poll.revents & PURPLE_INPUT_WRITE_COND))
+		condition |= PURPLE_INPUT_WRITE;
+	input->function(input->data, input->poll.fd, condition);
+	return TRUE;
+}
+
+
+/* purple_eventloop_input_get_error */
+static int _purple_eventloop_input_get_error(int fd, int * error)
+{
+	socklen_t len = sizeof(*error);
+
+	return getsockopt(fd, SOL_SOCKET, SO_ERROR, error, &len);
+}
+
+
+/* purple_eventloop_input_remove */
+static gboolean _purple_eventloop_input_remove(guint handle)
+{
+	return g_source_remove(handle);
+}
+
+
+/* purple_eventloop_timeout_add */
+static guint _purple_eventloop_timeout_add(guint interval,
+		GSourceFunc function, gpointer data)
+{
+	/* let GLib group the timeouts with a granularity of a second */
+	if(interval >= 1000 && interval % 1000 == 0)
+		return g_timeout_add_seconds(interval / 1000, function, data);
+	return g_timeout_add(interval, function, data);
+}
+
+
+/* purple_eventloop_timeout_add_seconds */
+static guint _purple_eventloop_timeout_add_seconds(guint interval,
+		GSourceFunc function, gpointer data)
+{
+	return g_timeout_add_seconds(interval, function, data);
+}
+
+
+/* purple_eventloop_timeout_remove */
+static gboolean _purple_eventloop_timeout_remove(guint handle)
+{
+	return g_source_remove(handle);
+}
+
+
+/* callbacks */
+/* purple_on_blist_node_aliased */
+static void _purple_on_blist_node_aliased(PurpleBlistNode * node,
+		char const * alias, gpointer data)
+{
+	Purple * purple = data;
+	(void) alias;
+
+	if(PURPLE_BLIST_NODE_IS_BUDDY(node))
+		_purple_entry_queue(purple, (PurpleBuddy *)node);
+}
+
+
+/* purple_on_buddy_added */
+static void _purple_on_buddy_added(PurpleBuddy * buddy, gpointer data)
+{
+	Purple * purple = data;
+
+	_purple_entry_queue(purple, buddy);
+}
+
+
+/* purple_on_buddy_changed */
+static void _purple_on_buddy_changed(PurpleBuddy * buddy, gpointer data)
+{
+	Purple * purple = data;
+
+	_purple_entry_queue(purple, buddy);
+}
+
+
+/* purple_on_buddy_idle_changed */
+static void _purple_on_buddy_idle_changed(PurpleBuddy * buddy,
+		gboolean previous, gboolean idle, gpointer data)
+{
+	Purple * purple = data;
+	(void) previous;
+	(void) idle;
+
+	_purple_entry_queue(purple, buddy);
+}
+
+
+/* purple_on_buddy_removed */
+static void _purple_on_buddy_removed(PurpleBuddy * buddy, gpointer data)
+{
+	Purple * purple = data;
+	PurpleEntry * entry;
+
+	if((entry = g_hash_table_lookup(purple->entries, buddy)) == NULL)
+		return;
+	/* the buddy is about to be freed */
+	_purple_entry_queue(purple, buddy);
+	g_hash_table_steal(purple->entries, buddy);
+	entry->buddy = NULL;
+}
+
+
+/* purple_on_buddy_status_changed */
+static void _purple_on_buddy_status_changed(PurpleBuddy * buddy,
+		PurpleStatus * previous, PurpleStatus * status, gpointer data)
+{
+	Purple * purple = data;
+	(void) previous;
+	(void) status;
+
+	_purple_entry_queue(purple, buddy);
+}
+
+
+/* purple_on_connection_error */
+static void _purple_on_connection_error(PurpleConnection * gc,
+		PurpleConnectionError reason, char const * description,
+		gpointer data)
+{
+	Purple * purple = data;
+	PurpleLogin * login;
+	unsigned int delay;
+
+	if((login = g_hash_table_lookup(purple->logins,
+					purple_connection_get_account(gc)))
+			== NULL)
+		return;
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s(\"%s\") %s\n", __func__,
+			purple_account_get_username(login->account),
+			description);
+#else
+	(void) description;
+#endif
+	if(login->state == PURPLE_LOGIN_STATE_CONNECTING)
+		purple->logins_active--;
+	login->state = PURPLE_LOGIN_STATE_IDLE;
+	if(login->source == 0 && !purple_connection_error_is_fatal(reason))
+	{
+		/* back off exponentially, with jitter to spread the attempts */
+		delay = MIN(PURPLE_LOGIN_BACKOFF << MIN(login->attempts, 16),
+				PURPLE_LOGIN_BACKOFF_MAX) * 1000;
+		login->attempts++;
+		login->source = g_timeout_add(g_random_int_range(delay / 2,
+					delay + 1), _purple_on_login_retry,
+				login);
+	}
+	_purple_login_schedule(purple);
+}
+
+
+/* purple_on_deleting_conversation */
+static gboolean _deleting_conversation_foreach(gpointer key, gpointer value,
+		gpointer data);
+
+static void _purple_on_deleting_conversation(PurpleConversation * conv,
+		gpointer data)
+{
+	Purple * purple = data;
+
+	g_hash_table_foreach_remove(purple->conversations,
+			_deleting_conversation_foreach, conv);
+}
+
+static gboolean _deleting_conversation_foreach(gpointer key, gpointer value,
+		gpointer data)
+{
+	(void) key;
+
+	return (value == data) ? TRUE : FALSE;
+}
+
+
+/* purple_on_entries */
+static ModemContactStatus _entries_status(PurpleBuddy * buddy);
+
+static gboolean _purple_on_entries(gpointer data)
+{
+	Purple * purple = data;
+	ModemPluginHelper * helper = purple->helper;
+	ModemEvent mevent;
+	PurpleEntry * entry;
+	ModemContactStatus status;
+	char const * name;
+	GList * l;
+
+	purple->entries_source = 0;
+	purple->entries_queue = g_list_reverse(purple->entries_queue);
+	for(l = purple->entries_queue; l != NULL; l = l->next)
+	{
+		entry = l->data;
+		memset(&mevent, 0, sizeof(mevent));
+		if(entry->buddy == NULL)
+		{
+			mevent.type = MODEM_EVENT_TYPE_CONTACT_DELETED;
+			mevent.contact_deleted.id = entry->id;
+			helper->event(helper->modem, &mevent);
+			_purple_entry_free(entry);
+			continue;
+		}
+		/* only send the latest state, if it changed */
+		status = _entries_status(entry->buddy);
+		name = purple_buddy_get_contact_alias(entry->buddy);
+		if(entry->sent && !purple->entries_force
+				&& status == entry->status
+				&& g_strcmp0(name, entry->name) == 0)
+			continue;
+		entry->sent = TRUE;
+		entry->status = status;
+		g_free(entry->name);
+		entry->name = g_strdup(name);
+		mevent.type = MODEM_EVENT_TYPE_CONTACT;
+		mevent.contact.id = entry->id;
+		mevent.contact.status = status;
+		mevent.contact.name = name;
+		mevent.contact.number = purple_buddy_get_name(entry->buddy);
+		helper->event(helper->modem, &mevent);
+	}
+	g_list_free(purple->entries_queue);
+	purple->entries_queue = NULL;
+	purple->entries_force = FALSE;
+	purple->generation++;
+	return FALSE;
+}
+
+static ModemContactStatus _entries_status(PurpleBuddy * buddy)
+{
+	PurplePresence * presence;
+	PurpleStatus * status;
+
+	presence = purple_buddy_get_presence(buddy);
+	if(!purple_presence_is_online(presence))
+		return MODEM_CONTACT_STATUS_OFFLINE;
+	if(purple_presence_is_idle(presence))
+		return MODEM_CONTACT_STATUS_IDLE;
+	status = purple_presence_get_active_status(presence);
+	switch(purple_status_type_get_primitive(purple_status_get_type(
+					status)))
+	{
+		case PURPLE_STATUS_AWAY:
+		case PURPLE_STATUS_EXTENDED_AWAY:
+			return MODEM_CONTACT_STATUS_AWAY;
+		case PURPLE_STATUS_UNAVAILABLE:
+			return MODEM_CONTACT_STATUS_BUSY;
+		default:
+			return MODEM_CONTACT_STATUS_ONLINE;
+	}
+}
+
+
+/* purple_on_file_recv_request */
+static void _purple_on_file_recv_request(PurpleXfer * xfer, gpointer data)
+{
+	Purple * purple = data;
+	PurpleTransfer * transfer = xfer->ui_data;
+
+	/* wait for PURPLE_MODEM_REQUEST_TRANSFER_ACCEPT */
+	if(transfer != NULL)
+		_purple_transfer_event(purple, transfer,
+				PURPLE_MODEM_TRANSFER_STATUS_OFFERED);
+}
+
+
+/* purple_on_file_send_start */
+static void _purple_on_file_send_start(PurpleXfer * xfer, gpointer data)
+{
+	PurpleTransfer * transfer = xfer->ui_data;
+	(void) data;
+
+	if(transfer == NULL)
+		return;
+	/* the file is read as the transfer goes */
+	if(_purple_transfer_open(transfer) != 0)
+		purple_xfer_cancel_local(xfer);
+	else
+		purple_xfer_ui_ready(xfer);
+}
+
+
+/* purple_on_history_compacted */
+static gboolean _purple_on_history_compacted(gpointer data)
+{
+	PurpleHistoryCompaction * compaction = data;
+	Purple * purple = compaction->purple;
+	size_t i;
+	size_t j;
+
+	g_thread_join(compaction->thread);
+	purple->compaction = NULL;
+	for(i = 0; compaction->error == 0 && i < purple->segments_cnt; i++)
+	{
+		if(purple->segments[i].id != compaction->ids[0])
+			continue;
+		/* replace the segments compacted */
+		for(j = 0; j < compaction->ids_cnt; j++)
+			_history_segment_unmap(&purple->segments[i + j]);
+		j = compaction->ids_cnt;
+		memmove(&purple->segments[i + 1], &purple->segments[i + j],
+				sizeof(*purple->segments)
+				* (purple->segments_cnt - i - j));
+		purple->segments_cnt -= j - 1;
+		if(_history_segment_map(purple->history, compaction->ids[0],
+					&purple->segments[i]) != 0)
+		{
+			memmove(&purple->segments[i], &purple->segments[i + 1],
+					sizeof(*purple->segments)
+					* (purple->segments_cnt - i - 1));
+			purple->segments_cnt--;
+		}
+		break;
+	}
+	g_free(compaction->ids);
+	g_free(compaction->path);
+	object_delete(compaction);
+	return FALSE;
+}
+
+
+/* purple_on_init */
+static int _init_core(Purple * purple);
+
+static gboolean _purple_on_init(gpointer data)
+{
+	Purple * purple = data;
+	ModemPluginHelper * helper = purple->helper;
+	ModemEvent mevent;
+	PurpleModemStartup startup;
+	size_t i;
+	gint64 t;
+#ifdef DEBUG
+	static char const * steps[PURPLE_INIT_STEP_COUNT] =
+	{
+		"core", "buddy list", "preferences", "probe", "plug-ins",
+		"pounces", "history"
+	};
+#endif
+
+	t = g_get_monotonic_time();
+	switch(purple->step)
+	{
+		case PURPLE_INIT_STEP_CORE:
+			if(_init_core(purple) != 0)
+			{
+				purple->source = 0;
+				helper->error(helper->modem,
+						"Could not initialize libpurple",
+						1);
+				return FALSE;
+			}
+			break;
+		case PURPLE_INIT_STEP_BLIST:
+			purple_set_blist(purple_blist_new());
+			purple_blist_load();
+			break;
+		case PURPLE_INIT_STEP_PREFS:
+			purple_prefs_load();
+			break;
+		case PURPLE_INIT_STEP_PROBE:
+			_purple_plugins_probe(purple);
+			break;
+		case PURPLE_INIT_STEP_PLUGINS:
+			purple_plugins_load_saved("/phone/plugins/loaded");
+			break;
+		case PURPLE_INIT_STEP_POUNCES:
+			purple_pounces_load();
+			break;
+		case PURPLE_INIT_STEP_HISTORY:
+			if(_purple_history_open(purple) != 0)
+				helper->error(helper->modem,
+						"Could not open the message"
+						" history", 1);
+			break;
+		case PURPLE_INIT_STEP_DONE:
+			break;
+	}
+	if(purple->step == PURPLE_INIT_STEP_DONE)
+		return FALSE;
+	purple->timings[purple->step] = g_get_monotonic_time() - t;
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %s: %lu us\n", __func__,
+			steps[purple->step],
+			(unsigned long)purple->timings[purple->step]);
+#endif
+	if(++purple->step != PURPLE_INIT_STEP_DONE)
+		return TRUE;
+	purple->source = 0;
+	/* report the time spent, and saved by skipping plug-ins */
+	startup.plugins_skipped = purple->plugins_skipped;
+	startup.plugins_saved = purple->plugins_saved;
+	for(i = 0; i < PURPLE_INIT_STEP_COUNT; i++)
+		startup.timings[i] = purple->timings[i];
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_UNSUPPORTED;
+	mevent.unsupported.modem = plugin.name;
+	mevent.unsupported.request = PURPLE_MODEM_REQUEST_STARTUP;
+	mevent.unsupported.data = &startup;
+	mevent.unsupported.size = sizeof(startup);
+	helper->event(helper->modem, &mevent);
+	/* send the whole buddy list once, only the changes afterwards */
+	_purple_entry_queue_all(purple);
+	_start_protocols(purple);
+	return FALSE;
+}
+
+static int _init_core(Purple * purple)
+{
+	char const * homedir;
+	char * p;
+	void * handle;
+
+	if((homedir = getenv("HOME")) == NULL)
+		homedir = g_get_home_dir();
+	p = g_build_filename(homedir, ".purple", NULL);
+	purple_util_set_user_dir(p);
+	g_free(p);
+	purple_debug_set_enabled(FALSE);
+	purple_core_set_ui_ops(&purple->ops_ui);
+	purple_eventloop_set_ui_ops(&purple->ops_glib);
+	/* the plug-ins are probed later, with the help of the manifest */
+	purple_dnsquery_set_ui_ops(&purple->ops_dns);
+	purple_xfers_set_ui_ops(&purple->ops_xfer);
+	if(purple_core_init("phone") == 0)
+		return -1;
+	handle = purple_conversations_get_handle();
+	purple_signal_connect(handle, "deleting-conversation", purple,
+			PURPLE_CALLBACK(_purple_on_deleting_conversation),
+			purple);
+	purple_signal_connect(handle, "received-chat-msg", purple,
+			PURPLE_CALLBACK(_purple_on_received_chat_msg), purple);
+	purple_signal_connect(handle, "received-im-msg", purple,
+			PURPLE_CALLBACK(_purple_on_received_im_msg), purple);
+	/* the history is written independently of the libpurple logs */
+	purple_signal_connect(handle, "wrote-chat-msg", purple,
+			PURPLE_CALLBACK(_purple_on_wrote_msg), purple);
+	purple_signal_connect(handle, "wrote-im-msg", purple,
+			PURPLE_CALLBACK(_purple_on_wrote_msg), purple);
+	handle = purple_blist_get_handle();
+	purple_signal_connect(handle, "blist-node-aliased", purple,
+			PURPLE_CALLBACK(_purple_on_blist_node_aliased), purple);
+	purple_signal_connect(handle, "buddy-added", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_added), purple);
+	purple_signal_connect(handle, "buddy-removed", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_removed), purple);
+	purple_signal_connect(handle, "buddy-idle-changed", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_idle_changed),
+			purple);
+	purple_signal_connect(handle, "buddy-signed-off", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_changed), purple);
+	purple_signal_connect(handle, "buddy-signed-on", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_changed), purple);
+	purple_signal_connect(handle, "buddy-status-changed", purple,
+			PURPLE_CALLBACK(_purple_on_buddy_status_changed),
+			purple);
+	handle = purple_connections_get_handle();
+	purple_signal_connect(handle, "connection-error", purple,
+			PURPLE_CALLBACK(_purple_on_connection_error), purple);
+	purple_signal_connect(handle, "signed-off", purple,
+			PURPLE_CALLBACK(_purple_on_signed_off), purple);
+	purple_signal_connect(handle, "signed-on", purple,
+			PURPLE_CALLBACK(_purple_on_signed_on), purple);
+	handle = purple_xfers_get_handle();
+	purple_signal_connect(handle, "file-recv-request", purple,
+			PURPLE_CALLBACK(_purple_on_file_recv_request), purple);
+	purple_signal_connect(handle, "file-send-start", purple,
+			PURPLE_CALLBACK(_purple_on_file_send_start), purple);
+	return 0;
+}
+
+
+/* purple_on_login */
+static gboolean _purple_on_login(gpointer data)
+{
+	Purple * purple = data;
+	PurpleLogin * login;
+
+	purple->logins_source = 0;
+	if((login = g_queue_pop_head(purple->logins_queue)) == NULL)
+		return FALSE;
+	if(purple_account_is_connected(login->account))
+		login->state = PURPLE_LOGIN_STATE_ONLINE;
+	else
+	{
+#ifdef DEBUG
+		fprintf(stderr, "DEBUG: %s(\"%s\") attempt %u\n", __func__,
+				purple_account_get_username(login->account),
+				login->attempts + 1);
+#endif
+		login->state = PURPLE_LOGIN_STATE_CONNECTING;
+		purple->logins_active++;
+		purple_account_connect(login->account);
+	}
+	_purple_login_schedule(purple);
+	return FALSE;
+}
+
+
+/* purple_on_login_retry */
+static gboolean _purple_on_login_retry(gpointer data)
+{
+	PurpleLogin * login = data;
+
+	login->source = 0;
+	_purple_login_queue(login->purple, login->account);
+	return FALSE;
+}
+
+
+/* purple_on_messages */
+static gboolean _purple_on_messages(gpointer data)
+{
+	Purple * purple = data;
+	ModemPluginHelper * helper = purple->helper;
+	ModemEvent mevent;
+	PurpleMessage * m;
+
+	purple->messages_source = 0;
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_MESSAGE;
+	mevent.message.folder = MODEM_MESSAGE_FOLDER_INBOX;
+	mevent.message.status = MODEM_MESSAGE_STATUS_NEW;
+	mevent.message.encoding = MODEM_MESSAGE_ENCODING_UTF8;
+	/* one event per message, in the order received */
+	while((m = g_queue_pop_head(purple->messages)) != NULL)
+	{
+		mevent.message.date = m->date;
+		mevent.message.number = m->number;
+		mevent.message.length = strlen(m->content);
+		mevent.message.content = m->content;
+		helper->event(helper->modem, &mevent);
+		g_free(m->content);
+		g_free(m->number);
+		object_delete(m);
+	}
+	return FALSE;
+}
+
+
+/* purple_on_resolved */
+static void _on_resolved(Purple * purple, PurpleResolve * resolve);
+
+static gboolean _purple_on_resolved(gpointer data)
+{
+	Purple * purple = data;
+	PurpleResolve * resolve;
+
+	for(;;)
+	{
+		g_mutex_lock(&purple->results_mutex);
+		if((resolve = g_queue_pop_head(purple->results)) == NULL)
+			purple->results_source = 0;
+		g_mutex_unlock(&purple->results_mutex);
+		if(resolve == NULL)
+			break;
+		_on_resolved(purple, resolve);
+	}
+	return FALSE;
+}
+
+static void _on_resolved(Purple * purple, PurpleResolve * resolve)
+{
+	PurpleResolved * resolved;
+	GSList * hosts;
+	gint64 now = g_get_monotonic_time();
+
+	if(g_atomic_int_get(&resolve->cancelled) != 0)
+	{
+		_dnsquery_resolve_free(resolve);
+		return;
+	}
+	g_hash_table_remove(purple->resolves, resolve->query);
+	if(resolve->error != 0)
+		resolve->failed(resolve->query, gai_strerror(resolve->error));
+	else if(resolve->hosts == NULL)
+		resolve->failed(resolve->query, "No address found");
+	else
+	{
+		/* cache the results, libpurple takes ownership of these */
+		if(((resolved = g_hash_table_lookup(purple->resolved,
+							resolve->host)) == NULL
+					|| resolved->expires <= now)
+				&& (resolved = object_new(sizeof(*resolved)))
+				!= NULL)
+		{
+			resolved->expires = now + (gint64)PURPLE_DNS_TTL
+				* G_USEC_PER_SEC;
+			resolved->hosts = _dnsquery_hosts_copy(resolve->hosts,
+					0);
+			g_hash_table_replace(purple->resolved,
+					g_strdup(resolve->host), resolved);
+		}
+		hosts = resolve->hosts;
+		resolve->hosts = NULL;
+		resolve->resolved(resolve->query, hosts);
+	}
+	_dnsquery_resolve_free(resolve);
+}
+
+
+/* purple_on_received_chat_msg */
+static void _purple_on_received_chat_msg(PurpleAccount * account,
+		char * sender, char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data)
+{
+	Purple * purple = data;
+	char const * number;
+	(void) account;
+	(void) sender;
+	(void) flags;
+
+	/* replies go to the whole conversation */
+	number = purple_conversation_get_name(conv);
+	if(g_hash_table_lookup(purple->conversations, number) == NULL)
+		g_hash_table_insert(purple->conversations, g_strdup(number),
+				conv);
+	_purple_message_queue(purple, number, message);
+}
+
+
+/* purple_on_received_im_msg */
+static void _purple_on_received_im_msg(PurpleAccount * account,
+		char * sender, char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data)
+{
+	Purple * purple = data;
+	(void) account;
+	(void) flags;
+
+	/* the conversation may not exist yet */
+	if(conv != NULL && g_hash_table_lookup(purple->conversations, sender)
+			== NULL)
+		g_hash_table_insert(purple->conversations, g_strdup(sender),
+				conv);
+	_purple_message_queue(purple, sender, message);
+}
+
+
+/* purple_on_signed_off */
+static void _purple_on_signed_off(PurpleConnection * gc, gpointer data)
+{
+	Purple * purple = data;
+	PurpleLogin * login;
+
+	if((login = g_hash_table_lookup(purple->logins,
+					purple_connection_get_account(gc)))
+			== NULL)
+		return;
+	if(login->state == PURPLE_LOGIN_STATE_CONNECTING)
+	{
+		purple->logins_active--;
+		_purple_login_schedule(purple);
+	}
+	if(login->state != PURPLE_LOGIN_STATE_QUEUED)
+		login->state = PURPLE_LOGIN_STATE_IDLE;
+}
+
+
+/* purple_on_signed_on */
+static void _purple_on_signed_on(PurpleConnection * gc, gpointer data)
+{
+	Purple * purple = data;
+	PurpleLogin * login;
+
+	if((login = g_hash_table_lookup(purple->logins,
+					purple_connection_get_account(gc)))
+			== NULL)
+		return;
+	if(login->state == PURPLE_LOGIN_STATE_CONNECTING)
+	{
+		purple->logins_active--;
+		_purple_login_schedule(purple);
+	}
+	login->state = PURPLE_LOGIN_STATE_ONLINE;
+	login->attempts = 0;
+}
+
+
+/* purple_on_ui_init */
+static void _purple_on_ui_init(void)
+{
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s()\n", __func__);
+#endif
+}
+
+
+/* purple_on_ui_prefs_init */
+static void _purple_on_ui_prefs_init(void)
+{
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s()\n", __func__);
+#endif
+	purple_prefs_add_path_list("/phone/plugins/loaded", NULL);
+}
+
+
+/* purple_on_wrote_msg */
+static void _purple_on_wrote_msg(PurpleAccount * account, char const * who,
+		char * message, PurpleConversation * conv,
+		PurpleMessageFlags flags, gpointer data)
+{
+	Purple * purple = data;
+	PurpleLogType type = PURPLE_LOG_IM;
+	gchar * p;
+	(void) account;
+
+	if(purple->sending && (flags & PURPLE_MESSAGE_ERROR))
+		purple->sending_failed = TRUE;
+	if(conv == NULL || (flags & (PURPLE_MESSAGE_SYSTEM
+					| PURPLE_MESSAGE_NO_LOG)))
+		return;
+	if(purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_CHAT)
+		type = PURPLE_LOG_CHAT;
+	if((p = purple_markup_strip_html(message)) == NULL)
+		return;
+	_purple_history_write(purple, type, flags,
+			purple_conversation_get_name(conv), who, time(NULL),
+			p);
+	g_free(p);
 }
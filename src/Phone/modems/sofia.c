@@ -15,19 +15,114 @@
 
 
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 #include <System.h>
 #include <Desktop/Phone/modem.h>
 #include <sofia-sip/nua.h>
 #include <sofia-sip/sip_header.h>
+#include <sofia-sip/su_alloc_stat.h>
 #include <sofia-sip/su_glib.h>
+#include <sofia-sip/su_localinfo.h>
 #include <sofia-sip/url.h>
+#include "sofia.h"
 
 
 /* Sofia */
+/* constants */
+/* decoded audio is recorded as 16-bit mono PCM at 8 kHz */
+#define SOFIA_RECORD_RATE	8000
+/* samples per buffer (one second) */
+#define SOFIA_RECORD_BUFFER	SOFIA_RECORD_RATE
+
+#define SOFIA_RTP_PORT		16384
+#define SOFIA_RTP_PORT_MAX	32766
+
+#define SOFIA_SDP_CODECS	"PCMU,PCMA,telephone-event"
+
+/* remote URIs kept formatted, for the messages received */
+#define SOFIA_SENDERS		8
+
+#define SOFIA_ICE_BIND		16
+#define SOFIA_ICE_CANDIDATES	8
+#define SOFIA_ICE_SERVERS	4
+#define SOFIA_ICE_TRANSACTIONS	32
+
+#define SOFIA_MEDIA_SIZE	2048
+
+#define SOFIA_RTP_CLOCK		8000
+/* packetization delay (in milliseconds) */
+#define SOFIA_RTP_PTIME		20
+/* average interval between reports (in milliseconds) */
+#define SOFIA_RTCP_INTERVAL	5000
+/* minimum gap length (RFC 3611) */
+#define SOFIA_RTCP_GMIN		16
+/* packets */
+#define SOFIA_RTCP_SR		200
+#define SOFIA_RTCP_RR		201
+#define SOFIA_RTCP_SDES		202
+#define SOFIA_RTCP_XR		207
+/* extended report blocks */
+#define SOFIA_RTCP_XR_RRTR	4
+#define SOFIA_RTCP_XR_DLRR	5
+#define SOFIA_RTCP_XR_VOIP	7
+
+#define SOFIA_STUN_PORT		"3478"
+#define SOFIA_STUN_COOKIE	0x2112a442
+#define SOFIA_STUN_RTO		100
+#define SOFIA_STUN_RETRIES	6
+/* messages */
+#define SOFIA_STUN_BINDING		0x0001
+#define SOFIA_STUN_BINDING_SUCCESS	0x0101
+#define SOFIA_STUN_ALLOCATE		0x0003
+#define SOFIA_STUN_ALLOCATE_SUCCESS	0x0103
+#define SOFIA_STUN_ALLOCATE_ERROR	0x0113
+#define SOFIA_STUN_REFRESH		0x0004
+#define SOFIA_STUN_REFRESH_SUCCESS	0x0104
+#define SOFIA_STUN_REFRESH_ERROR	0x0114
+#define SOFIA_STUN_PERMISSION		0x0008
+#define SOFIA_STUN_PERMISSION_SUCCESS	0x0108
+#define SOFIA_STUN_PERMISSION_ERROR	0x0118
+#define SOFIA_STUN_SEND_INDICATION	0x0016
+#define SOFIA_STUN_DATA_INDICATION	0x0017
+/* attributes */
+#define SOFIA_STUN_USERNAME		0x0006
+#define SOFIA_STUN_MESSAGE_INTEGRITY	0x0008
+#define SOFIA_STUN_ERROR_CODE		0x0009
+#define SOFIA_STUN_LIFETIME		0x000d
+#define SOFIA_STUN_XOR_PEER_ADDRESS	0x0012
+#define SOFIA_STUN_DATA			0x0013
+#define SOFIA_STUN_REALM		0x0014
+#define SOFIA_STUN_NONCE		0x0015
+#define SOFIA_STUN_XOR_RELAYED_ADDRESS	0x0016
+#define SOFIA_STUN_REQUESTED_TRANSPORT	0x0019
+#define SOFIA_STUN_XOR_MAPPED_ADDRESS	0x0020
+#define SOFIA_STUN_PRIORITY		0x0024
+#define SOFIA_STUN_USE_CANDIDATE	0x0025
+#define SOFIA_STUN_FINGERPRINT		0x8028
+#define SOFIA_STUN_ICE_CONTROLLING	0x802a
+
+/* lifetimes on the TURN server (in seconds) */
+#define SOFIA_TURN_LIFETIME	600
+#define SOFIA_TURN_PERMISSION	300
+
+
 /* private */
 /* types */
 typedef enum _SofiaHandleType
@@ -37,12 +132,152 @@ typedef enum _SofiaHandleType
 	SOFIA_HANDLE_TYPE_MESSAGE
 } SofiaHandleType;
 
+typedef enum _SofiaInfoType
+{
+	SOFIA_INFO_TYPE_DTMF = 1,
+	SOFIA_INFO_TYPE_TRICKLE
+} SofiaInfoType;
+
+typedef enum _SofiaCandidateType
+{
+	SOFIA_CANDIDATE_HOST = 0,
+	SOFIA_CANDIDATE_SRFLX,
+	SOFIA_CANDIDATE_RELAY
+} SofiaCandidateType;
+#define SOFIA_CANDIDATE_LAST	SOFIA_CANDIDATE_RELAY
+#define SOFIA_CANDIDATE_COUNT	(SOFIA_CANDIDATE_LAST + 1)
+
+typedef struct _SofiaCandidate
+{
+	SofiaCandidateType type;
+	struct sockaddr_in addr;
+	uint32_t priority;
+	/* local candidates */
+	int trickled;
+	/* remote candidates */
+	int checking;
+	int permission;		/* through the relay: 1 requested, 2 granted */
+	int relayed;		/* the lowest RTT was through the relay */
+	struct sockaddr_in mapped;	/* the local address seen remotely */
+	gint64 rtt;
+} SofiaCandidate;
+
+typedef enum _SofiaStunType
+{
+	SOFIA_STUN_TYPE_GATHER = 0,
+	SOFIA_STUN_TYPE_ALLOCATE,
+	SOFIA_STUN_TYPE_REFRESH,
+	SOFIA_STUN_TYPE_PERMISSION,
+	SOFIA_STUN_TYPE_CHECK
+} SofiaStunType;
+
+typedef struct _SofiaStun
+{
+	unsigned char buf[548];
+	size_t len;
+} SofiaStun;
+
+typedef struct _SofiaTransaction
+{
+	int active;
+	SofiaStunType type;
+	unsigned char id[12];
+	struct sockaddr_in addr;
+	size_t remote;
+	int nominate;
+	int relayed;
+	SofiaStun stun;
+	gint64 sent;
+	gint64 timeout;
+	unsigned int retries;
+} SofiaTransaction;
+
+typedef struct _SofiaRtp
+{
+	uint32_t ssrc;
+
+	/* reception (RFC 3550, appendix A) */
+	int started;
+	uint32_t source;
+	uint16_t max_seq;
+	uint32_t cycles;
+	uint32_t base_seq;
+	uint64_t received;
+	uint32_t expected_prior;
+	uint64_t received_prior;
+	uint32_t transit;
+	double jitter;
+
+	/* delay variation, to size the jitter buffer */
+	uint32_t reference;
+	int64_t transit_min;
+	int64_t transit_max;
+	int64_t buffer;
+
+	/* loss pattern (RFC 3611, section 4.7.2) */
+	unsigned int run;
+	uint64_t burst_packets;
+	uint64_t burst_lost;
+	uint64_t gap_packets;
+	uint64_t gap_lost;
+	uint64_t current_packets;
+	uint64_t current_lost;
+	/* transitions between received (0) and lost (1) packets */
+	int previous;
+	uint64_t transitions[2][2];
+
+	/* round-trip time */
+	uint32_t lsr;		/* last sender report */
+	gint64 lsr_time;
+	uint32_t lrr;		/* last receiver reference time */
+	gint64 lrr_time;
+	gint64 rtt;
+
+	SofiaMediaQuality remote;
+
+	/* CPU usage */
+	gint64 cpu;
+	gint64 since;
+} SofiaRtp;
+
+typedef struct _SofiaMedia SofiaMedia;
+
 typedef struct _SofiaHandle
 {
 	SofiaHandleType type;
 	nua_handle_t * handle;
+	/* memory specific to this transaction */
+	su_home_t * home;
+	/* calls */
+	SofiaMedia * media;
 } SofiaHandle;
 
+typedef struct _SofiaSender
+{
+	url_t * url;
+	char * number;
+	unsigned int used;
+} SofiaSender;
+
+typedef struct _SofiaRecorder
+{
+	GThread * thread;
+	GMutex mutex;
+	GCond cond;
+	FILE * fp;
+	int running;
+
+	/* double buffering: one buffer is filled while the other is written */
+	int16_t * buffers[2];
+	size_t fill[2];
+	unsigned int current;
+	int pending;
+
+	/* statistics */
+	SofiaRecordStats stats;
+	uint64_t missed;	/* dropped without holding the lock */
+} SofiaRecorder;
+
 typedef struct _ModemPlugin
 {
 	ModemPluginHelper * helper;
@@ -53,22 +288,120 @@ typedef struct _ModemPlugin
 	nua_t * nua;
 	SofiaHandle * handles;
 	size_t handles_cnt;
+	/* memory counters */
+	size_t homes_cnt;
+	size_t homes_peak;
+	uint64_t bytes_peak;
+
+	/* messages, mostly received outside of a dialog */
+	SofiaSender senders[SOFIA_SENDERS];
+	unsigned int senders_used;
+
+	/* SDP offer, but for the session and the port */
+	char * sdp_address;
+	int sdp_family;
+	char * sdp_codecs;
+	char * sdp_formats;
+	char * sdp_attributes;
+	guint sdp_source;
+	unsigned long sdp_session;
+	unsigned int rtp_port;
+
+	/* NAT traversal */
+	struct sockaddr_in stun[SOFIA_ICE_SERVERS];
+	size_t stun_cnt;
+	struct sockaddr_in turn;
+
+	/* recording */
+	SofiaRecorder * recorder;
 } Sofia;
 
+struct _SofiaMedia
+{
+	Sofia * sofia;
+	nua_handle_t * handle;
+	int fd;
+	unsigned int port;
+	guint source;
+	guint timeout;
+
+	/* timing */
+	gint64 dialled;
+	gint64 connected;
+
+	/* ICE (RFC 8445), over IPv4 only and always controlling, since calls
+	 * are only placed from here */
+	char ufrag[9];
+	char pwd[25];
+	char rufrag[257];
+	char rpwd[257];
+	uint64_t tiebreaker;
+	SofiaCandidate local[SOFIA_ICE_CANDIDATES];
+	size_t local_cnt;
+	SofiaCandidate remote[SOFIA_ICE_CANDIDATES];
+	size_t remote_cnt;
+	ssize_t selected;
+	int nominated;
+	SofiaTransaction transactions[SOFIA_ICE_TRANSACTIONS];
+
+	/* trickling */
+	int dialog;
+	int ready;
+	int update;
+	int gathered;
+	/* INFO requests sent, oldest first (nua sends them one at a time) */
+	GQueue info;
+
+	/* TURN (RFC 5766) */
+	char realm[128];
+	char nonce[128];
+	unsigned char key[16];
+	int allocated;
+	guint refresh;
+
+	/* RTP and RTCP */
+	SofiaRtp rtp;
+	guint rtcp;
+};
+
 
 /* variables */
+static const struct
+{
+	char const * name;
+	unsigned int payload;
+	char const * rtpmap;
+	char const * fmtp;
+} _sofia_codecs[] =
+{
+	{ "PCMU",		0,	"PCMU/8000",		NULL	},
+	{ "GSM",		3,	"GSM/8000",		NULL	},
+	{ "PCMA",		8,	"PCMA/8000",		NULL	},
+	{ "G722",		9,	"G722/8000",		NULL	},
+	{ "telephone-event",	101,	"telephone-event/8000",	"0-16"	}
+};
+
 static ModemConfig _sofia_config[] =
 {
 	{ "username",		"Username",	MCT_STRING	},
 	{ "fullname",		"Full name",	MCT_STRING	},
 	{ NULL,			"Network:",	MCT_SUBSECTION	},
 	{ "bind",		"Bind address",	MCT_STRING	},
+	{ "rtp_port",		"RTP port",	MCT_UINT32	},
+	{ "codecs",		"Codecs",	MCT_STRING	},
+	{ "stun_servers",	"STUN servers",	MCT_STRING	},
+	{ NULL,			"TURN server:",	MCT_SUBSECTION	},
+	{ "turn_server",	"Hostname",	MCT_STRING	},
+	{ "turn_username",	"Username",	MCT_STRING	},
+	{ "turn_password",	"Password",	MCT_PASSWORD	},
 	{ NULL,			"Registrar:",	MCT_SUBSECTION	},
 	{ "registrar_hostname",	"Hostname",	MCT_STRING	},
 	{ "registrar_username",	"Username",	MCT_STRING	},
 	{ "registrar_password",	"Password",	MCT_PASSWORD	},
 	{ NULL,			"Proxy:",	MCT_SUBSECTION	},
 	{ "proxy_hostname",	"Hostname",	MCT_STRING	},
+	{ NULL,			"Recording:",	MCT_SUBSECTION	},
+	{ "record_directory",	"Directory",	MCT_STRING	},
 	{ NULL,			NULL,		MCT_NONE	},
 };
 
@@ -83,14 +416,104 @@ static int _sofia_request(ModemPlugin * modem, ModemRequest * request);
 
 /* useful */
 static nua_handle_t * _sofia_handle_add(Sofia * sofia, SofiaHandleType type,
-		sip_to_t * to);
+		char const * to, char const * display);
+static SofiaHandle * _sofia_handle_adopt(Sofia * sofia, SofiaHandleType type,
+		nua_handle_t * handle);
+static SofiaHandle * _sofia_handle_get(Sofia * sofia, nua_handle_t * handle);
 static nua_handle_t * _sofia_handle_lookup(Sofia * sofia, SofiaHandleType type);
 static int _sofia_handle_remove(Sofia * sofia, nua_handle_t * handle);
+static void _sofia_memory_report(Sofia * sofia);
+static void _sofia_memory_stats(Sofia * sofia, SofiaMemoryStats * stats);
+static char const * _sofia_sender(Sofia * sofia, url_t const * url);
+
+/* sdp */
+static int _sofia_sdp_update(Sofia * sofia);
+static char const * _sofia_sdp_codecs(Sofia * sofia);
+static void _sofia_sdp_invalidate(Sofia * sofia);
+static char const * _sofia_sdp_offer(Sofia * sofia, char const * address,
+		unsigned int port, char const * attributes, char * buf,
+		size_t size);
+static unsigned int _sofia_rtp_port(Sofia * sofia);
+
+/* ice */
+static void _sofia_ice_resolve(Sofia * sofia);
+
+/* media */
+static SofiaMedia * _sofia_media_new(Sofia * sofia, nua_handle_t * handle,
+		unsigned int * port);
+static void _sofia_media_delete(SofiaMedia * media);
+static void _sofia_media_attributes(SofiaMedia * media, GString * str);
+static void _sofia_media_dialog(SofiaMedia * media);
+static void _sofia_media_ready(SofiaMedia * media);
+static void _sofia_media_remote(SofiaMedia * media, char const * sdp);
+static void _sofia_media_stats(SofiaMedia * media, SofiaMediaStats * stats);
+static void _media_audio(SofiaMedia * media, unsigned char const * buf,
+		size_t len);
+static void _media_credentials(SofiaMedia * media, SofiaStun * stun);
+static void _media_packet(SofiaMedia * media, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from, int relayed);
+static int _media_pending(SofiaMedia * media, SofiaStunType type);
+static void _media_permission(SofiaMedia * media);
+static void _media_report(SofiaMedia * media);
+static void _media_rtcp(SofiaMedia * media, unsigned char const * buf,
+		size_t len);
+static void _media_rtcp_send(SofiaMedia * media);
+static void _media_rtp(SofiaMedia * media, unsigned char const * buf,
+		size_t len);
+static int _media_send(SofiaMedia * media, int relayed,
+		unsigned char const * buf, size_t len,
+		struct sockaddr_in const * addr);
+static int _media_transaction(SofiaMedia * media, SofiaStunType type,
+		struct sockaddr_in const * addr, size_t remote, int nominate,
+		int relayed);
+static void _media_trickle(SofiaMedia * media);
+static void _media_update(SofiaMedia * media);
+
+/* rtp */
+static int16_t _rtp_alaw(unsigned char value);
+static void _rtp_ntp(gint64 now, uint32_t * msw, uint32_t * lsw);
+static void _rtp_uint16(unsigned char * buf, uint16_t value);
+static uint16_t _rtp_uint16_get(unsigned char const * buf);
+static uint32_t _rtp_uint32_get(unsigned char const * buf);
+static int16_t _rtp_ulaw(unsigned char value);
+
+/* stun */
+static void _stun_address(unsigned char * buf, struct sockaddr_in const * sa);
+static int _stun_address_get(unsigned char const * buf, size_t size,
+		struct sockaddr_in * sa);
+static int _stun_attribute(SofiaStun * stun, uint16_t type, void const * data,
+		size_t size);
+static unsigned char const * _stun_find(unsigned char const * buf, size_t len,
+		uint16_t type, size_t * size);
+static int _stun_fingerprint(SofiaStun * stun);
+static void _stun_init(SofiaStun * stun, uint16_t type,
+		unsigned char const * id);
+static int _stun_integrity(SofiaStun * stun, unsigned char const * key,
+		size_t keylen);
+static void _stun_length(SofiaStun * stun, size_t length);
+static void _stun_uint32(unsigned char * buf, uint32_t value);
+static int _stun_verify(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen);
+
+/* encoding */
+static ModemMessageEncoding _sofia_encoding(char const * buf, size_t len);
+
+/* recorder */
+static int _sofia_record_start(Sofia * sofia, char const * filename);
+static int _sofia_record_stop(Sofia * sofia);
+static void _sofia_record_audio(Sofia * sofia, int16_t const * samples,
+		size_t cnt);
 
 /* callbacks */
 static void _sofia_callback(nua_event_t event, int status, char const * phrase,
 		nua_t * nua, nua_magic_t * magic, nua_handle_t * nh,
 		nua_hmagic_t * hmagic, sip_t const * sip, tagi_t tags[]);
+static gboolean _sofia_on_sdp_update(gpointer data);
+static gboolean _media_on_io(GIOChannel * source, GIOCondition condition,
+		gpointer data);
+static gboolean _media_on_rtcp(gpointer data);
+static gboolean _media_on_refresh(gpointer data);
+static gboolean _media_on_timeout(gpointer data);
 
 
 /* public */
@@ -123,6 +546,7 @@ static ModemPlugin * _sofia_init(ModemPluginHelper * helper)
 	sofia->helper = helper;
 	su_init();
 	su_home_init(sofia->home);
+	su_home_init_stats(sofia->home);
 	if((sofia->root = su_glib_root_create(NULL)) == NULL)
 	{
 		_sofia_destroy(sofia);
@@ -132,6 +556,19 @@ static ModemPlugin * _sofia_init(ModemPluginHelper * helper)
 	sofia->source = g_source_attach(gsource, g_main_context_default());
 	sofia->handles = NULL;
 	sofia->handles_cnt = 0;
+	sofia->homes_cnt = 0;
+	sofia->homes_peak = 0;
+	sofia->bytes_peak = 0;
+	sofia->sdp_address = NULL;
+	sofia->sdp_family = AF_INET;
+	sofia->sdp_codecs = NULL;
+	sofia->sdp_formats = NULL;
+	sofia->sdp_attributes = NULL;
+	sofia->sdp_source = 0;
+	sofia->sdp_session = time(NULL);
+	sofia->rtp_port = 0;
+	sofia->stun_cnt = 0;
+	sofia->recorder = NULL;
 	return sofia;
 }
 
@@ -179,8 +616,13 @@ static int _sofia_start(ModemPlugin * modem, unsigned int retry)
 	if((sofia->nua = nua_create(sofia->root, _sofia_callback, modem,
 					TAG_IF(p, NUTAG_URL(us.us_str)),
 					SOATAG_AF(SOA_AF_IP4_IP6),
+					NUTAG_DETECT_NETWORK_UPDATES(
+						NUA_NW_DETECT_TRY_FULL),
 					TAG_END())) == NULL)
 		return -1;
+	/* prepare the SDP offer for calls */
+	_sofia_sdp_update(sofia);
+	_sofia_ice_resolve(sofia);
 	/* username */
 	if((p = helper->config_get(helper->modem, "username")) != NULL
 			&& strlen(p) > 0)
@@ -205,7 +647,7 @@ static int _sofia_start(ModemPlugin * modem, unsigned int retry)
 	{
 		if((handle = _sofia_handle_add(sofia,
 						SOFIA_HANDLE_TYPE_REGISTRATION,
-						NULL)) == NULL)
+						NULL, NULL)) == NULL)
 			return -helper->error(helper->modem,
 					"Cannot create registration handle", 1);
 		snprintf(us.us_str, sizeof(us.us_str), "%s%s", "sip:", q);
@@ -234,7 +676,7 @@ static int _sofia_start(ModemPlugin * modem, unsigned int retry)
 
 
 /* sofia_stop */
-static void _stop_handle(SofiaHandle * handle);
+static void _stop_handle(Sofia * sofia, SofiaHandle * handle);
 
 static int _sofia_stop(ModemPlugin * modem)
 {
@@ -244,8 +686,13 @@ static int _sofia_stop(ModemPlugin * modem)
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s()\n", __func__);
 #endif
+	_sofia_record_stop(sofia);
+	_sofia_sdp_invalidate(sofia);
+	if(sofia->sdp_source != 0)
+		g_source_remove(sofia->sdp_source);
+	sofia->sdp_source = 0;
 	for(i = 0; i < sofia->handles_cnt; i++)
-		_stop_handle(&sofia->handles[i]);
+		_stop_handle(sofia, &sofia->handles[i]);
 	free(sofia->handles);
 	sofia->handles = NULL;
 	sofia->handles_cnt = 0;
@@ -259,11 +706,18 @@ static int _sofia_stop(ModemPlugin * modem)
 	return 0;
 }
 
-static void _stop_handle(SofiaHandle * handle)
+static void _stop_handle(Sofia * sofia, SofiaHandle * handle)
 {
 	if(handle->handle == NULL)
 		return;
 	nua_handle_destroy(handle->handle);
+	handle->handle = NULL;
+	if(handle->media != NULL)
+		_sofia_media_delete(handle->media);
+	handle->media = NULL;
+	su_home_unref(handle->home);
+	handle->home = NULL;
+	sofia->homes_cnt--;
 }
 
 
@@ -271,6 +725,7 @@ static void _stop_handle(SofiaHandle * handle)
 static int _request_call(ModemPlugin * modem, ModemRequest * request);
 static int _request_dtmf_send(ModemPlugin * modem, ModemRequest * request);
 static int _request_message_send(ModemPlugin * modem, ModemRequest * request);
+static int _request_unsupported(ModemPlugin * modem, ModemRequest * request);
 
 static int _sofia_request(ModemPlugin * modem, ModemRequest * request)
 {
@@ -282,6 +737,8 @@ static int _sofia_request(ModemPlugin * modem, ModemRequest * request)
 			return _request_dtmf_send(modem, request);
 		case MODEM_REQUEST_MESSAGE_SEND:
 			return _request_message_send(modem, request);
+		case MODEM_REQUEST_UNSUPPORTED:
+			return _request_unsupported(modem, request);
 #ifndef DEBUG
 		default:
 			break;
@@ -295,27 +752,38 @@ static int _request_call(ModemPlugin * modem, ModemRequest * request)
 	Sofia * sofia = modem;
 	ModemPluginHelper * helper = sofia->helper;
 	nua_handle_t * handle;
+	SofiaHandle * h;
 	url_string_t us;
-	sip_to_t * to;
+	unsigned int port;
+	GString * str;
+	char buf[2048];
+	char const * sdp;
 
 	snprintf(us.us_str, sizeof(us.us_str), "%s%s", "sip:",
 			request->call.number);
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s() \"%s\"\n", __func__, us.us_str);
 #endif
-	if((to = sip_to_make(sofia->home, us.us_str)) == NULL)
-		return -helper->error(helper->modem,
-				"Could not initiate the call", 1);
-	if((handle = _sofia_handle_add(sofia, SOFIA_HANDLE_TYPE_CALL, to))
+	if((handle = _sofia_handle_add(sofia, SOFIA_HANDLE_TYPE_CALL,
+					us.us_str, request->call.number))
 			== NULL)
 		return -helper->error(helper->modem,
 				"Could not initiate the call", 1);
-	to->a_display = request->call.number;
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s() nua_invite(\"%s\")\n", __func__,
 			us.us_str);
 #endif
-	nua_invite(handle, SOATAG_USER_SDP_STR(NULL),
+	/* gather the ICE candidates while the call is being set up */
+	str = g_string_new(NULL);
+	if((h = _sofia_handle_get(sofia, handle)) != NULL
+			&& (h->media = _sofia_media_new(sofia, handle, &port))
+			!= NULL)
+		_sofia_media_attributes(h->media, str);
+	else
+		port = _sofia_rtp_port(sofia);
+	sdp = _sofia_sdp_offer(sofia, NULL, port, str->str, buf, sizeof(buf));
+	g_string_free(str, TRUE);
+	nua_invite(handle, SOATAG_USER_SDP_STR(sdp),
 			SOATAG_RTP_SORT(SOA_RTP_SORT_REMOTE),
 			SOATAG_RTP_SELECT(SOA_RTP_SELECT_ALL), TAG_END());
 	return 0;
@@ -326,6 +794,7 @@ static int _request_dtmf_send(ModemPlugin * modem, ModemRequest * request)
 	Sofia * sofia = modem;
 	ModemPluginHelper * helper = sofia->helper;
 	nua_handle_t * handle;
+	SofiaHandle * h;
 	char buf[] = "Signal=X";
 
 #ifdef DEBUG
@@ -336,6 +805,9 @@ static int _request_dtmf_send(ModemPlugin * modem, ModemRequest * request)
 			== NULL)
 		return -helper->error(helper->modem, "Could not send DTMF", 1);
 	buf[sizeof(buf) - 2] = request->dtmf_send.dtmf;
+	if((h = _sofia_handle_get(sofia, handle)) != NULL && h->media != NULL)
+		g_queue_push_tail(&h->media->info,
+				GINT_TO_POINTER(SOFIA_INFO_TYPE_DTMF));
 	nua_info(handle, SIPTAG_CONTENT_TYPE_STR("application/dtmf-info"),
 			SIPTAG_PAYLOAD_STR(buf),
 			TAG_END());
@@ -347,7 +819,6 @@ static int _request_message_send(ModemPlugin * modem, ModemRequest * request)
 	Sofia * sofia = modem;
 	ModemPluginHelper * helper = sofia->helper;
 	url_string_t us;
-	sip_to_t * to;
 	nua_handle_t * handle;
 
 	snprintf(us.us_str, sizeof(us.us_str), "%s%s", "sip:",
@@ -355,11 +826,8 @@ static int _request_message_send(ModemPlugin * modem, ModemRequest * request)
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s() \"%s\"\n", __func__, us.us_str);
 #endif
-	if((to = sip_to_make(sofia->home, us.us_str)) == NULL)
-		return -helper->error(helper->modem, "Could not send message",
-				1);
-	if((handle = _sofia_handle_add(sofia, SOFIA_HANDLE_TYPE_MESSAGE, to))
-			== NULL)
+	if((handle = _sofia_handle_add(sofia, SOFIA_HANDLE_TYPE_MESSAGE,
+					us.us_str, NULL)) == NULL)
 		return -helper->error(helper->modem, "Could not send message",
 				1);
 	nua_message(handle, SIPTAG_CONTENT_TYPE_STR("text/plain"),
@@ -368,11 +836,83 @@ static int _request_message_send(ModemPlugin * modem, ModemRequest * request)
 	return 0;
 }
 
+static int _request_unsupported(ModemPlugin * modem, ModemRequest * request)
+{
+	Sofia * sofia = modem;
+	size_t i;
+
+	if(request->unsupported.modem != NULL
+			&& strcmp(request->unsupported.modem, plugin.name) != 0)
+		return 0;
+	switch(request->unsupported.request)
+	{
+		case SOFIA_REQUEST_RECORD_START:
+			return _sofia_record_start(sofia,
+					request->unsupported.arg);
+		case SOFIA_REQUEST_RECORD_STOP:
+			return _sofia_record_stop(sofia);
+		case SOFIA_REQUEST_RECORD_AUDIO:
+			_sofia_record_audio(sofia, request->unsupported.arg,
+					request->unsupported.size
+					/ sizeof(int16_t));
+			return 0;
+		case SOFIA_REQUEST_MEDIA_STATS:
+			for(i = 0; i < sofia->handles_cnt; i++)
+				if(sofia->handles[i].media != NULL)
+					_media_report(sofia->handles[i].media);
+			return 0;
+		case SOFIA_REQUEST_MEMORY_STATS:
+			_sofia_memory_report(sofia);
+			return 0;
+	}
+	return 0;
+}
+
 
 /* useful */
 /* sofia_handle_add */
+static SofiaHandle * _handle_insert(Sofia * sofia, SofiaHandleType type,
+		nua_handle_t * handle, su_home_t * home);
+
 static nua_handle_t * _sofia_handle_add(Sofia * sofia, SofiaHandleType type,
-		sip_to_t * to)
+		char const * to, char const * display)
+{
+	su_home_t * home;
+	sip_to_t * t = NULL;
+	nua_handle_t * handle;
+
+	/* allocate everything for this transaction in its own home */
+	if((home = su_home_new(sizeof(*home))) == NULL)
+		return NULL;
+	su_home_init_stats(home);
+	if(to != NULL)
+	{
+		if((t = sip_to_make(home, to)) == NULL)
+		{
+			su_home_unref(home);
+			return NULL;
+		}
+		t->a_display = su_strdup(home, display);
+	}
+	if((handle = nua_handle(sofia->nua, sofia,
+					TAG_IF(t, NUTAG_URL(t->a_url)),
+					TAG_IF(t, SIPTAG_TO(t)),
+					TAG_END())) == NULL)
+	{
+		su_home_unref(home);
+		return NULL;
+	}
+	if(_handle_insert(sofia, type, handle, home) == NULL)
+	{
+		nua_handle_destroy(handle);
+		su_home_unref(home);
+		return NULL;
+	}
+	return handle;
+}
+
+static SofiaHandle * _handle_insert(Sofia * sofia, SofiaHandleType type,
+		nua_handle_t * handle, su_home_t * home)
 {
 	size_t i;
 	SofiaHandle * p;
@@ -387,11 +927,50 @@ static nua_handle_t * _sofia_handle_add(Sofia * sofia, SofiaHandleType type,
 		sofia->handles = p;
 		sofia->handles_cnt++;
 	}
-	sofia->handles[i].type = type;
-	sofia->handles[i].handle = nua_handle(sofia->nua, sofia,
-			TAG_IF(to, NUTAG_URL(to->a_url)),
-			TAG_IF(to, SIPTAG_TO(to)), TAG_END());
-	return sofia->handles[i].handle;
+	p = &sofia->handles[i];
+	p->type = type;
+	p->handle = handle;
+	p->home = home;
+	p->media = NULL;
+	if(++sofia->homes_cnt > sofia->homes_peak)
+		sofia->homes_peak = sofia->homes_cnt;
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %lu homes (peak %lu)\n", __func__,
+			(unsigned long)sofia->homes_cnt,
+			(unsigned long)sofia->homes_peak);
+#endif
+	return p;
+}
+
+
+/* sofia_handle_adopt */
+static SofiaHandle * _sofia_handle_adopt(Sofia * sofia, SofiaHandleType type,
+		nua_handle_t * handle)
+{
+	su_home_t * home;
+	SofiaHandle * p;
+
+	/* track a handle created by nua */
+	if((home = su_home_new(sizeof(*home))) == NULL)
+		return NULL;
+	su_home_init_stats(home);
+	if((p = _handle_insert(sofia, type, handle, home)) == NULL)
+		su_home_unref(home);
+	return p;
+}
+
+
+/* sofia_handle_get */
+static SofiaHandle * _sofia_handle_get(Sofia * sofia, nua_handle_t * handle)
+{
+	size_t i;
+
+	if(handle == NULL)
+		return NULL;
+	for(i = 0; i < sofia->handles_cnt; i++)
+		if(sofia->handles[i].handle == handle)
+			return &sofia->handles[i];
+	return NULL;
 }
 
 
@@ -401,7 +980,8 @@ static nua_handle_t * _sofia_handle_lookup(Sofia * sofia, SofiaHandleType type)
 	size_t i;
 
 	for(i = 0; i < sofia->handles_cnt; i++)
-		if(sofia->handles[i].type == type)
+		if(sofia->handles[i].handle != NULL
+				&& sofia->handles[i].type == type)
 			return sofia->handles[i].handle;
 	return NULL;
 }
@@ -411,182 +991,2607 @@ static nua_handle_t * _sofia_handle_lookup(Sofia * sofia, SofiaHandleType type)
 static int _sofia_handle_remove(Sofia * sofia, nua_handle_t * handle)
 {
 	size_t i;
+	SofiaMemoryStats stats;
 
+	if(handle == NULL)
+		return -1;
 	for(i = 0; i < sofia->handles_cnt; i++)
 		if(sofia->handles[i].handle == handle)
 		{
-			/* FIXME also free memory */
-			nua_handle_destroy(sofia->handles[i].handle);
-			sofia->handles[i].handle = NULL;
+			/* the transaction is over, its memory at its peak */
+			_sofia_memory_stats(sofia, &stats);
+			_stop_handle(sofia, &sofia->handles[i]);
+#ifdef DEBUG
+			fprintf(stderr, "DEBUG: %s() %lu homes (peak %lu),"
+					" %lu bytes before (peak %lu)\n",
+					__func__,
+					(unsigned long)sofia->homes_cnt,
+					(unsigned long)sofia->homes_peak,
+					(unsigned long)stats.bytes,
+					(unsigned long)stats.bytes_peak);
+#endif
 			return 0;
 		}
 	return -1;
 }
 
 
-/* callbacks */
-/* sofia_callback */
-static void _callback_i_info(ModemPlugin * modem, int status,
-		sip_t const * sip);
-static void _callback_i_message(ModemPlugin * modem, int status,
-		sip_t const * sip);
-static void _callback_r_invite(ModemPlugin * modem, int status,
-		char const * phrase, nua_handle_t * handle);
-static void _callback_r_message(ModemPlugin * modem, int status,
-		char const * phrase);
-static void _callback_r_register(ModemPlugin * modem, int status,
-		nua_handle_t * nh, sip_t const * sip, tagi_t tags[]);
-
-static void _sofia_callback(nua_event_t event, int status, char const * phrase,
-		nua_t * nua, nua_magic_t * magic, nua_handle_t * nh,
-		nua_hmagic_t * hmagic, sip_t const * sip, tagi_t tags[])
+/* sofia_memory_report */
+static void _sofia_memory_report(Sofia * sofia)
 {
-	ModemPlugin * modem = magic;
-	Sofia * sofia = modem;
-	ModemPluginHelper * helper = modem->helper;
+	ModemPluginHelper * helper = sofia->helper;
 	ModemEvent mevent;
-	(void) nua;
-	(void) hmagic;
+	SofiaMemoryStats stats;
 
-#ifdef DEBUG
-	fprintf(stderr, "DEBUG: %s(%u)\n", __func__, event);
-#endif
-	switch(event)
-	{
-		case nua_i_error:
-			/* FIXME report error */
-			fprintf(stderr, "i_error %03d %s\n", status, phrase);
-			break;
-		case nua_i_invite:
-			/* FIXME report event: incoming call */
-			fprintf(stderr, "i_invite %03d %s\n", status, phrase);
-			break;
-		case nua_i_cancel:
-			/* FIXME report event: incoming call was cancelled */
-			fprintf(stderr, "i_invite %03d %s\n", status, phrase);
-			break;
-		case nua_i_info:
-			_callback_i_info(modem, status, sip);
-			break;
-		case nua_i_message:
-			_callback_i_message(modem, status, sip);
-			break;
-		case nua_i_notify:
-			/* FIXME report event */
-			fprintf(stderr, "i_notify %03d %s\n", status, phrase);
-			break;
-		case nua_i_outbound:
-			/* FIXME what to do? */
-			fprintf(stderr, "i_outbound %03d %s\n", status, phrase);
-			break;
-		case nua_i_state:
-			/* FIXME report event, particularly if 180 Ringing! */
-			fprintf(stderr, "i_state %03d %s\n", status, phrase);
-			break;
-		case nua_i_terminated:
-			memset(&mevent, 0, sizeof(mevent));
-			mevent.type = MODEM_EVENT_TYPE_CALL;
-			/* FIXME also remember the other fields */
-			mevent.call.status = MODEM_CALL_STATUS_NONE;
-			helper->event(helper->modem, &mevent);
-			break;
-		case nua_r_get_params:
-			if(status == 200)
-				break;
-			/* FIXME what to do? */
-			fprintf(stderr, "r_get_params %03d %s\n", status,
-					phrase);
-			break;
-		case nua_r_info:
-			if(status == 200)
-				break;
-			helper->error(helper->modem, "Could not send DTMF", 1);
-			break;
-		case nua_r_invite:
-			_callback_r_invite(modem, status, phrase, nh);
-			break;
-		case nua_r_message:
-			_callback_r_message(modem, status, phrase);
-			break;
-		case nua_r_register:
-			_callback_r_register(modem, status, nh, sip, tags);
-			break;
-		case nua_r_set_params:
-			if(status == 200)
-				break;
-			/* FIXME implement */
-			fprintf(stderr, "r_set_params %03d %s\n", status,
-					phrase);
-			break;
-		case nua_r_shutdown:
-			/* exit the background loop when ready */
-			if(status == 200)
-				su_root_break(sofia->root);
-			break;
-		default:
-#ifdef DEBUG
-			fprintf(stderr, "DEBUG: %s() %s%d%s: %03d \"%s\"\n",
-					__func__, "event ", event,
-					" not handled: ", status, phrase);
-#endif
-			break;
-	}
+	_sofia_memory_stats(sofia, &stats);
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_UNSUPPORTED;
+	mevent.unsupported.modem = plugin.name;
+	mevent.unsupported.request = SOFIA_REQUEST_MEMORY_STATS;
+	mevent.unsupported.data = &stats;
+	mevent.unsupported.size = sizeof(stats);
+	helper->event(helper->modem, &mevent);
 }
 
-static void _callback_i_info(ModemPlugin * modem, int status, sip_t const * sip)
+
+/* sofia_memory_stats */
+static uint64_t _memory_stats_home(su_home_t * home);
+
+static void _sofia_memory_stats(Sofia * sofia, SofiaMemoryStats * stats)
 {
-	Sofia * sofia = modem;
-	ModemPluginHelper * helper = sofia->helper;
-	ModemEvent mevent;
-	sip_from_t const * from;
-	sip_to_t const * to;
+	size_t i;
 
-	if(status != 200)
-		/* FIXME report whatever that is */
-		return;
-	/* a notification arrived */
-	if(sip == NULL || (from = sip->sip_from) == NULL
-			|| (to = sip->sip_to) == NULL)
-		/* FIXME report whatever that is */
-		return;
-	memset(&mevent, 0, sizeof(mevent));
-	mevent.type = MODEM_EVENT_TYPE_NOTIFICATION;
-	/* FIXME we may want to include more information */
-	mevent.notification.content = sip->sip_payload->pl_data;
-	helper->event(helper->modem, &mevent);
+	memset(stats, 0, sizeof(*stats));
+	stats->homes = sofia->homes_cnt;
+	stats->homes_peak = sofia->homes_peak;
+	for(i = 0; i < sofia->handles_cnt; i++)
+		if(sofia->handles[i].home != NULL)
+			stats->bytes += _memory_stats_home(
+					sofia->handles[i].home);
+	/* as sampled when asked and when transactions complete */
+	sofia->bytes_peak = MAX(sofia->bytes_peak, stats->bytes);
+	stats->bytes_peak = sofia->bytes_peak;
+	stats->shared = _memory_stats_home(sofia->home);
 }
 
-static void _callback_i_message(ModemPlugin * modem, int status,
-		sip_t const * sip)
+static uint64_t _memory_stats_home(su_home_t * home)
 {
-	Sofia * sofia = modem;
-	ModemPluginHelper * helper = sofia->helper;
-	ModemEvent mevent;
-	sip_from_t const * from;
-	sip_to_t const * to;
-	char buf[256];
+	su_home_stat_t stats;
 
-	if(status != 200)
-		/* FIXME report whatever that is */
-		return;
-	/* a message arrived */
-	if(sip == NULL || (from = sip->sip_from) == NULL
+	memset(&stats, 0, sizeof(stats));
+	su_home_get_stats(home, 0, &stats, sizeof(stats));
+	/* the blocks still allocated */
+	return stats.hs_blocks.hsb_bytes;
+}
+
+
+/* sofia_sender */
+static char const * _sofia_sender(Sofia * sofia, url_t const * url)
+{
+	SofiaSender * sender = &sofia->senders[0];
+	size_t i;
+
+	/* formatted once per remote URI, and not once per message */
+	for(i = 0; i < SOFIA_SENDERS; i++)
+	{
+		if(sofia->senders[i].url != NULL
+				&& url_cmp(sofia->senders[i].url, url) == 0)
+		{
+			sofia->senders[i].used = ++sofia->senders_used;
+			return sofia->senders[i].number;
+		}
+		if(sofia->senders[i].used < sender->used)
+			sender = &sofia->senders[i];
+	}
+	/* replace the least recently used */
+	su_free(sofia->home, sender->url);
+	su_free(sofia->home, sender->number);
+	sender->number = NULL;
+	if((sender->url = url_hdup(sofia->home, url)) == NULL
+			|| (sender->number = url_as_string(sofia->home, url))
+			== NULL)
+	{
+		su_free(sofia->home, sender->url);
+		sender->url = NULL;
+		sender->used = 0;
+		return NULL;
+	}
+	sender->used = ++sofia->senders_used;
+	return sender->number;
+}
+
+
+/* sdp */
+/* sofia_sdp_update */
+static char const * _sdp_update_address(Sofia * sofia, int * family);
+
+static int _sofia_sdp_update(Sofia * sofia)
+{
+	su_localinfo_t hints;
+	su_localinfo_t * res = NULL;
+	su_localinfo_t * li;
+	char const * address;
+	char const * codecs;
+	int family = AF_INET;
+	GString * formats;
+	GString * attributes;
+	gchar ** p;
+	size_t i;
+	size_t j;
+
+	if((address = _sdp_update_address(sofia, &family)) == NULL)
+	{
+		/* lookup the first global or site-local address */
+		memset(&hints, 0, sizeof(hints));
+		hints.li_flags = LI_CANONNAME | LI_NUMERIC;
+		if(su_getlocalinfo(&hints, &res) == 0)
+			for(li = res; li != NULL; li = li->li_next)
+				if(li->li_scope != LI_SCOPE_HOST
+						&& li->li_scope != LI_SCOPE_LINK)
+				{
+					address = li->li_canonname;
+					family = li->li_family;
+					break;
+				}
+		if(address == NULL)
+			address = "127.0.0.1";
+	}
+	codecs = _sofia_sdp_codecs(sofia);
+	if(sofia->sdp_address != NULL
+			&& strcmp(sofia->sdp_address, address) == 0
+			&& sofia->sdp_codecs != NULL
+			&& strcmp(sofia->sdp_codecs, codecs) == 0)
+	{
+		/* the template is still valid */
+		if(res != NULL)
+			su_freelocalinfo(res);
+		return 0;
+	}
+	_sofia_sdp_invalidate(sofia);
+	/* the formats offered, and their attributes */
+	formats = g_string_new(NULL);
+	attributes = g_string_new(NULL);
+	p = g_strsplit(codecs, ",", -1);
+	for(i = 0; p[i] != NULL; i++)
+		for(j = 0; j < G_N_ELEMENTS(_sofia_codecs); j++)
+		{
+			if(strcmp(p[i], _sofia_codecs[j].name) != 0)
+				continue;
+			g_string_append_printf(formats, " %u",
+					_sofia_codecs[j].payload);
+			g_string_append_printf(attributes, "a=rtpmap:%u %s\r\n",
+					_sofia_codecs[j].payload,
+					_sofia_codecs[j].rtpmap);
+			if(_sofia_codecs[j].fmtp != NULL)
+				g_string_append_printf(attributes,
+						"a=fmtp:%u %s\r\n",
+						_sofia_codecs[j].payload,
+						_sofia_codecs[j].fmtp);
+		}
+	g_strfreev(p);
+	sofia->sdp_address = su_strdup(sofia->home, address);
+	sofia->sdp_family = family;
+	sofia->sdp_codecs = su_strdup(sofia->home, codecs);
+	sofia->sdp_formats = su_strdup(sofia->home, formats->str);
+	sofia->sdp_attributes = su_strdup(sofia->home, attributes->str);
+	g_string_free(formats, TRUE);
+	g_string_free(attributes, TRUE);
+	if(res != NULL)
+		su_freelocalinfo(res);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() \"%s\" \"%s\"\n", __func__,
+			sofia->sdp_address, sofia->sdp_codecs);
+#endif
+	if(sofia->sdp_address == NULL || sofia->sdp_codecs == NULL
+			|| sofia->sdp_formats == NULL
+			|| sofia->sdp_attributes == NULL)
+	{
+		_sofia_sdp_invalidate(sofia);
+		return -1;
+	}
+	return 0;
+}
+
+static char const * _sdp_update_address(Sofia * sofia, int * family)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	char const * p;
+
+	/* use the bind address if it is numeric */
+	if((p = helper->config_get(helper->modem, "bind")) == NULL
+			|| strlen(p) == 0)
+		return NULL;
+	/* the unspecified addresses (0.0.0.0, ::) cannot be offered */
+	if(strspn(p, "0.:") == strlen(p))
+		return NULL;
+	if(strspn(p, "0123456789.") == strlen(p))
+		*family = AF_INET;
+	else if(strspn(p, "0123456789abcdefABCDEF:") == strlen(p))
+		*family = AF_INET6;
+	else
+		return NULL;
+	return p;
+}
+
+
+/* sofia_sdp_codecs */
+static char const * _sofia_sdp_codecs(Sofia * sofia)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	char const * codecs;
+
+	if((codecs = helper->config_get(helper->modem, "codecs")) == NULL
+			|| strlen(codecs) == 0)
+		codecs = SOFIA_SDP_CODECS;
+	return codecs;
+}
+
+
+/* sofia_sdp_invalidate */
+static void _sofia_sdp_invalidate(Sofia * sofia)
+{
+	if(sofia->sdp_address != NULL)
+		su_free(sofia->home, sofia->sdp_address);
+	sofia->sdp_address = NULL;
+	if(sofia->sdp_codecs != NULL)
+		su_free(sofia->home, sofia->sdp_codecs);
+	sofia->sdp_codecs = NULL;
+	if(sofia->sdp_formats != NULL)
+		su_free(sofia->home, sofia->sdp_formats);
+	sofia->sdp_formats = NULL;
+	if(sofia->sdp_attributes != NULL)
+		su_free(sofia->home, sofia->sdp_attributes);
+	sofia->sdp_attributes = NULL;
+}
+
+
+/* sofia_sdp_offer */
+static char const * _sofia_sdp_offer(Sofia * sofia, char const * address,
+		unsigned int port, char const * attributes, char * buf,
+		size_t size)
+{
+	char const * ip;
+	unsigned long session;
+	int res;
+
+	/* the codecs may have been configured since */
+	if(sofia->sdp_codecs != NULL && strcmp(sofia->sdp_codecs,
+				_sofia_sdp_codecs(sofia)) != 0)
+		_sofia_sdp_invalidate(sofia);
+	if(sofia->sdp_codecs == NULL && _sofia_sdp_update(sofia) != 0)
+		/* let the offer/answer engine generate it */
+		return NULL;
+	ip = (sofia->sdp_family == AF_INET6) ? "6" : "4";
+	session = sofia->sdp_session++;
+	/* the connection may go through another (IPv4) address */
+	res = snprintf(buf, size, "v=0\r\no=- %lu %lu IN IP%s %s\r\n"
+			"s=-\r\nc=IN IP%s %s\r\nt=0 0\r\n"
+			"m=audio %u RTP/AVP%s\r\n%sa=sendrecv\r\n%s",
+			session, session, ip, sofia->sdp_address,
+			(address != NULL) ? "4" : ip,
+			(address != NULL) ? address : sofia->sdp_address,
+			port, sofia->sdp_formats,
+			sofia->sdp_attributes, attributes);
+	if(res < 0 || (size_t)res >= size)
+		return NULL;
+	return buf;
+}
+
+
+/* sofia_rtp_port */
+static unsigned int _sofia_rtp_port(Sofia * sofia)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	char const * p;
+	unsigned int port;
+
+	/* allocate an even port for RTP */
+	if(sofia->rtp_port == 0)
+	{
+		if((p = helper->config_get(helper->modem, "rtp_port")) == NULL
+				|| (port = strtoul(p, NULL, 10)) == 0
+				|| port > SOFIA_RTP_PORT_MAX)
+			port = SOFIA_RTP_PORT;
+		sofia->rtp_port = port & ~1;
+	}
+	port = sofia->rtp_port;
+	if((sofia->rtp_port += 2) > SOFIA_RTP_PORT_MAX)
+		sofia->rtp_port = 0;
+	return port;
+}
+
+
+/* ice */
+/* sofia_ice_resolve */
+static int _ice_resolve_server(char const * server, struct sockaddr_in * sa);
+
+static void _sofia_ice_resolve(Sofia * sofia)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	char const * p;
+	gchar ** servers;
+	size_t i;
+
+	/* resolve the servers once, instead of for every call */
+	sofia->stun_cnt = 0;
+	if((p = helper->config_get(helper->modem, "stun_servers")) != NULL)
+	{
+		servers = g_strsplit(p, ",", -1);
+		for(i = 0; servers[i] != NULL
+				&& sofia->stun_cnt < SOFIA_ICE_SERVERS; i++)
+			if(_ice_resolve_server(g_strstrip(servers[i]),
+						&sofia->stun[sofia->stun_cnt])
+					== 0)
+				sofia->stun_cnt++;
+		g_strfreev(servers);
+	}
+	memset(&sofia->turn, 0, sizeof(sofia->turn));
+	if((p = helper->config_get(helper->modem, "turn_server")) != NULL)
+		_ice_resolve_server(p, &sofia->turn);
+}
+
+static int _ice_resolve_server(char const * server, struct sockaddr_in * sa)
+{
+	struct addrinfo hints;
+	struct addrinfo * ai;
+	char host[256];
+	char const * port = SOFIA_STUN_PORT;
+	char * p;
+
+	if(strlen(server) == 0 || strlen(server) >= sizeof(host))
+		return -1;
+	snprintf(host, sizeof(host), "%s", server);
+	if((p = strchr(host, ':')) != NULL)
+	{
+		*(p++) = '\0';
+		port = p;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if(getaddrinfo(host, port, &hints, &ai) != 0)
+		return -1;
+	memcpy(sa, ai->ai_addr, sizeof(*sa));
+	freeaddrinfo(ai);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s(\"%s\") %s:%u\n", __func__, server,
+			inet_ntoa(sa->sin_addr), ntohs(sa->sin_port));
+#endif
+	return 0;
+}
+
+
+/* media */
+/* sofia_media_new */
+static int _media_candidate_add(SofiaCandidate * candidates, size_t * cnt,
+		SofiaCandidateType type, struct sockaddr_in const * addr,
+		uint32_t priority);
+static void _media_random(char * buf, size_t size);
+
+static SofiaMedia * _sofia_media_new(Sofia * sofia, nua_handle_t * handle,
+		unsigned int * port)
+{
+	SofiaMedia * media;
+	struct sockaddr_in sa;
+	su_localinfo_t hints;
+	su_localinfo_t * res;
+	su_localinfo_t * li;
+	GIOChannel * channel;
+	size_t i;
+
+	if((media = object_new(sizeof(*media))) == NULL)
+		return NULL;
+	memset(media, 0, sizeof(*media));
+	media->sofia = sofia;
+	media->handle = handle;
+	media->dialled = g_get_monotonic_time();
+	media->selected = -1;
+	if((media->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	{
+		object_delete(media);
+		return NULL;
+	}
+	/* look for a free port */
+	for(i = 0; i < SOFIA_ICE_BIND; i++)
+	{
+		*port = _sofia_rtp_port(sofia);
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(*port);
+		sa.sin_addr.s_addr = htonl(INADDR_ANY);
+		if(bind(media->fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			break;
+	}
+	media->port = *port;
+	if(i == SOFIA_ICE_BIND
+			|| fcntl(media->fd, F_SETFL, fcntl(media->fd, F_GETFL)
+				| O_NONBLOCK) != 0)
+	{
+		close(media->fd);
+		object_delete(media);
+		return NULL;
+	}
+	_media_random(media->ufrag, sizeof(media->ufrag));
+	_media_random(media->pwd, sizeof(media->pwd));
+	media->tiebreaker = ((uint64_t)g_random_int() << 32) | g_random_int();
+	media->rtp.ssrc = g_random_int();
+	g_queue_init(&media->info);
+	/* host candidates */
+	memset(&hints, 0, sizeof(hints));
+	hints.li_family = AF_INET;
+	if(su_getlocalinfo(&hints, &res) == 0)
+	{
+		for(li = res; li != NULL; li = li->li_next)
+		{
+			if(li->li_scope == LI_SCOPE_HOST
+					|| li->li_scope == LI_SCOPE_LINK)
+				continue;
+			memcpy(&sa, li->li_addr, sizeof(sa));
+			sa.sin_port = htons(*port);
+			_media_candidate_add(media->local, &media->local_cnt,
+					SOFIA_CANDIDATE_HOST, &sa, 0);
+		}
+		su_freelocalinfo(res);
+	}
+	channel = g_io_channel_unix_new(media->fd);
+	media->source = g_io_add_watch(channel, G_IO_IN, _media_on_io,
+			media);
+	g_io_channel_unref(channel);
+	/* gather the other candidates in parallel with the call setup */
+	for(i = 0; i < sofia->stun_cnt; i++)
+		_media_transaction(media, SOFIA_STUN_TYPE_GATHER,
+				&sofia->stun[i], 0, 0, 0);
+	if(sofia->turn.sin_family == AF_INET)
+		_media_transaction(media, SOFIA_STUN_TYPE_ALLOCATE,
+				&sofia->turn, 0, 0, 0);
+	return media;
+}
+
+static int _media_candidate_add(SofiaCandidate * candidates, size_t * cnt,
+		SofiaCandidateType type, struct sockaddr_in const * addr,
+		uint32_t priority)
+{
+	/* type preferences from RFC 8445 */
+	static const uint32_t preferences[SOFIA_CANDIDATE_COUNT] =
+	{ 126, 100, 0 };
+	size_t i;
+
+	for(i = 0; i < *cnt; i++)
+		if(candidates[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr
+				&& candidates[i].addr.sin_port
+				== addr->sin_port)
+			return -1;
+	if(*cnt == SOFIA_ICE_CANDIDATES)
+		return -1;
+	memset(&candidates[i], 0, sizeof(candidates[i]));
+	candidates[i].type = type;
+	candidates[i].addr = *addr;
+	/* there is only one component (RTP) */
+	candidates[i].priority = (priority != 0) ? priority
+		: (preferences[type] << 24) | ((65535 - i) << 8) | 255;
+	candidates[i].rtt = -1;
+	(*cnt)++;
+	return 0;
+}
+
+static void _media_random(char * buf, size_t size)
+{
+	char const chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		"0123456789+/";
+	size_t i;
+
+	for(i = 0; i + 1 < size; i++)
+		buf[i] = chars[g_random_int_range(0, sizeof(chars) - 1)];
+	buf[i] = '\0';
+}
+
+
+/* sofia_media_delete */
+static void _sofia_media_delete(SofiaMedia * media)
+{
+	if(media->rtcp != 0)
+		g_source_remove(media->rtcp);
+	if(media->refresh != 0)
+		g_source_remove(media->refresh);
+	if(media->allocated)
+	{
+		/* release the allocation, without waiting for the answer */
+		media->allocated = 0;
+		_media_transaction(media, SOFIA_STUN_TYPE_REFRESH,
+				&media->sofia->turn, 0, 0, 0);
+	}
+	if(media->timeout != 0)
+		g_source_remove(media->timeout);
+	if(media->source != 0)
+		g_source_remove(media->source);
+	close(media->fd);
+	g_queue_clear(&media->info);
+	object_delete(media);
+}
+
+
+/* sofia_media_attributes */
+static void _media_attributes_candidate(SofiaMedia * media, GString * str,
+		SofiaCandidate * candidate);
+
+static void _sofia_media_attributes(SofiaMedia * media, GString * str)
+{
+	size_t i;
+
+	g_string_append_printf(str, "a=ice-ufrag:%s\r\na=ice-pwd:%s\r\n"
+			"a=ice-options:trickle\r\n", media->ufrag, media->pwd);
+	/* RTCP shares the RTP port (RFC 5761) */
+	g_string_append(str, "a=rtcp-mux\r\n"
+			"a=rtcp-xr:rcvr-rtt=all voip-metrics\r\n");
+	for(i = 0; i < media->local_cnt; i++)
+		if(!media->local[i].trickled)
+			_media_attributes_candidate(media, str,
+					&media->local[i]);
+}
+
+static void _media_attributes_candidate(SofiaMedia * media, GString * str,
+		SofiaCandidate * candidate)
+{
+	static char const * types[SOFIA_CANDIDATE_COUNT] =
+	{ "host", "srflx", "relay" };
+	char addr[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &candidate->addr.sin_addr, addr, sizeof(addr));
+	g_string_append_printf(str, "a=candidate:%u 1 UDP %u %s %u typ %s",
+			candidate->type + 1, candidate->priority, addr,
+			ntohs(candidate->addr.sin_port),
+			types[candidate->type]);
+	if(candidate->type != SOFIA_CANDIDATE_HOST && media->local_cnt > 0)
+	{
+		/* the base is the first host candidate */
+		inet_ntop(AF_INET, &media->local[0].addr.sin_addr, addr,
+				sizeof(addr));
+		g_string_append_printf(str, " raddr %s rport %u", addr,
+				ntohs(media->local[0].addr.sin_port));
+	}
+	g_string_append(str, "\r\n");
+	candidate->trickled = 1;
+}
+
+
+/* sofia_media_dialog */
+static void _sofia_media_dialog(SofiaMedia * media)
+{
+	media->dialog = 1;
+	_media_trickle(media);
+}
+
+
+/* sofia_media_ready */
+static void _sofia_media_ready(SofiaMedia * media)
+{
+	media->ready = 1;
+	/* the offer can only be updated once the call is established */
+	if(media->update)
+		_media_update(media);
+}
+
+
+/* sofia_media_remote */
+static void _media_remote_candidate(SofiaMedia * media, char const * line);
+
+static void _sofia_media_remote(SofiaMedia * media, char const * sdp)
+{
+	char const * p;
+	char const * q;
+	char line[256];
+	size_t len;
+	size_t i;
+
+	for(p = sdp; p != NULL && *p != '\0'; p = (*q != '\0') ? q + 1 : q)
+	{
+		if((q = strchr(p, '\n')) == NULL)
+			q = p + strlen(p);
+		if((len = q - p) > 0 && p[len - 1] == '\r')
+			len--;
+		if(len >= sizeof(line))
+			continue;
+		memcpy(line, p, len);
+		line[len] = '\0';
+		if(strncmp(line, "a=ice-ufrag:", 12) == 0)
+			snprintf(media->rufrag, sizeof(media->rufrag), "%s",
+					&line[12]);
+		else if(strncmp(line, "a=ice-pwd:", 10) == 0)
+			snprintf(media->rpwd, sizeof(media->rpwd), "%s",
+					&line[10]);
+		else if(strncmp(line, "a=candidate:", 12) == 0)
+			_media_remote_candidate(media, &line[12]);
+	}
+	if(media->rufrag[0] == '\0' || media->rpwd[0] == '\0')
+		/* the remote side does not support ICE */
+		return;
+	/* check the connectivity with every new remote candidate */
+	for(i = 0; i < media->remote_cnt; i++)
+		if(!media->remote[i].checking)
+		{
+			media->remote[i].checking = 1;
+			_media_transaction(media, SOFIA_STUN_TYPE_CHECK,
+					&media->remote[i].addr, i, 0, 0);
+		}
+	/* and through the relay, once allowed to */
+	if(media->allocated)
+		_media_permission(media);
+}
+
+static void _media_remote_candidate(SofiaMedia * media, char const * line)
+{
+	char foundation[33];
+	unsigned int component;
+	char transport[4];
+	unsigned int priority;
+	char addr[INET_ADDRSTRLEN + 1];
+	unsigned int port;
+	struct sockaddr_in sa;
+
+	if(sscanf(line, "%32s %u %3s %u %16s %u", foundation, &component,
+				transport, &priority, addr, &port) != 6
+			|| component != 1 || strcasecmp(transport, "UDP") != 0
+			|| port == 0 || port > 65535)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if(inet_pton(AF_INET, addr, &sa.sin_addr) != 1)
+		return;
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %s:%u\n", __func__, addr, port);
+#endif
+	_media_candidate_add(media->remote, &media->remote_cnt,
+			SOFIA_CANDIDATE_HOST, &sa, priority);
+}
+
+
+/* sofia_media_stats */
+static double _media_stats_mos(double loss, double burst, int64_t delay);
+
+static void _sofia_media_stats(SofiaMedia * media, SofiaMediaStats * stats)
+{
+	SofiaRtp * rtp = &media->rtp;
+	uint32_t expected;
+	uint64_t packets;
+	uint64_t lost;
+	uint64_t rl;
+	uint64_t lr;
+	double p;
+	double q;
+	gint64 elapsed;
+
+	memset(stats, 0, sizeof(*stats));
+	if(media->connected != 0)
+		stats->setup = media->connected - media->dialled;
+	if(media->selected >= 0)
+	{
+		stats->rtt = media->remote[media->selected].rtt;
+		stats->address = media->remote[media->selected].addr;
+	}
+	if(rtp->rtt != 0)
+		stats->rtt = rtp->rtt;
+	stats->remote = rtp->remote;
+	stats->cpu = rtp->cpu;
+	if((elapsed = g_get_monotonic_time() - rtp->since) > 0
+			&& rtp->since != 0)
+		stats->load = (double)rtp->cpu / elapsed;
+	if(!rtp->started)
+		return;
+	expected = rtp->cycles + rtp->max_seq - rtp->base_seq + 1;
+	stats->received = rtp->received;
+	stats->lost = (int64_t)expected - (int64_t)rtp->received;
+	if(expected > 0 && stats->lost > 0)
+		stats->local.loss = (double)stats->lost / expected;
+	/* include the burst in progress */
+	packets = rtp->burst_packets;
+	lost = rtp->burst_lost;
+	if(rtp->current_lost > 1)
+	{
+		packets += rtp->current_packets;
+		lost += rtp->current_lost;
+	}
+	if(packets > 0)
+		stats->local.burst = (double)lost / packets;
+	stats->local.jitter = rtp->jitter * 1000000 / SOFIA_RTP_CLOCK;
+	stats->local.buffer = (rtp->buffer != 0) ? rtp->buffer
+		: rtp->transit_max - rtp->transit_min;
+	/* the burst ratio of the loss (ITU-T G.113) */
+	rl = rtp->transitions[0][1];
+	lr = rtp->transitions[1][0];
+	p = (rl > 0) ? (double)rl / (rtp->transitions[0][0] + rl) : 0.0;
+	q = (lr > 0) ? (double)lr / (rtp->transitions[1][1] + lr) : 1.0;
+	stats->local.mos = _media_stats_mos(stats->local.loss,
+			(p + q > 0.0) ? 1.0 / (p + q) : 1.0,
+			stats->rtt / 2 + stats->local.buffer
+			+ SOFIA_RTP_PTIME * 1000);
+}
+
+static double _media_stats_mos(double loss, double burst, int64_t delay)
+{
+	/* simplified E-model (ITU-T G.107) for G.711 with concealment */
+	const double bpl = 25.1;
+	double d = delay / 1000.0;
+	double ppl = loss * 100.0;
+	double r;
+
+	r = 93.2 - 0.024 * d;
+	if(d > 177.3)
+		r -= 0.11 * (d - 177.3);
+	if(ppl > 0.0)
+		r -= 95.0 * ppl / (ppl / burst + bpl);
+	if(r <= 0.0)
+		return 1.0;
+	if(r >= 100.0)
+		return 4.5;
+	return 1.0 + 0.035 * r + 0.000007 * r * (r - 60.0) * (100.0 - r);
+}
+
+
+/* media_audio */
+static void _media_audio(SofiaMedia * media, unsigned char const * buf,
+		size_t len)
+{
+	Sofia * sofia = media->sofia;
+	int16_t samples[SOFIA_MEDIA_SIZE];
+	size_t offset;
+	size_t i;
+
+	if(sofia->recorder == NULL)
+		return;
+	/* skip the contributing sources and the header extension */
+	offset = 12 + (buf[0] & 0x0f) * 4;
+	if((buf[0] & 0x10) && offset + 4 <= len)
+		offset += 4 + _rtp_uint16_get(&buf[offset + 2]) * 4;
+	/* and the padding */
+	if((buf[0] & 0x20) && buf[len - 1] <= len)
+		len -= buf[len - 1];
+	if(offset >= len || len - offset > G_N_ELEMENTS(samples))
+		return;
+	/* decode the payload for the recorder */
+	switch(buf[1] & 0x7f)
+	{
+		case 0: /* PCMU */
+			for(i = offset; i < len; i++)
+				samples[i - offset] = _rtp_ulaw(buf[i]);
+			break;
+		case 8: /* PCMA */
+			for(i = offset; i < len; i++)
+				samples[i - offset] = _rtp_alaw(buf[i]);
+			break;
+		default:
+			/* not decoded here */
+			return;
+	}
+	_sofia_record_audio(sofia, samples, len - offset);
+}
+
+
+/* media_credentials */
+static void _media_credentials(SofiaMedia * media, SofiaStun * stun)
+{
+	ModemPluginHelper * helper = media->sofia->helper;
+	char const * username;
+
+	if(media->realm[0] == '\0')
+		/* not challenged yet */
+		return;
+	/* authenticate with the long-term credentials */
+	if((username = helper->config_get(helper->modem, "turn_username"))
+			== NULL)
+		username = "";
+	_stun_attribute(stun, SOFIA_STUN_USERNAME, username, strlen(username));
+	_stun_attribute(stun, SOFIA_STUN_REALM, media->realm,
+			strlen(media->realm));
+	_stun_attribute(stun, SOFIA_STUN_NONCE, media->nonce,
+			strlen(media->nonce));
+	_stun_integrity(stun, media->key, sizeof(media->key));
+}
+
+
+/* media_report */
+static void _media_report(SofiaMedia * media)
+{
+	Sofia * sofia = media->sofia;
+	ModemPluginHelper * helper = sofia->helper;
+	ModemEvent mevent;
+	SofiaMediaStats stats;
+
+	_sofia_media_stats(media, &stats);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() setup %lu us, rtt %lu us, loss %.3f,"
+			" jitter %lu us, MOS %.2f (remote %.2f), load %.3f\n",
+			__func__, (unsigned long)stats.setup,
+			(unsigned long)stats.rtt, stats.local.loss,
+			(unsigned long)stats.local.jitter, stats.local.mos,
+			stats.remote.mos, stats.load);
+#endif
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_UNSUPPORTED;
+	mevent.unsupported.modem = plugin.name;
+	mevent.unsupported.request = SOFIA_REQUEST_MEDIA_STATS;
+	mevent.unsupported.data = &stats;
+	mevent.unsupported.size = sizeof(stats);
+	helper->event(helper->modem, &mevent);
+}
+
+
+/* media_rtcp */
+static void _rtcp_blocks(SofiaRtp * rtp, unsigned char const * buf, size_t len,
+		unsigned int count, uint32_t ntp);
+static void _rtcp_rtt(SofiaRtp * rtp, uint32_t rtt);
+static void _rtcp_xr(SofiaRtp * rtp, unsigned char const * buf, size_t len,
+		uint32_t ntp);
+
+static void _media_rtcp(SofiaMedia * media, unsigned char const * buf,
+		size_t len)
+{
+	SofiaRtp * rtp = &media->rtp;
+	uint32_t msw;
+	uint32_t lsw;
+	uint32_t ntp;
+	size_t size;
+
+	_rtp_ntp(g_get_real_time(), &msw, &lsw);
+	ntp = (msw << 16) | (lsw >> 16);
+	/* walk the compound packet */
+	for(; len >= 8; buf += size, len -= size)
+	{
+		size = ((size_t)_rtp_uint16_get(&buf[2]) + 1) * 4;
+		if((buf[0] & 0xc0) != 0x80 || size < 8 || size > len)
+			return;
+		switch(buf[1])
+		{
+			case SOFIA_RTCP_SR:
+				if(size < 28)
+					break;
+				rtp->lsr = (_rtp_uint32_get(&buf[8]) << 16)
+					| (_rtp_uint32_get(&buf[12]) >> 16);
+				rtp->lsr_time = g_get_monotonic_time();
+				_rtcp_blocks(rtp, &buf[28], size - 28,
+						buf[0] & 0x1f, ntp);
+				break;
+			case SOFIA_RTCP_RR:
+				_rtcp_blocks(rtp, &buf[8], size - 8,
+						buf[0] & 0x1f, ntp);
+				break;
+			case SOFIA_RTCP_XR:
+				_rtcp_xr(rtp, &buf[8], size - 8, ntp);
+				break;
+		}
+	}
+}
+
+static void _rtcp_blocks(SofiaRtp * rtp, unsigned char const * buf, size_t len,
+		unsigned int count, uint32_t ntp)
+{
+	uint32_t lsr;
+
+	for(; count > 0 && len >= 24; count--, buf += 24, len -= 24)
+	{
+		if(_rtp_uint32_get(buf) != rtp->ssrc)
+			continue;
+		rtp->remote.loss = buf[4] / 256.0;
+		rtp->remote.jitter = (int64_t)_rtp_uint32_get(&buf[12])
+			* 1000000 / SOFIA_RTP_CLOCK;
+		if((lsr = _rtp_uint32_get(&buf[16])) != 0)
+			_rtcp_rtt(rtp, ntp - lsr - _rtp_uint32_get(&buf[20]));
+	}
+}
+
+static void _rtcp_rtt(SofiaRtp * rtp, uint32_t rtt)
+{
+	/* in units of 1/65536 seconds */
+	if(rtt < 0x80000000)
+		rtp->rtt = (gint64)rtt * 1000000 / 65536;
+}
+
+static void _rtcp_xr(SofiaRtp * rtp, unsigned char const * buf, size_t len,
+		uint32_t ntp)
+{
+	size_t size;
+	size_t i;
+	uint32_t lrr;
+
+	for(; len >= 4; buf += size, len -= size)
+	{
+		size = ((size_t)_rtp_uint16_get(&buf[2]) + 1) * 4;
+		if(size > len)
+			return;
+		switch(buf[0])
+		{
+			case SOFIA_RTCP_XR_RRTR:
+				if(size < 12)
+					break;
+				rtp->lrr = (_rtp_uint32_get(&buf[4]) << 16)
+					| (_rtp_uint32_get(&buf[8]) >> 16);
+				rtp->lrr_time = g_get_monotonic_time();
+				break;
+			case SOFIA_RTCP_XR_DLRR:
+				for(i = 4; i + 12 <= size; i += 12)
+				{
+					if(_rtp_uint32_get(&buf[i]) != rtp->ssrc
+							|| (lrr = _rtp_uint32_get(
+									&buf[i + 4]))
+							== 0)
+						continue;
+					_rtcp_rtt(rtp, ntp - lrr
+							- _rtp_uint32_get(
+								&buf[i + 8]));
+				}
+				break;
+			case SOFIA_RTCP_XR_VOIP:
+				if(size < 36 || _rtp_uint32_get(&buf[4])
+						!= rtp->ssrc)
+					break;
+				rtp->remote.loss = buf[8] / 256.0;
+				rtp->remote.burst = buf[10] / 256.0;
+				/* 127 means unavailable */
+				rtp->remote.mos = (buf[26] != 127)
+					? buf[26] / 10.0 : 0.0;
+				rtp->remote.buffer = (int64_t)_rtp_uint16_get(
+						&buf[30]) * 1000;
+				break;
+		}
+	}
+}
+
+
+/* media_rtcp_send */
+static void _media_rtcp_send(SofiaMedia * media)
+{
+	SofiaRtp * rtp = &media->rtp;
+	SofiaMediaStats stats;
+	unsigned char buf[256];
+	gint64 now = g_get_monotonic_time();
+	uint32_t expected;
+	uint32_t interval;
+	uint32_t fraction = 0;
+	int64_t lost;
+	uint32_t msw;
+	uint32_t lsw;
+	size_t len;
+	size_t pos;
+	size_t n;
+
+	if(media->selected < 0)
+		return;
+	_sofia_media_stats(media, &stats);
+	/* receiver report */
+	buf[0] = 0x80 | (rtp->started ? 1 : 0);
+	buf[1] = SOFIA_RTCP_RR;
+	_stun_uint32(&buf[4], rtp->ssrc);
+	len = 8;
+	if(rtp->started)
+	{
+		expected = rtp->cycles + rtp->max_seq - rtp->base_seq + 1;
+		interval = expected - rtp->expected_prior;
+		lost = (int64_t)interval
+			- (int64_t)(rtp->received - rtp->received_prior);
+		if(interval > 0 && lost > 0)
+			fraction = MIN(((uint64_t)lost << 8) / interval, 255);
+		rtp->expected_prior = expected;
+		rtp->received_prior = rtp->received;
+		lost = MAX(MIN(stats.lost, 0x7fffff), -0x800000);
+		_stun_uint32(&buf[8], rtp->source);
+		_stun_uint32(&buf[12], (fraction << 24) | (lost & 0xffffff));
+		_stun_uint32(&buf[16], rtp->cycles + rtp->max_seq);
+		_stun_uint32(&buf[20], rtp->jitter);
+		_stun_uint32(&buf[24], rtp->lsr);
+		_stun_uint32(&buf[28], (rtp->lsr_time != 0)
+				? (now - rtp->lsr_time) * 65536 / 1000000 : 0);
+		len = 32;
+	}
+	_rtp_uint16(&buf[2], len / 4 - 1);
+	/* source description */
+	pos = len;
+	n = strlen(media->ufrag);
+	buf[pos] = 0x81;
+	buf[pos + 1] = SOFIA_RTCP_SDES;
+	_stun_uint32(&buf[pos + 4], rtp->ssrc);
+	buf[pos + 8] = 1; /* CNAME */
+	buf[pos + 9] = n;
+	memcpy(&buf[pos + 10], media->ufrag, n);
+	len = pos + 10 + n;
+	do
+		buf[len++] = '\0';
+	while(len % 4 != 0);
+	_rtp_uint16(&buf[pos + 2], (len - pos) / 4 - 1);
+	/* extended report */
+	pos = len;
+	buf[pos] = 0x80;
+	buf[pos + 1] = SOFIA_RTCP_XR;
+	_stun_uint32(&buf[pos + 4], rtp->ssrc);
+	len = pos + 8;
+	_rtp_ntp(g_get_real_time(), &msw, &lsw);
+	buf[len] = SOFIA_RTCP_XR_RRTR;
+	buf[len + 1] = 0;
+	_rtp_uint16(&buf[len + 2], 2);
+	_stun_uint32(&buf[len + 4], msw);
+	_stun_uint32(&buf[len + 8], lsw);
+	len += 12;
+	if(rtp->lrr_time != 0)
+	{
+		buf[len] = SOFIA_RTCP_XR_DLRR;
+		buf[len + 1] = 0;
+		_rtp_uint16(&buf[len + 2], 3);
+		_stun_uint32(&buf[len + 4], rtp->source);
+		_stun_uint32(&buf[len + 8], rtp->lrr);
+		_stun_uint32(&buf[len + 12], (now - rtp->lrr_time) * 65536
+				/ 1000000);
+		len += 16;
+	}
+	if(rtp->started)
+	{
+		/* VoIP metrics, 127 meaning unavailable */
+		memset(&buf[len], 0, 36);
+		buf[len] = SOFIA_RTCP_XR_VOIP;
+		_rtp_uint16(&buf[len + 2], 8);
+		_stun_uint32(&buf[len + 4], rtp->source);
+		buf[len + 8] = MIN(stats.local.loss * 256, 255);
+		buf[len + 10] = MIN(stats.local.burst * 256, 255);
+		if(rtp->gap_packets > 0)
+			buf[len + 11] = MIN(rtp->gap_lost * 256
+					/ rtp->gap_packets, 255);
+		_rtp_uint16(&buf[len + 16], MIN(stats.rtt / 1000, 65535));
+		buf[len + 20] = 127;
+		buf[len + 21] = 127;
+		buf[len + 22] = 127;
+		buf[len + 23] = SOFIA_RTCP_GMIN;
+		buf[len + 24] = 127;
+		buf[len + 25] = 127;
+		buf[len + 26] = stats.local.mos * 10;
+		buf[len + 27] = 127;
+		_rtp_uint16(&buf[len + 30], MIN(stats.local.buffer / 1000,
+					65535));
+		_rtp_uint16(&buf[len + 32], MIN(stats.local.buffer / 1000,
+					65535));
+		_rtp_uint16(&buf[len + 34], MIN(stats.local.buffer / 1000,
+					65535));
+		len += 36;
+	}
+	_rtp_uint16(&buf[pos + 2], (len - pos) / 4 - 1);
+	_media_send(media, media->remote[media->selected].relayed, buf, len,
+			&media->remote[media->selected].addr);
+}
+
+
+/* media_rtp */
+static void _rtp_init(SofiaRtp * rtp, uint32_t source, uint16_t seq,
+		uint32_t transit);
+static void _rtp_loss(SofiaRtp * rtp, uint32_t count);
+static void _rtp_received(SofiaRtp * rtp);
+
+static void _media_rtp(SofiaMedia * media, unsigned char const * buf,
+		size_t len)
+{
+	SofiaRtp * rtp = &media->rtp;
+	uint32_t source;
+	uint16_t seq;
+	uint16_t delta;
+	uint32_t transit;
+	int64_t relative;
+	int32_t d;
+
+	if(len < 12)
+		return;
+	seq = _rtp_uint16_get(&buf[2]);
+	source = _rtp_uint32_get(&buf[8]);
+	transit = (uint32_t)(g_get_monotonic_time() * SOFIA_RTP_CLOCK
+			/ 1000000) - _rtp_uint32_get(&buf[4]);
+	if(!rtp->started || source != rtp->source)
+	{
+		_rtp_init(rtp, source, seq, transit);
+		_media_audio(media, buf, len);
+		return;
+	}
+	if((delta = seq - rtp->max_seq) == 0)
+		/* duplicate */
+		return;
+	if(delta < 3000)
+	{
+		if(seq < rtp->max_seq)
+			rtp->cycles += 65536;
+		rtp->max_seq = seq;
+		if(delta > 1)
+			_rtp_loss(rtp, delta - 1);
+	}
+	else if(delta <= 65536 - 100)
+	{
+		/* the sender restarted */
+		_rtp_init(rtp, source, seq, transit);
+		_media_audio(media, buf, len);
+		return;
+	}
+	_rtp_received(rtp);
+	/* interarrival jitter (RFC 3550, section 6.4.1) */
+	d = transit - rtp->transit;
+	rtp->transit = transit;
+	rtp->jitter += (abs(d) - rtp->jitter) / 16.0;
+	relative = (int64_t)(int32_t)(transit - rtp->reference) * 1000000
+		/ SOFIA_RTP_CLOCK;
+	rtp->transit_min = MIN(rtp->transit_min, relative);
+	rtp->transit_max = MAX(rtp->transit_max, relative);
+	_media_audio(media, buf, len);
+}
+
+static void _rtp_init(SofiaRtp * rtp, uint32_t source, uint16_t seq,
+		uint32_t transit)
+{
+	rtp->started = 1;
+	rtp->source = source;
+	rtp->max_seq = seq;
+	rtp->cycles = 0;
+	rtp->base_seq = seq;
+	rtp->received = 0;
+	rtp->expected_prior = 0;
+	rtp->received_prior = 0;
+	rtp->transit = transit;
+	rtp->jitter = 0.0;
+	rtp->reference = transit;
+	rtp->transit_min = 0;
+	rtp->transit_max = 0;
+	rtp->buffer = 0;
+	rtp->run = 0;
+	rtp->burst_packets = 0;
+	rtp->burst_lost = 0;
+	rtp->gap_packets = 0;
+	rtp->gap_lost = 0;
+	rtp->current_packets = 0;
+	rtp->current_lost = 0;
+	rtp->previous = 0;
+	memset(rtp->transitions, 0, sizeof(rtp->transitions));
+	_rtp_received(rtp);
+}
+
+static void _rtp_loss(SofiaRtp * rtp, uint32_t count)
+{
+	for(; count > 0; count--)
+	{
+		rtp->transitions[rtp->previous][1]++;
+		rtp->previous = 1;
+		if(rtp->current_lost == 0 || rtp->run >= SOFIA_RTCP_GMIN)
+		{
+			/* the previous burst is over, isolated losses belong
+			 * to the gaps */
+			if(rtp->current_lost > 1)
+			{
+				rtp->burst_packets += rtp->current_packets;
+				rtp->burst_lost += rtp->current_lost;
+			}
+			else
+			{
+				rtp->gap_packets += rtp->current_packets;
+				rtp->gap_lost += rtp->current_lost;
+			}
+			rtp->gap_packets += rtp->run;
+			rtp->current_packets = 1;
+			rtp->current_lost = 1;
+		}
+		else
+		{
+			rtp->current_packets += rtp->run + 1;
+			rtp->current_lost++;
+		}
+		rtp->run = 0;
+	}
+}
+
+static void _rtp_received(SofiaRtp * rtp)
+{
+	rtp->received++;
+	rtp->transitions[rtp->previous][0]++;
+	rtp->previous = 0;
+	rtp->run++;
+}
+
+
+/* media_send */
+static int _media_send(SofiaMedia * media, int relayed,
+		unsigned char const * buf, size_t len,
+		struct sockaddr_in const * addr)
+{
+	SofiaStun stun;
+	unsigned char id[12];
+	unsigned char value[8];
+	size_t i;
+
+	if(relayed)
+	{
+		/* through the TURN server, in a Send indication */
+		for(i = 0; i < sizeof(id); i++)
+			id[i] = g_random_int_range(0, 256);
+		_stun_init(&stun, SOFIA_STUN_SEND_INDICATION, id);
+		_stun_address(value, addr);
+		if(_stun_attribute(&stun, SOFIA_STUN_XOR_PEER_ADDRESS, value,
+					sizeof(value)) != 0
+				|| _stun_attribute(&stun, SOFIA_STUN_DATA, buf,
+					len) != 0)
+			return -1;
+		buf = stun.buf;
+		len = stun.len;
+		addr = &media->sofia->turn;
+	}
+	return (sendto(media->fd, buf, len, 0, (struct sockaddr const *)addr,
+				sizeof(*addr)) == (ssize_t)len) ? 0 : -1;
+}
+
+
+/* media_transaction */
+static int _media_transaction(SofiaMedia * media, SofiaStunType type,
+		struct sockaddr_in const * addr, size_t remote, int nominate,
+		int relayed)
+{
+	SofiaTransaction * transaction = NULL;
+	SofiaStun * stun;
+	unsigned char buf[4];
+	unsigned char value[8];
+	gchar * p;
+	size_t i;
+
+	for(i = 0; i < SOFIA_ICE_TRANSACTIONS; i++)
+		if(!media->transactions[i].active)
+		{
+			transaction = &media->transactions[i];
+			break;
+		}
+	if(transaction == NULL)
+		return -1;
+	memset(transaction, 0, sizeof(*transaction));
+	transaction->type = type;
+	for(i = 0; i < sizeof(transaction->id); i++)
+		transaction->id[i] = g_random_int_range(0, 256);
+	transaction->addr = *addr;
+	transaction->remote = remote;
+	transaction->nominate = nominate;
+	transaction->relayed = relayed;
+	stun = &transaction->stun;
+	switch(type)
+	{
+		case SOFIA_STUN_TYPE_GATHER:
+			_stun_init(stun, SOFIA_STUN_BINDING, transaction->id);
+			break;
+		case SOFIA_STUN_TYPE_ALLOCATE:
+			_stun_init(stun, SOFIA_STUN_ALLOCATE, transaction->id);
+			/* UDP */
+			buf[0] = 17;
+			buf[1] = buf[2] = buf[3] = 0;
+			_stun_attribute(stun, SOFIA_STUN_REQUESTED_TRANSPORT,
+					buf, sizeof(buf));
+			_media_credentials(media, stun);
+			break;
+		case SOFIA_STUN_TYPE_REFRESH:
+			_stun_init(stun, SOFIA_STUN_REFRESH, transaction->id);
+			/* a lifetime of zero releases the allocation */
+			_stun_uint32(buf, media->allocated
+					? SOFIA_TURN_LIFETIME : 0);
+			_stun_attribute(stun, SOFIA_STUN_LIFETIME, buf,
+					sizeof(buf));
+			_media_credentials(media, stun);
+			break;
+		case SOFIA_STUN_TYPE_PERMISSION:
+			_stun_init(stun, SOFIA_STUN_PERMISSION,
+					transaction->id);
+			_stun_address(value, &media->remote[remote].addr);
+			_stun_attribute(stun, SOFIA_STUN_XOR_PEER_ADDRESS,
+					value, sizeof(value));
+			_media_credentials(media, stun);
+			break;
+		case SOFIA_STUN_TYPE_CHECK:
+			_stun_init(stun, SOFIA_STUN_BINDING, transaction->id);
+			p = g_strdup_printf("%s:%s", media->rufrag,
+					media->ufrag);
+			_stun_attribute(stun, SOFIA_STUN_USERNAME, p,
+					strlen(p));
+			g_free(p);
+			/* as a peer-reflexive candidate */
+			_stun_uint32(buf, (110 << 24) | (65535 << 8) | 255);
+			_stun_attribute(stun, SOFIA_STUN_PRIORITY, buf,
+					sizeof(buf));
+			_stun_attribute(stun, SOFIA_STUN_ICE_CONTROLLING,
+					&media->tiebreaker,
+					sizeof(media->tiebreaker));
+			if(nominate)
+				_stun_attribute(stun, SOFIA_STUN_USE_CANDIDATE,
+						NULL, 0);
+			_stun_integrity(stun, (unsigned char *)media->rpwd,
+					strlen(media->rpwd));
+			break;
+	}
+	_stun_fingerprint(stun);
+	transaction->active = 1;
+	transaction->sent = g_get_monotonic_time();
+	transaction->timeout = transaction->sent + SOFIA_STUN_RTO * 1000;
+	_media_send(media, relayed, stun->buf, stun->len, addr);
+	if(media->timeout == 0)
+		media->timeout = g_timeout_add(SOFIA_STUN_RTO / 2,
+				_media_on_timeout, media);
+	return 0;
+}
+
+
+/* media_trickle */
+static void _media_trickle(SofiaMedia * media)
+{
+	GString * str;
+	size_t len;
+	size_t i;
+
+	if(!media->dialog)
+		return;
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "a=ice-ufrag:%s\r\na=ice-pwd:%s\r\n",
+			media->ufrag, media->pwd);
+	len = str->len;
+	for(i = 0; i < media->local_cnt; i++)
+		if(!media->local[i].trickled)
+			_media_attributes_candidate(media, str,
+					&media->local[i]);
+	if(!media->gathered && !_media_pending(media,
+				SOFIA_STUN_TYPE_GATHER)
+			&& !_media_pending(media, SOFIA_STUN_TYPE_ALLOCATE))
+	{
+		g_string_append(str, "a=end-of-candidates\r\n");
+		media->gathered = 1;
+	}
+	if(str->len > len)
+	{
+#ifdef DEBUG
+		fprintf(stderr, "DEBUG: %s() \"%s\"\n", __func__, str->str);
+#endif
+		g_queue_push_tail(&media->info,
+				GINT_TO_POINTER(SOFIA_INFO_TYPE_TRICKLE));
+		nua_info(media->handle, SIPTAG_CONTENT_TYPE_STR(
+					"application/trickle-ice-sdpfrag"),
+				SIPTAG_HEADER_STR("Info-Package: trickle-ice"),
+				SIPTAG_PAYLOAD_STR(str->str), TAG_END());
+	}
+	g_string_free(str, TRUE);
+}
+
+
+/* media_update */
+static void _media_update(SofiaMedia * media)
+{
+	Sofia * sofia = media->sofia;
+	SofiaCandidate * remote;
+	GString * str;
+	char addr[INET_ADDRSTRLEN];
+	char raddr[INET_ADDRSTRLEN];
+	char buf[2048];
+	char const * sdp;
+	size_t i;
+
+	if(media->selected < 0)
+		return;
+	if(!media->ready)
+	{
+		/* wait until the call is established */
+		media->update = 1;
+		return;
+	}
+	media->update = 0;
+	remote = &media->remote[media->selected];
+	if(remote->mapped.sin_family != AF_INET)
+		return;
+	for(i = 0; i < media->local_cnt; i++)
+		if(media->local[i].addr.sin_addr.s_addr
+				== remote->mapped.sin_addr.s_addr
+				&& media->local[i].addr.sin_port
+				== remote->mapped.sin_port)
+			break;
+	inet_ntop(AF_INET, &remote->mapped.sin_addr, addr, sizeof(addr));
+	/* peer-reflexive candidates cannot be offered, and the default
+	 * candidate may already be the one selected */
+	if(i == media->local_cnt || (sofia->sdp_address != NULL
+				&& strcmp(addr, sofia->sdp_address) == 0
+				&& ntohs(remote->mapped.sin_port)
+				== media->port))
+		return;
+	/* offer the pair selected as the default (RFC 8445, section 8.1.2) */
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "a=ice-ufrag:%s\r\na=ice-pwd:%s\r\n"
+			"a=rtcp-mux\r\n"
+			"a=rtcp-xr:rcvr-rtt=all voip-metrics\r\n",
+			media->ufrag, media->pwd);
+	_media_attributes_candidate(media, str, &media->local[i]);
+	inet_ntop(AF_INET, &remote->addr.sin_addr, raddr, sizeof(raddr));
+	g_string_append_printf(str, "a=remote-candidates:1 %s %u\r\n", raddr,
+			ntohs(remote->addr.sin_port));
+	sdp = _sofia_sdp_offer(sofia, addr, ntohs(remote->mapped.sin_port),
+			str->str, buf, sizeof(buf));
+	g_string_free(str, TRUE);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %s:%u\n", __func__, addr,
+			ntohs(remote->mapped.sin_port));
+#endif
+	if(sdp != NULL)
+		nua_invite(media->handle, SOATAG_USER_SDP_STR(sdp), TAG_END());
+}
+
+
+/* media_pending */
+static int _media_pending(SofiaMedia * media, SofiaStunType type)
+{
+	size_t i;
+
+	for(i = 0; i < SOFIA_ICE_TRANSACTIONS; i++)
+		if(media->transactions[i].active
+				&& media->transactions[i].type == type)
+			return 1;
+	return 0;
+}
+
+
+/* media_permission */
+static void _media_permission(SofiaMedia * media)
+{
+	size_t i;
+
+	/* let every remote candidate reach the relay */
+	for(i = 0; i < media->remote_cnt; i++)
+		if(media->remote[i].permission == 0)
+		{
+			media->remote[i].permission = 1;
+			_media_transaction(media, SOFIA_STUN_TYPE_PERMISSION,
+					&media->sofia->turn, i, 0, 0);
+		}
+}
+
+
+/* media_complete */
+static void _media_complete(SofiaMedia * media, SofiaTransaction * transaction)
+{
+	SofiaCandidate * selected;
+
+	transaction->active = 0;
+	switch(transaction->type)
+	{
+		case SOFIA_STUN_TYPE_GATHER:
+			_media_trickle(media);
+			break;
+		case SOFIA_STUN_TYPE_REFRESH:
+			break;
+		case SOFIA_STUN_TYPE_ALLOCATE:
+			_media_trickle(media);
+			/* fallthrough */
+		case SOFIA_STUN_TYPE_PERMISSION:
+		case SOFIA_STUN_TYPE_CHECK:
+			/* wait for every pair, including through the relay */
+			if(_media_pending(media, SOFIA_STUN_TYPE_ALLOCATE)
+					|| _media_pending(media,
+						SOFIA_STUN_TYPE_PERMISSION)
+					|| _media_pending(media,
+						SOFIA_STUN_TYPE_CHECK)
+					|| media->selected < 0
+					|| media->nominated)
+				break;
+			/* nominate the pair with the lowest RTT */
+			media->nominated = 1;
+			selected = &media->remote[media->selected];
+			_media_transaction(media, SOFIA_STUN_TYPE_CHECK,
+					&selected->addr, media->selected, 1,
+					selected->relayed);
+			break;
+	}
+}
+
+
+/* media_stun */
+static int _media_stun_challenge(SofiaMedia * media, unsigned char const * buf,
+		size_t len);
+static void _media_stun_request(SofiaMedia * media, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from, int relayed);
+static void _media_stun_response(SofiaMedia * media,
+		SofiaTransaction * transaction, uint16_t type,
+		unsigned char const * buf, size_t len);
+
+static void _media_stun(SofiaMedia * media, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from, int relayed)
+{
+	Sofia * sofia = media->sofia;
+	uint16_t type = (buf[0] << 8) | buf[1];
+	unsigned char const * value;
+	size_t size;
+	struct sockaddr_in peer;
+	size_t i;
+
+	if(type == SOFIA_STUN_DATA_INDICATION)
+	{
+		/* relayed from a peer by the TURN server */
+		if(relayed || !media->allocated
+				|| from->sin_addr.s_addr
+				!= sofia->turn.sin_addr.s_addr
+				|| from->sin_port != sofia->turn.sin_port
+				|| (value = _stun_find(buf, len,
+						SOFIA_STUN_XOR_PEER_ADDRESS,
+						&size)) == NULL
+				|| _stun_address_get(value, size, &peer) != 0
+				|| (value = _stun_find(buf, len,
+						SOFIA_STUN_DATA, &size))
+				== NULL)
+			return;
+		_media_packet(media, value, size, &peer, 1);
+		return;
+	}
+	if(type == SOFIA_STUN_BINDING)
+	{
+		_media_stun_request(media, buf, len, from, relayed);
+		return;
+	}
+	for(i = 0; i < SOFIA_ICE_TRANSACTIONS; i++)
+		if(media->transactions[i].active && memcmp(&buf[8],
+					media->transactions[i].id,
+					sizeof(media->transactions[i].id))
+				== 0)
+		{
+			_media_stun_response(media, &media->transactions[i],
+					type, buf, len);
+			return;
+		}
+}
+
+static int _media_stun_challenge(SofiaMedia * media, unsigned char const * buf,
+		size_t len)
+{
+	ModemPluginHelper * helper = media->sofia->helper;
+	unsigned char const * value;
+	size_t size;
+	unsigned int code;
+	char nonce[sizeof(media->nonce)];
+	char const * username;
+	char const * password;
+	gsize keylen = sizeof(media->key);
+	GChecksum * checksum;
+	gchar * p;
+
+	if((value = _stun_find(buf, len, SOFIA_STUN_ERROR_CODE, &size))
+			== NULL || size < 4)
+		return -1;
+	code = (value[2] & 0x07) * 100 + value[3];
+	if((value = _stun_find(buf, len, SOFIA_STUN_NONCE, &size)) == NULL
+			|| size >= sizeof(nonce))
+		return -1;
+	memcpy(nonce, value, size);
+	nonce[size] = '\0';
+	if(code == 438)
+	{
+		/* retry with the new nonce */
+		if(media->realm[0] == '\0' || strcmp(nonce, media->nonce) == 0)
+			return -1;
+		snprintf(media->nonce, sizeof(media->nonce), "%s", nonce);
+		return 0;
+	}
+	/* retry once with the credentials */
+	if(code != 401 || media->realm[0] != '\0')
+		return -1;
+	if((value = _stun_find(buf, len, SOFIA_STUN_REALM, &size)) == NULL
+			|| size >= sizeof(media->realm))
+		return -1;
+	memcpy(media->realm, value, size);
+	media->realm[size] = '\0';
+	snprintf(media->nonce, sizeof(media->nonce), "%s", nonce);
+	if((username = helper->config_get(helper->modem, "turn_username"))
+			== NULL)
+		username = "";
+	if((password = helper->config_get(helper->modem, "turn_password"))
+			== NULL)
+		password = "";
+	p = g_strdup_printf("%s:%s:%s", username, media->realm, password);
+	checksum = g_checksum_new(G_CHECKSUM_MD5);
+	g_checksum_update(checksum, (guchar *)p, strlen(p));
+	g_checksum_get_digest(checksum, media->key, &keylen);
+	g_checksum_free(checksum);
+	g_free(p);
+	return 0;
+}
+
+static void _media_stun_request(SofiaMedia * media, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from, int relayed)
+{
+	unsigned char const * username;
+	size_t size;
+	size_t ufrag = strlen(media->ufrag);
+	SofiaStun stun;
+	unsigned char value[8];
+
+	/* connectivity check from the remote side */
+	if((username = _stun_find(buf, len, SOFIA_STUN_USERNAME, &size))
+			== NULL || size <= ufrag
+			|| memcmp(username, media->ufrag, ufrag) != 0
+			|| username[ufrag] != ':'
+			|| _stun_verify(buf, len, (unsigned char *)media->pwd,
+				strlen(media->pwd)) != 0)
+		return;
+	_stun_init(&stun, SOFIA_STUN_BINDING_SUCCESS, &buf[8]);
+	_stun_address(value, from);
+	_stun_attribute(&stun, SOFIA_STUN_XOR_MAPPED_ADDRESS, value,
+			sizeof(value));
+	_stun_integrity(&stun, (unsigned char *)media->pwd,
+			strlen(media->pwd));
+	_stun_fingerprint(&stun);
+	_media_send(media, relayed, stun.buf, stun.len, from);
+}
+
+static void _media_stun_response(SofiaMedia * media,
+		SofiaTransaction * transaction, uint16_t type,
+		unsigned char const * buf, size_t len)
+{
+	unsigned char const * value;
+	size_t size;
+	struct sockaddr_in sa;
+	SofiaCandidate * remote;
+	gint64 rtt;
+	uint32_t lifetime = SOFIA_TURN_LIFETIME;
+	SofiaStunType t;
+	size_t r;
+
+	switch(type)
+	{
+		case SOFIA_STUN_BINDING_SUCCESS:
+			if(transaction->type == SOFIA_STUN_TYPE_GATHER)
+			{
+				if((value = _stun_find(buf, len,
+							SOFIA_STUN_XOR_MAPPED_ADDRESS,
+							&size)) != NULL
+						&& _stun_address_get(value,
+							size, &sa) == 0)
+					_media_candidate_add(media->local,
+							&media->local_cnt,
+							SOFIA_CANDIDATE_SRFLX,
+							&sa, 0);
+			}
+			else if(transaction->type == SOFIA_STUN_TYPE_CHECK
+					&& _stun_verify(buf, len,
+						(unsigned char *)media->rpwd,
+						strlen(media->rpwd)) == 0)
+			{
+				remote = &media->remote[transaction->remote];
+				rtt = g_get_monotonic_time() - transaction->sent;
+				if(remote->rtt < 0 || rtt < remote->rtt)
+				{
+					remote->rtt = rtt;
+					remote->relayed = transaction->relayed;
+					/* the local candidate of this pair */
+					if((value = _stun_find(buf, len,
+								SOFIA_STUN_XOR_MAPPED_ADDRESS,
+								&size)) != NULL
+							&& _stun_address_get(
+								value, size,
+								&sa) == 0)
+						remote->mapped = sa;
+				}
+				if(media->selected < 0 || remote->rtt
+						< media->remote[
+						media->selected].rtt)
+					media->selected = transaction->remote;
+				if(transaction->nominate)
+					_media_update(media);
+			}
+			break;
+		case SOFIA_STUN_ALLOCATE_SUCCESS:
+			if((value = _stun_find(buf, len,
+						SOFIA_STUN_XOR_RELAYED_ADDRESS,
+						&size)) == NULL
+					|| _stun_address_get(value, size, &sa)
+					!= 0)
+				break;
+			_media_candidate_add(media->local, &media->local_cnt,
+					SOFIA_CANDIDATE_RELAY, &sa, 0);
+			media->allocated = 1;
+			if((value = _stun_find(buf, len, SOFIA_STUN_LIFETIME,
+							&size)) != NULL
+					&& size == 4)
+				lifetime = _rtp_uint32_get(value);
+			/* refresh before the allocation or the permissions
+			 * expire */
+			lifetime = MIN(MAX(lifetime, 60), SOFIA_TURN_PERMISSION);
+			media->refresh = g_timeout_add_seconds(lifetime / 2,
+					_media_on_refresh, media);
+			if(media->rufrag[0] != '\0')
+				_media_permission(media);
+			break;
+		case SOFIA_STUN_PERMISSION_SUCCESS:
+			remote = &media->remote[transaction->remote];
+			if(remote->permission == 2)
+				/* renewed */
+				break;
+			/* check the connectivity through the relay */
+			remote->permission = 2;
+			_media_transaction(media, SOFIA_STUN_TYPE_CHECK,
+					&remote->addr, transaction->remote, 0,
+					1);
+			break;
+		case SOFIA_STUN_ALLOCATE_ERROR:
+		case SOFIA_STUN_REFRESH_ERROR:
+		case SOFIA_STUN_PERMISSION_ERROR:
+			if(_media_stun_challenge(media, buf, len) != 0)
+				break;
+			t = transaction->type;
+			sa = transaction->addr;
+			r = transaction->remote;
+			transaction->active = 0;
+			_media_transaction(media, t, &sa, r, 0, 0);
+			return;
+	}
+	_media_complete(media, transaction);
+}
+
+
+/* media_packet */
+static void _media_packet(SofiaMedia * media, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from, int relayed)
+{
+	/* STUN messages start with two zero bits and the cookie */
+	if(len >= 20 && (buf[0] & 0xc0) == 0
+			&& (size_t)((buf[2] << 8) | buf[3]) + 20 == len
+			&& ((uint32_t)buf[4] << 24 | buf[5] << 16
+				| buf[6] << 8 | buf[7]) == SOFIA_STUN_COOKIE)
+	{
+		_media_stun(media, buf, len, from, relayed);
+		return;
+	}
+	if(media->connected == 0)
+	{
+		/* this is the first media packet */
+		media->connected = g_get_monotonic_time();
+		media->rtp.since = media->connected;
+		media->rtcp = g_timeout_add(SOFIA_RTCP_INTERVAL,
+				_media_on_rtcp, media);
+		_media_report(media);
+	}
+	if(len < 8 || (buf[0] & 0xc0) != 0x80)
+		return;
+	/* RTCP packet types when multiplexed (RFC 5761) */
+	if(buf[1] >= 192 && buf[1] <= 223)
+		_media_rtcp(media, buf, len);
+	else
+		_media_rtp(media, buf, len);
+}
+
+
+/* rtp */
+/* rtp_alaw */
+static int16_t _rtp_alaw(unsigned char value)
+{
+	int t;
+	int segment;
+
+	/* G.711 A-law */
+	value ^= 0x55;
+	t = (value & 0x0f) << 4;
+	segment = (value & 0x70) >> 4;
+	if(segment == 0)
+		t += 8;
+	else
+		t = (t + 0x108) << (segment - 1);
+	return (value & 0x80) ? t : -t;
+}
+
+
+/* rtp_ntp */
+static void _rtp_ntp(gint64 now, uint32_t * msw, uint32_t * lsw)
+{
+	/* the NTP epoch is in 1900 */
+	*msw = now / 1000000 + 2208988800UL;
+	*lsw = ((uint64_t)(now % 1000000) << 32) / 1000000;
+}
+
+
+/* rtp_uint16 */
+static void _rtp_uint16(unsigned char * buf, uint16_t value)
+{
+	buf[0] = value >> 8;
+	buf[1] = value & 0xff;
+}
+
+
+/* rtp_uint16_get */
+static uint16_t _rtp_uint16_get(unsigned char const * buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+
+/* rtp_uint32_get */
+static uint32_t _rtp_uint32_get(unsigned char const * buf)
+{
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8)
+		| buf[3];
+}
+
+
+/* rtp_ulaw */
+static int16_t _rtp_ulaw(unsigned char value)
+{
+	int t;
+
+	/* G.711 mu-law */
+	value = ~value;
+	t = (((value & 0x0f) << 3) + 0x84) << ((value & 0x70) >> 4);
+	return (value & 0x80) ? 0x84 - t : t - 0x84;
+}
+
+
+/* stun */
+/* stun_init */
+static void _stun_init(SofiaStun * stun, uint16_t type,
+		unsigned char const * id)
+{
+	stun->buf[0] = type >> 8;
+	stun->buf[1] = type & 0xff;
+	_stun_uint32(&stun->buf[4], SOFIA_STUN_COOKIE);
+	memcpy(&stun->buf[8], id, 12);
+	stun->len = 20;
+	_stun_length(stun, 0);
+}
+
+
+/* stun_address */
+static void _stun_address(unsigned char * buf, struct sockaddr_in const * sa)
+{
+	uint16_t port = ntohs(sa->sin_port) ^ (SOFIA_STUN_COOKIE >> 16);
+
+	/* XOR-MAPPED-ADDRESS, IPv4 */
+	buf[0] = 0;
+	buf[1] = 0x01;
+	buf[2] = port >> 8;
+	buf[3] = port & 0xff;
+	_stun_uint32(&buf[4], ntohl(sa->sin_addr.s_addr) ^ SOFIA_STUN_COOKIE);
+}
+
+
+/* stun_address_get */
+static int _stun_address_get(unsigned char const * buf, size_t size,
+		struct sockaddr_in * sa)
+{
+	uint16_t port;
+	uint32_t addr;
+
+	if(size != 8 || buf[1] != 0x01)
+		return -1;
+	port = ((buf[2] << 8) | buf[3]) ^ (SOFIA_STUN_COOKIE >> 16);
+	addr = (((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8)
+			| buf[7]) ^ SOFIA_STUN_COOKIE;
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(port);
+	sa->sin_addr.s_addr = htonl(addr);
+	return 0;
+}
+
+
+/* stun_attribute */
+static int _stun_attribute(SofiaStun * stun, uint16_t type, void const * data,
+		size_t size)
+{
+	size_t padded = (size + 3) & ~3;
+	unsigned char * p;
+
+	if(stun->len + 4 + padded > sizeof(stun->buf))
+		return -1;
+	p = &stun->buf[stun->len];
+	p[0] = type >> 8;
+	p[1] = type & 0xff;
+	p[2] = size >> 8;
+	p[3] = size & 0xff;
+	if(size > 0)
+		memcpy(&p[4], data, size);
+	memset(&p[4 + size], 0, padded - size);
+	stun->len += 4 + padded;
+	_stun_length(stun, stun->len - 20);
+	return 0;
+}
+
+
+/* stun_crc32 */
+static uint32_t _stun_crc32(unsigned char const * buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	unsigned int j;
+
+	for(i = 0; i < len; i++)
+	{
+		crc ^= buf[i];
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+
+/* stun_find */
+static unsigned char const * _stun_find(unsigned char const * buf, size_t len,
+		uint16_t type, size_t * size)
+{
+	size_t i;
+	uint16_t t;
+	size_t s;
+
+	for(i = 20; i + 4 <= len; i += 4 + ((s + 3) & ~3))
+	{
+		t = (buf[i] << 8) | buf[i + 1];
+		s = (buf[i + 2] << 8) | buf[i + 3];
+		if(i + 4 + s > len)
+			break;
+		if(t == type)
+		{
+			*size = s;
+			return &buf[i + 4];
+		}
+	}
+	return NULL;
+}
+
+
+/* stun_fingerprint */
+static int _stun_fingerprint(SofiaStun * stun)
+{
+	unsigned char value[4];
+
+	if(stun->len + 8 > sizeof(stun->buf))
+		return -1;
+	/* the length includes the attribute itself */
+	_stun_length(stun, stun->len - 20 + 8);
+	_stun_uint32(value, _stun_crc32(stun->buf, stun->len) ^ 0x5354554e);
+	return _stun_attribute(stun, SOFIA_STUN_FINGERPRINT, value,
+			sizeof(value));
+}
+
+
+/* stun_integrity */
+static void _stun_integrity_digest(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen, unsigned char * digest);
+
+static int _stun_integrity(SofiaStun * stun, unsigned char const * key,
+		size_t keylen)
+{
+	unsigned char digest[20];
+
+	if(stun->len + 4 + sizeof(digest) > sizeof(stun->buf))
+		return -1;
+	/* the length includes the attribute itself */
+	_stun_length(stun, stun->len - 20 + 4 + sizeof(digest));
+	_stun_integrity_digest(stun->buf, stun->len, key, keylen, digest);
+	return _stun_attribute(stun, SOFIA_STUN_MESSAGE_INTEGRITY, digest,
+			sizeof(digest));
+}
+
+static void _stun_integrity_digest(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen, unsigned char * digest)
+{
+	GHmac * hmac;
+	gsize size = 20;
+
+	hmac = g_hmac_new(G_CHECKSUM_SHA1, key, keylen);
+	g_hmac_update(hmac, buf, len);
+	g_hmac_get_digest(hmac, digest, &size);
+	g_hmac_unref(hmac);
+}
+
+
+/* stun_length */
+static void _stun_length(SofiaStun * stun, size_t length)
+{
+	stun->buf[2] = length >> 8;
+	stun->buf[3] = length & 0xff;
+}
+
+
+/* stun_uint32 */
+static void _stun_uint32(unsigned char * buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = (value >> 16) & 0xff;
+	buf[2] = (value >> 8) & 0xff;
+	buf[3] = value & 0xff;
+}
+
+
+/* stun_verify */
+static int _stun_verify(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen)
+{
+	SofiaStun stun;
+	unsigned char const * value;
+	size_t size;
+	size_t offset;
+	unsigned char digest[20];
+
+	if((value = _stun_find(buf, len, SOFIA_STUN_MESSAGE_INTEGRITY, &size))
+			== NULL || size != sizeof(digest))
+		return -1;
+	/* the digest covers everything up to the attribute */
+	if((offset = value - 4 - buf) > sizeof(stun.buf))
+		return -1;
+	memcpy(stun.buf, buf, offset);
+	stun.len = offset;
+	_stun_length(&stun, offset - 20 + 4 + sizeof(digest));
+	_stun_integrity_digest(stun.buf, stun.len, key, keylen, digest);
+	return (memcmp(digest, value, sizeof(digest)) == 0) ? 0 : -1;
+}
+
+
+/* encoding */
+/* sofia_encoding */
+static size_t _encoding_ascii(unsigned char const * buf, size_t len);
+
+static ModemMessageEncoding _sofia_encoding(char const * buf, size_t len)
+{
+	unsigned char const * p = (unsigned char const *)buf;
+	ModemMessageEncoding encoding = MODEM_MESSAGE_ENCODING_ASCII;
+	size_t i = 0;
+	size_t j;
+	size_t n;
+
+	for(;;)
+	{
+		if((i += _encoding_ascii(&p[i], len - i)) == len)
+			return encoding;
+		/* validate the UTF-8 sequence (RFC 3629) */
+		if(p[i] >= 0xc2 && p[i] <= 0xdf)
+			n = 1;
+		else if(p[i] >= 0xe0 && p[i] <= 0xef)
+			n = 2;
+		else if(p[i] >= 0xf0 && p[i] <= 0xf4)
+			n = 3;
+		else
+			return MODEM_MESSAGE_ENCODING_DATA;
+		if(len - i <= n
+				/* overlong forms, surrogates, beyond U+10FFFF */
+				|| (p[i] == 0xe0 && p[i + 1] < 0xa0)
+				|| (p[i] == 0xed && p[i + 1] > 0x9f)
+				|| (p[i] == 0xf0 && p[i + 1] < 0x90)
+				|| (p[i] == 0xf4 && p[i + 1] > 0x8f))
+			return MODEM_MESSAGE_ENCODING_DATA;
+		for(j = 1; j <= n; j++)
+			if((p[i + j] & 0xc0) != 0x80)
+				return MODEM_MESSAGE_ENCODING_DATA;
+		i += n + 1;
+		encoding = MODEM_MESSAGE_ENCODING_UTF8;
+	}
+}
+
+static size_t _encoding_ascii(unsigned char const * buf, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i v;
+
+	/* skip 16 bytes at a time */
+	for(; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((__m128i const *)&buf[i]);
+		if(_mm_movemask_epi8(v) != 0)
+			break;
+	}
+#elif defined(__ARM_NEON)
+	uint64x2_t v;
+
+	/* skip 16 bytes at a time */
+	for(; i + 16 <= len; i += 16)
+	{
+		v = vreinterpretq_u64_u8(vld1q_u8(&buf[i]));
+		if(((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1))
+					& 0x8080808080808080ULL) != 0)
+			break;
+	}
+#else
+	uint64_t v;
+
+	/* skip 8 bytes at a time */
+	for(; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, &buf[i], sizeof(v));
+		if((v & 0x8080808080808080ULL) != 0)
+			break;
+	}
+#endif
+	for(; i < len; i++)
+		if(buf[i] & 0x80)
+			break;
+	return i;
+}
+
+
+/* recorder */
+/* sofia_record_start */
+static void _record_header(FILE * fp, uint32_t size);
+static gpointer _record_thread(gpointer data);
+
+static int _sofia_record_start(Sofia * sofia, char const * filename)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	SofiaRecorder * recorder;
+	char const * directory;
+	char buf[32];
+	time_t t;
+	struct tm tm;
+	gchar * p = NULL;
+
+	if(sofia->recorder != NULL)
+		/* already recording */
+		return 0;
+	if(filename == NULL)
+	{
+		if((directory = helper->config_get(helper->modem,
+						"record_directory")) == NULL
+				|| strlen(directory) == 0)
+			directory = g_get_home_dir();
+		t = time(NULL);
+		localtime_r(&t, &tm);
+		strftime(buf, sizeof(buf), "call-%Y%m%d-%H%M%S.wav", &tm);
+		filename = p = g_build_filename(directory, buf, NULL);
+	}
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s(\"%s\")\n", __func__, filename);
+#endif
+	if((recorder = object_new(sizeof(*recorder))) == NULL)
+	{
+		g_free(p);
+		return -helper->error(helper->modem,
+				"Could not start recording", 1);
+	}
+	memset(recorder, 0, sizeof(*recorder));
+	/* preallocate both buffers so that the media path never allocates */
+	recorder->buffers[0] = malloc(sizeof(int16_t) * SOFIA_RECORD_BUFFER);
+	recorder->buffers[1] = malloc(sizeof(int16_t) * SOFIA_RECORD_BUFFER);
+	recorder->fp = fopen(filename, "wb");
+	g_free(p);
+	if(recorder->buffers[0] == NULL || recorder->buffers[1] == NULL
+			|| recorder->fp == NULL)
+	{
+		if(recorder->fp != NULL)
+			fclose(recorder->fp);
+		free(recorder->buffers[0]);
+		free(recorder->buffers[1]);
+		object_delete(recorder);
+		return -helper->error(helper->modem,
+				"Could not start recording", 1);
+	}
+	_record_header(recorder->fp, 0);
+	g_mutex_init(&recorder->mutex);
+	g_cond_init(&recorder->cond);
+	recorder->running = 1;
+	if((recorder->thread = g_thread_try_new("sofia-record", _record_thread,
+					recorder, NULL)) == NULL)
+	{
+		g_cond_clear(&recorder->cond);
+		g_mutex_clear(&recorder->mutex);
+		fclose(recorder->fp);
+		free(recorder->buffers[0]);
+		free(recorder->buffers[1]);
+		object_delete(recorder);
+		return -helper->error(helper->modem,
+				"Could not start recording", 1);
+	}
+	sofia->recorder = recorder;
+	return 0;
+}
+
+static void _record_header(FILE * fp, uint32_t size)
+{
+	unsigned char header[44] = "RIFF\0\0\0\0WAVEfmt "
+		"\x10\0\0\0\x01\0\x01\0\0\0\0\0\0\0\0\0\x02\0\x10\0"
+		"data\0\0\0\0";
+	uint32_t rate = SOFIA_RECORD_RATE;
+	uint32_t bps = SOFIA_RECORD_RATE * sizeof(int16_t);
+	uint32_t riff = size + sizeof(header) - 8;
+	size_t i;
+
+	/* the WAV header is little-endian */
+	for(i = 0; i < 4; i++)
+	{
+		header[4 + i] = (riff >> (i * 8)) & 0xff;
+		header[24 + i] = (rate >> (i * 8)) & 0xff;
+		header[28 + i] = (bps >> (i * 8)) & 0xff;
+		header[40 + i] = (size >> (i * 8)) & 0xff;
+	}
+	fseek(fp, 0, SEEK_SET);
+	fwrite(header, sizeof(header), 1, fp);
+}
+
+static gpointer _record_thread(gpointer data)
+{
+	SofiaRecorder * recorder = data;
+	unsigned int i;
+	size_t cnt;
+	size_t size;
+	uint32_t total = 0;
+	int16_t * p;
+	unsigned char buf[sizeof(int16_t) * SOFIA_RECORD_BUFFER];
+
+	g_mutex_lock(&recorder->mutex);
+	for(;;)
+	{
+		while(recorder->running && !recorder->pending)
+			g_cond_wait(&recorder->cond, &recorder->mutex);
+		if(!recorder->pending)
+		{
+			/* stopped: flush the buffer being filled, if any */
+			if(recorder->fill[recorder->current] == 0)
+				break;
+			recorder->current ^= 1;
+			recorder->pending = 1;
+		}
+		i = recorder->current ^ 1;
+		cnt = recorder->fill[i];
+		g_mutex_unlock(&recorder->mutex);
+		/* write as little-endian, without holding the lock */
+		for(p = recorder->buffers[i], size = 0; size < cnt; size++)
+		{
+			buf[size * 2] = p[size] & 0xff;
+			buf[size * 2 + 1] = (p[size] >> 8) & 0xff;
+		}
+		cnt = fwrite(buf, sizeof(int16_t), cnt, recorder->fp);
+		total += cnt * sizeof(int16_t);
+		g_mutex_lock(&recorder->mutex);
+		recorder->stats.written += cnt;
+		recorder->stats.dropped += recorder->fill[i] - cnt;
+		recorder->fill[i] = 0;
+		recorder->pending = 0;
+	}
+	g_mutex_unlock(&recorder->mutex);
+	_record_header(recorder->fp, total);
+	return NULL;
+}
+
+
+/* sofia_record_stop */
+static int _sofia_record_stop(Sofia * sofia)
+{
+	ModemPluginHelper * helper = sofia->helper;
+	SofiaRecorder * recorder;
+	ModemEvent mevent;
+	SofiaRecordStats stats;
+	int ret = 0;
+
+	if((recorder = sofia->recorder) == NULL)
+		return 0;
+	sofia->recorder = NULL;
+	g_mutex_lock(&recorder->mutex);
+	recorder->running = 0;
+	g_cond_signal(&recorder->cond);
+	g_mutex_unlock(&recorder->mutex);
+	g_thread_join(recorder->thread);
+	stats = recorder->stats;
+	stats.dropped += recorder->missed;
+	if(fclose(recorder->fp) != 0)
+		ret = -helper->error(helper->modem,
+				"Could not complete the recording", 1);
+	g_cond_clear(&recorder->cond);
+	g_mutex_clear(&recorder->mutex);
+	free(recorder->buffers[0]);
+	free(recorder->buffers[1]);
+	object_delete(recorder);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %lu written, %lu dropped\n", __func__,
+			(unsigned long)stats.written,
+			(unsigned long)stats.dropped);
+#endif
+	/* report the statistics */
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_UNSUPPORTED;
+	mevent.unsupported.modem = plugin.name;
+	mevent.unsupported.request = SOFIA_REQUEST_RECORD_STOP;
+	mevent.unsupported.data = &stats;
+	mevent.unsupported.size = sizeof(stats);
+	helper->event(helper->modem, &mevent);
+	return ret;
+}
+
+
+/* sofia_record_audio */
+static void _sofia_record_audio(Sofia * sofia, int16_t const * samples,
+		size_t cnt)
+{
+	SofiaRecorder * recorder;
+	size_t * fill;
+	size_t n;
+
+	if((recorder = sofia->recorder) == NULL || cnt == 0)
+		return;
+	/* never wait for the writer: drop the audio instead */
+	if(!g_mutex_trylock(&recorder->mutex))
+	{
+		recorder->missed += cnt;
+		return;
+	}
+	while(cnt > 0 && recorder->running)
+	{
+		fill = &recorder->fill[recorder->current];
+		if(*fill == SOFIA_RECORD_BUFFER)
+		{
+			if(recorder->pending)
+				/* the writer is late */
+				break;
+			recorder->current ^= 1;
+			recorder->pending = 1;
+			g_cond_signal(&recorder->cond);
+			continue;
+		}
+		n = MIN(cnt, SOFIA_RECORD_BUFFER - *fill);
+		memcpy(&recorder->buffers[recorder->current][*fill], samples,
+				n * sizeof(*samples));
+		*fill += n;
+		samples += n;
+		cnt -= n;
+	}
+	recorder->stats.dropped += cnt;
+	g_mutex_unlock(&recorder->mutex);
+}
+
+
+/* callbacks */
+/* sofia_callback */
+static void _callback_i_info(ModemPlugin * modem, int status,
+		nua_handle_t * nh, sip_t const * sip);
+static void _callback_i_message(ModemPlugin * modem, int status,
+		nua_handle_t * nh, sip_t const * sip);
+static void _callback_i_state(ModemPlugin * modem, int status,
+		char const * phrase, nua_handle_t * nh, tagi_t tags[]);
+static void _callback_r_info(ModemPlugin * modem, int status,
+		nua_handle_t * nh);
+static void _callback_r_invite(ModemPlugin * modem, int status,
+		char const * phrase, nua_handle_t * handle);
+static void _callback_r_message(ModemPlugin * modem, int status,
+		char const * phrase);
+static void _callback_r_register(ModemPlugin * modem, int status,
+		nua_handle_t * nh, sip_t const * sip, tagi_t tags[]);
+
+static void _sofia_callback(nua_event_t event, int status, char const * phrase,
+		nua_t * nua, nua_magic_t * magic, nua_handle_t * nh,
+		nua_hmagic_t * hmagic, sip_t const * sip, tagi_t tags[])
+{
+	ModemPlugin * modem = magic;
+	Sofia * sofia = modem;
+	ModemPluginHelper * helper = modem->helper;
+	ModemEvent mevent;
+	(void) nua;
+	(void) hmagic;
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s(%u)\n", __func__, event);
+#endif
+	switch(event)
+	{
+		case nua_i_error:
+			/* FIXME report error */
+			fprintf(stderr, "i_error %03d %s\n", status, phrase);
+			break;
+		case nua_i_invite:
+			/* FIXME report event: incoming call */
+			fprintf(stderr, "i_invite %03d %s\n", status, phrase);
+			break;
+		case nua_i_cancel:
+			/* FIXME report event: incoming call was cancelled */
+			fprintf(stderr, "i_invite %03d %s\n", status, phrase);
+			break;
+		case nua_i_info:
+			_callback_i_info(modem, status, nh, sip);
+			break;
+		case nua_i_message:
+			_callback_i_message(modem, status, nh, sip);
+			break;
+		case nua_i_notify:
+			/* FIXME report event */
+			fprintf(stderr, "i_notify %03d %s\n", status, phrase);
+			break;
+		case nua_i_network_changed:
+			/* refresh the SDP offer once idle */
+			_sofia_sdp_invalidate(sofia);
+			if(sofia->sdp_source == 0)
+				sofia->sdp_source = g_idle_add(
+						_sofia_on_sdp_update, sofia);
+			break;
+		case nua_i_outbound:
+			/* FIXME what to do? */
+			fprintf(stderr, "i_outbound %03d %s\n", status, phrase);
+			break;
+		case nua_i_state:
+			_callback_i_state(modem, status, phrase, nh, tags);
+			break;
+		case nua_i_terminated:
+			_sofia_record_stop(sofia);
+			memset(&mevent, 0, sizeof(mevent));
+			mevent.type = MODEM_EVENT_TYPE_CALL;
+			/* FIXME also remember the other fields */
+			mevent.call.status = MODEM_CALL_STATUS_NONE;
+			helper->event(helper->modem, &mevent);
+			/* release the memory for this call */
+			_sofia_handle_remove(sofia, nh);
+			break;
+		case nua_r_get_params:
+			if(status == 200)
+				break;
+			/* FIXME what to do? */
+			fprintf(stderr, "r_get_params %03d %s\n", status,
+					phrase);
+			break;
+		case nua_r_info:
+			_callback_r_info(modem, status, nh);
+			break;
+		case nua_r_invite:
+			_callback_r_invite(modem, status, phrase, nh);
+			break;
+		case nua_r_message:
+			_callback_r_message(modem, status, phrase);
+			/* release the memory for this message */
+			if(status >= 200)
+				_sofia_handle_remove(sofia, nh);
+			break;
+		case nua_r_register:
+			_callback_r_register(modem, status, nh, sip, tags);
+			break;
+		case nua_r_set_params:
+			if(status == 200)
+				break;
+			/* FIXME implement */
+			fprintf(stderr, "r_set_params %03d %s\n", status,
+					phrase);
+			break;
+		case nua_r_shutdown:
+			/* exit the background loop when ready */
+			if(status == 200)
+				su_root_break(sofia->root);
+			break;
+		default:
+#ifdef DEBUG
+			fprintf(stderr, "DEBUG: %s() %s%d%s: %03d \"%s\"\n",
+					__func__, "event ", event,
+					" not handled: ", status, phrase);
+#endif
+			break;
+	}
+}
+
+static void _callback_i_info(ModemPlugin * modem, int status,
+		nua_handle_t * nh, sip_t const * sip)
+{
+	Sofia * sofia = modem;
+	ModemPluginHelper * helper = sofia->helper;
+	ModemEvent mevent;
+	sip_from_t const * from;
+	sip_to_t const * to;
+	SofiaHandle * handle;
+	sip_content_type_t const * type;
+	gchar * str;
+
+	if(status != 200)
+		/* FIXME report whatever that is */
+		return;
+	/* a notification arrived */
+	if(sip == NULL || (from = sip->sip_from) == NULL
+			|| (to = sip->sip_to) == NULL)
+		/* FIXME report whatever that is */
+		return;
+	if((type = sip->sip_content_type) != NULL
+			&& type->c_type != NULL
+			&& strcasecmp(type->c_type,
+				"application/trickle-ice-sdpfrag") == 0)
+	{
+		/* new candidates for the call */
+		if((handle = _sofia_handle_get(sofia, nh)) != NULL
+				&& handle->media != NULL
+				&& sip->sip_payload != NULL)
+		{
+			str = g_strndup(sip->sip_payload->pl_data,
+					sip->sip_payload->pl_len);
+			_sofia_media_remote(handle->media, str);
+			g_free(str);
+		}
+		return;
+	}
+	if(sip->sip_payload == NULL)
+		return;
+	memset(&mevent, 0, sizeof(mevent));
+	mevent.type = MODEM_EVENT_TYPE_NOTIFICATION;
+	/* FIXME we may want to include more information */
+	/* the payload is not nul-terminated */
+	str = g_strndup(sip->sip_payload->pl_data, sip->sip_payload->pl_len);
+	mevent.notification.content = str;
+	helper->event(helper->modem, &mevent);
+	g_free(str);
+}
+
+static void _callback_i_message(ModemPlugin * modem, int status,
+		nua_handle_t * nh, sip_t const * sip)
+{
+	Sofia * sofia = modem;
+	ModemPluginHelper * helper = sofia->helper;
+	ModemEvent mevent;
+	sip_from_t const * from;
+	sip_to_t const * to;
+	SofiaHandle * handle;
+	char * sender = NULL;
+
+	if(status != 200)
+		/* FIXME report whatever that is */
+		return;
+	/* a message arrived */
+	if(sip == NULL || (from = sip->sip_from) == NULL
 			|| (to = sip->sip_to) == NULL)
 		/* FIXME report whatever that is */
 		return;
+	if((handle = _sofia_handle_get(sofia, nh)) == NULL)
+		handle = _sofia_handle_adopt(sofia, SOFIA_HANDLE_TYPE_MESSAGE,
+				nh);
 	memset(&mevent, 0, sizeof(mevent));
 	mevent.type = MODEM_EVENT_TYPE_MESSAGE;
 	mevent.message.date = time(NULL);
 	/* XXX automatically import as a new contact? (from->a_display) */
-	snprintf(buf, sizeof(buf), URL_FORMAT_STRING,
-			URL_PRINT_ARGS(from->a_url));
-	mevent.message.number = buf;
+	if((mevent.message.number = _sofia_sender(sofia, from->a_url))
+			== NULL)
+		mevent.message.number = sender = url_as_string(NULL,
+				from->a_url);
 	mevent.message.folder = MODEM_MESSAGE_FOLDER_INBOX;
 	mevent.message.status = MODEM_MESSAGE_STATUS_NEW;
-	mevent.message.encoding = MODEM_MESSAGE_ENCODING_ASCII;
-	mevent.message.length = sip->sip_payload->pl_len;
-	mevent.message.content = sip->sip_payload->pl_data;
+	/* the payload is delivered as is, with its length */
+	if(sip->sip_payload != NULL)
+	{
+		mevent.message.encoding = _sofia_encoding(
+				sip->sip_payload->pl_data,
+				sip->sip_payload->pl_len);
+		mevent.message.length = sip->sip_payload->pl_len;
+		mevent.message.content = sip->sip_payload->pl_data;
+	}
+	else
+		mevent.message.encoding = MODEM_MESSAGE_ENCODING_ASCII;
 	helper->event(helper->modem, &mevent);
+	su_free(NULL, sender);
+	if(handle == NULL)
+		/* it could not be tracked */
+		nua_handle_destroy(nh);
+	/* this handle will not be used again outside of a dialog */
+	else if(to->a_tag == NULL)
+		_sofia_handle_remove(sofia, nh);
+}
+
+static void _callback_i_state(ModemPlugin * modem, int status,
+		char const * phrase, nua_handle_t * nh, tagi_t tags[])
+{
+	Sofia * sofia = modem;
+	SofiaHandle * handle;
+	int state = nua_callstate_init;
+	char const * sdp = NULL;
+
+	/* FIXME report event, particularly if 180 Ringing! */
+	fprintf(stderr, "i_state %03d %s\n", status, phrase);
+	if((handle = _sofia_handle_get(sofia, nh)) == NULL
+			|| handle->media == NULL)
+		return;
+	tl_gets(tags, NUTAG_CALLSTATE_REF(state),
+			SOATAG_REMOTE_SDP_STR_REF(sdp), TAG_END());
+	if(sdp != NULL)
+		_sofia_media_remote(handle->media, sdp);
+	/* candidates can be trickled once there is a dialog */
+	if(state == nua_callstate_early || state == nua_callstate_completing
+			|| state == nua_callstate_ready)
+		_sofia_media_dialog(handle->media);
+	if(state == nua_callstate_ready)
+		_sofia_media_ready(handle->media);
+}
+
+static void _callback_r_info(ModemPlugin * modem, int status,
+		nua_handle_t * nh)
+{
+	Sofia * sofia = modem;
+	ModemPluginHelper * helper = sofia->helper;
+	SofiaHandle * handle;
+	SofiaInfoType type = SOFIA_INFO_TYPE_DTMF;
+
+	if(status < 200)
+		return;
+	/* match the response with its request */
+	if((handle = _sofia_handle_get(sofia, nh)) != NULL
+			&& handle->media != NULL
+			&& !g_queue_is_empty(&handle->media->info))
+		type = GPOINTER_TO_INT(g_queue_pop_head(&handle->media->info));
+	/* the remote side may not support trickle ICE */
+	if(type == SOFIA_INFO_TYPE_TRICKLE || status == 200)
+		return;
+	helper->error(helper->modem, "Could not send DTMF", 1);
 }
 
 static void _callback_r_invite(ModemPlugin * modem, int status,
@@ -701,3 +3706,119 @@ static void _callback_r_register(ModemPlugin * modem, int status,
 			= MODEM_REGISTRATION_STATUS_NOT_SEARCHING;
 	helper->event(helper->modem, &mevent);
 }
+
+
+/* sofia_on_sdp_update */
+static gboolean _sofia_on_sdp_update(gpointer data)
+{
+	Sofia * sofia = data;
+
+	sofia->sdp_source = 0;
+	_sofia_sdp_update(sofia);
+	return FALSE;
+}
+
+
+/* media_on_io */
+static gboolean _media_on_io(GIOChannel * source, GIOCondition condition,
+		gpointer data)
+{
+	SofiaMedia * media = data;
+	unsigned char buf[SOFIA_MEDIA_SIZE];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	ssize_t len;
+	struct timespec ts[2];
+	(void) source;
+	(void) condition;
+
+	/* account for the CPU time spent on the media */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts[0]);
+	for(;;)
+	{
+		fromlen = sizeof(from);
+		if((len = recvfrom(media->fd, buf, sizeof(buf), 0,
+						(struct sockaddr *)&from,
+						&fromlen)) < 0)
+			break;
+		if(from.sin_family == AF_INET)
+			_media_packet(media, buf, len, &from, 0);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts[1]);
+	media->rtp.cpu += (ts[1].tv_sec - ts[0].tv_sec) * 1000000
+		+ (ts[1].tv_nsec - ts[0].tv_nsec) / 1000;
+	return TRUE;
+}
+
+
+/* media_on_rtcp */
+static gboolean _media_on_rtcp(gpointer data)
+{
+	SofiaMedia * media = data;
+	SofiaRtp * rtp = &media->rtp;
+
+	/* size the jitter buffer after the last interval */
+	rtp->buffer = rtp->transit_max - rtp->transit_min;
+	rtp->reference = rtp->transit;
+	rtp->transit_min = 0;
+	rtp->transit_max = 0;
+	_media_rtcp_send(media);
+	_media_report(media);
+	/* randomize the interval (RFC 3550, section 6.3.1) */
+	media->rtcp = g_timeout_add(SOFIA_RTCP_INTERVAL / 2
+			+ g_random_int_range(0, SOFIA_RTCP_INTERVAL),
+			_media_on_rtcp, media);
+	return FALSE;
+}
+
+
+/* media_on_refresh */
+static gboolean _media_on_refresh(gpointer data)
+{
+	SofiaMedia * media = data;
+	Sofia * sofia = media->sofia;
+	size_t i;
+
+	/* keep the allocation and the permissions alive */
+	_media_transaction(media, SOFIA_STUN_TYPE_REFRESH, &sofia->turn, 0, 0,
+			0);
+	for(i = 0; i < media->remote_cnt; i++)
+		if(media->remote[i].permission == 2)
+			_media_transaction(media, SOFIA_STUN_TYPE_PERMISSION,
+					&sofia->turn, i, 0, 0);
+	return TRUE;
+}
+
+
+/* media_on_timeout */
+static gboolean _media_on_timeout(gpointer data)
+{
+	SofiaMedia * media = data;
+	SofiaTransaction * transaction;
+	gint64 now = g_get_monotonic_time();
+	size_t i;
+
+	for(i = 0; i < SOFIA_ICE_TRANSACTIONS; i++)
+	{
+		transaction = &media->transactions[i];
+		if(!transaction->active)
+			continue;
+		if(now < transaction->timeout)
+			continue;
+		if(transaction->retries++ == SOFIA_STUN_RETRIES)
+		{
+			/* the transaction timed out */
+			_media_complete(media, transaction);
+			continue;
+		}
+		transaction->timeout = now + ((gint64)SOFIA_STUN_RTO * 1000
+				<< transaction->retries);
+		_media_send(media, transaction->relayed, transaction->stun.buf,
+				transaction->stun.len, &transaction->addr);
+	}
+	for(i = 0; i < SOFIA_ICE_TRANSACTIONS; i++)
+		if(media->transactions[i].active)
+			return TRUE;
+	media->timeout = 0;
+	return FALSE;
+}
@@ -0,0 +1,87 @@
+/* $Id$ */
+/* Copyright (c) 2011-2020 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+#ifndef DESKTOP_PHONE_MODEMS_SOFIA_H
+# define DESKTOP_PHONE_MODEMS_SOFIA_H
+
+# include <sys/types.h>
+# include <netinet/in.h>
+# include <stdint.h>
+
+
+/* Sofia */
+/* types */
+/* requests specific to the Sofia modem plug-in: sent as
+ * MODEM_REQUEST_UNSUPPORTED, and reported as MODEM_EVENT_TYPE_UNSUPPORTED,
+ * with these numbers as request */
+typedef enum _SofiaRequest
+{
+	SOFIA_REQUEST_RECORD_START = 0,	/* arg: filename (optional) */
+	SOFIA_REQUEST_RECORD_STOP,	/* event: SofiaRecordStats */
+	SOFIA_REQUEST_RECORD_AUDIO,	/* arg: samples, size: in bytes */
+	SOFIA_REQUEST_MEDIA_STATS,	/* event: SofiaMediaStats */
+	SOFIA_REQUEST_MEMORY_STATS	/* event: SofiaMemoryStats */
+} SofiaRequest;
+
+typedef struct _SofiaMediaQuality
+{
+	double loss;		/* fraction of the packets lost */
+	double burst;		/* fraction of the packets lost within bursts */
+	int64_t jitter;		/* interarrival jitter (in microseconds) */
+	int64_t buffer;		/* jitter buffer depth (in microseconds) */
+	double mos;		/* listening quality, from 1 to 5 (0 if unknown) */
+} SofiaMediaQuality;
+
+typedef struct _SofiaMediaStats
+{
+	/* from dialling to the first media packet (in microseconds) */
+	int64_t setup;
+	/* round-trip time, from RTCP if available or else from the selected
+	 * candidate pair (in microseconds) */
+	int64_t rtt;
+	struct sockaddr_in address;
+	/* reception */
+	uint64_t received;
+	int64_t lost;
+	SofiaMediaQuality local;
+	/* as reported by the remote end (RTCP and RTCP XR) */
+	SofiaMediaQuality remote;
+	/* CPU time spent handling the media (in microseconds) */
+	int64_t cpu;
+	/* fraction of the call duration spent handling the media */
+	double load;
+} SofiaMediaStats;
+
+typedef struct _SofiaMemoryStats
+{
+	/* transactions in progress, each with its own home */
+	uint64_t homes;
+	uint64_t homes_peak;
+	/* allocated in these homes (in bytes) */
+	uint64_t bytes;
+	uint64_t bytes_peak;
+	/* allocated for the whole plug-in (in bytes) */
+	uint64_t shared;
+} SofiaMemoryStats;
+
+typedef struct _SofiaRecordStats
+{
+	uint64_t written;
+	uint64_t dropped;
+} SofiaRecordStats;
+
+#endif /* !DESKTOP_PHONE_MODEMS_SOFIA_H */
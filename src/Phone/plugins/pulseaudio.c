@@ -13,19 +13,27 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 /* TODO:
- * - optionally loop the audio sample until told to stop
- * - implement setting the volume (for headset/loudspeaker/audio...) */
+ * - decode other formats than WAV
+ * - resample the voice for modems with other rates */
 
 
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <libintl.h>
 #include <gtk/gtk.h>
 #include <pulse/pulseaudio.h>
 #include <System.h>
 #include <Desktop/Phone.h>
+#include "pulseaudio.h"
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
 #ifndef PACKAGE
@@ -36,7 +44,167 @@
 /* Pulseaudio */
 /* private */
 /* types */
-typedef struct _PhonePlugin
+typedef struct _PhonePlugin Pulseaudio;
+
+/* latency, in powers of two of milliseconds */
+#define PULSEAUDIO_HISTOGRAM	12
+typedef struct _PulseaudioHistogram
+{
+	unsigned long buckets[PULSEAUDIO_HISTOGRAM];
+	unsigned long cnt;
+	gint64 total;
+	gint64 max;
+} PulseaudioHistogram;
+
+/* voice processing, on the audio captured */
+typedef struct _PulseaudioDSP
+{
+	/* echo cancellation, as the filter reversed */
+	float * taps;
+	/* active taps, within the budget */
+	size_t taps_cnt;
+	/* consecutive packets over, and within the budget */
+	unsigned int overruns;
+	unsigned int within;
+	/* audio played, latest last */
+	float * history;
+	float * near;
+
+	/* noise suppression */
+	float noise;
+	float suppression;
+
+	/* automatic gain control */
+	float gain;
+} PulseaudioDSP;
+
+typedef enum _PulseaudioRoute
+{
+	PULSEAUDIO_ROUTE_AUDIO = 0,
+	PULSEAUDIO_ROUTE_HEADSET,
+	PULSEAUDIO_ROUTE_LOUDSPEAKER
+} PulseaudioRoute;
+#define PULSEAUDIO_ROUTE_LAST	PULSEAUDIO_ROUTE_LOUDSPEAKER
+#define PULSEAUDIO_ROUTE_COUNT	(PULSEAUDIO_ROUTE_LAST + 1)
+
+/* from the highest priority */
+typedef enum _PulseaudioClass
+{
+	PULSEAUDIO_CLASS_RINGTONE = 0,
+	PULSEAUDIO_CLASS_ALERT,
+	PULSEAUDIO_CLASS_FEEDBACK
+} PulseaudioClass;
+#define PULSEAUDIO_CLASS_LAST	PULSEAUDIO_CLASS_FEEDBACK
+#define PULSEAUDIO_CLASS_COUNT	(PULSEAUDIO_CLASS_LAST + 1)
+
+typedef struct _PulseaudioClassDefinition
+{
+	/* played at once */
+	size_t limit;
+	/* waiting for their turn */
+	size_t queue;
+	/* stopped for higher priorities, or the latest of the class */
+	gboolean preemptible;
+} PulseaudioClassDefinition;
+
+typedef enum _PulseaudioPlaybackState
+{
+	PPS_QUEUED = 0,
+	PPS_STARTING,
+	PPS_PLAYING
+} PulseaudioPlaybackState;
+
+typedef struct _PulseaudioPlayback
+{
+	Pulseaudio * pa;
+	gchar * name;
+	PulseaudioClass pclass;
+	PulseaudioPlaybackState state;
+	pa_operation * pao;
+	/* the sink input, once started */
+	uint32_t index;
+	/* stopped once started */
+	gboolean cancelled;
+	/* when requested, for the statistics */
+	gint64 requested;
+} PulseaudioPlayback;
+
+typedef enum _PulseaudioSampleState
+{
+	PSS_NONE = 0,
+	PSS_DECODING,
+	PSS_DECODED,
+	PSS_UPLOADING,
+	PSS_CACHED
+} PulseaudioSampleState;
+
+/* single producer, single consumer */
+typedef struct _PulseaudioRing
+{
+	int16_t * frames;
+	guint size;
+	/* only moved by the producer and the consumer respectively */
+	gint head;
+	gint tail;
+} PulseaudioRing;
+
+/* from the main thread to the main loop of PulseAudio */
+typedef enum _PulseaudioCommandType
+{
+	PCT_PLAY = 0,	/* sample: to play, or NULL to stop */
+	PCT_ROUTE,	/* call, route, volume */
+	PCT_VOICE	/* call: to open or close the streams */
+} PulseaudioCommandType;
+
+typedef struct _PulseaudioCommand
+{
+	PulseaudioCommandType type;
+	/* when requested */
+	gint64 time;
+	gchar * sample;
+	gboolean call;
+	PulseaudioRoute route;
+	double volume;
+} PulseaudioCommand;
+
+/* commands pending at most (a power of two) */
+#define PULSEAUDIO_COMMANDS	64
+/* state sent again when the commands did not fit (in milliseconds) */
+#define PULSEAUDIO_RETRY	20
+
+typedef struct _PulseaudioSampleDefinition
+{
+	char const * name;
+	/* played until told to stop */
+	gboolean loop;
+	PulseaudioClass pclass;
+} PulseaudioSampleDefinition;
+
+typedef struct _PulseaudioSample
+{
+	Pulseaudio * pa;
+	char const * name;
+	gchar * filename;
+	gboolean loop;
+	PulseaudioClass pclass;
+
+	/* decoded, until uploaded */
+	PulseaudioSampleState state;
+	gchar * contents;
+	pa_sample_spec spec;
+	char const * data;
+	size_t size;
+	size_t written;
+	pa_stream * stream;
+
+	/* last use, for eviction */
+	gint64 used;
+	/* play once uploaded, as requested then */
+	gboolean play;
+	gint64 requested;
+} PulseaudioSample;
+
+struct _PhonePlugin
 {
 	PhonePluginHelper * helper;
 
@@ -44,17 +212,280 @@ typedef struct _PhonePlugin
 
 	pa_threaded_mainloop * pam;
 	pa_context * pac;
-	pa_operation * pao;
-} Pulseaudio;
+	/* in the order requested, queued or started */
+	GSList * playbacks;
+	/* single producer, single consumer */
+	PulseaudioCommand commands[PULSEAUDIO_COMMANDS];
+	gint commands_head;
+	gint commands_tail;
+	/* the route and voice state, when the ring was full */
+	guint retry;
+	gboolean retry_route;
+	gboolean retry_voice;
+	/* wakes the main loop of PulseAudio up */
+	int wakeup[2];
+	pa_io_event * wakeup_io;
+	/* after the server went away (in milliseconds) */
+	pa_time_event * reconnect;
+	unsigned int reconnect_delay;
+	/* other samples requested until connected */
+	GSList * pending;
+
+	/* instrumentation, from the event to the audio */
+	gint64 loop_requested;
+	PulseaudioHistogram issued;
+	PulseaudioHistogram started;
+	unsigned long underruns;
+	guint stats_source;
+
+	/* samples, preloaded into the server */
+	PulseaudioSample * samples;
+	size_t samples_cnt;
+	GThreadPool * decoder;
+	size_t cached;
+	size_t cache_size;
+
+	/* looping */
+	pa_stream * loop;
+	PulseaudioSample * loop_sample;
+	size_t loop_offset;
+
+	/* calls in progress, with their status by number */
+	GHashTable * calls;
+
+	/* routes, as requested */
+	double volumes[PULSEAUDIO_ROUTE_COUNT];
+	gboolean call;
+	gboolean speaker;
+	/* routes, as applied by the main loop of PulseAudio */
+	PulseaudioRoute route;
+	double volume;
+	gboolean calling;
+	gboolean ringing;
+	/* at once, on the next iteration */
+	pa_defer_event * update;
+	/* other streams lowered, with their original volume */
+	gboolean ducking;
+	GHashTable * ducked;
+
+	/* voice, exchanged with the modem during calls */
+	gchar * voice_modem;
+	unsigned int voice_request;
+	gboolean voice;
+	gboolean voice_open;
+	pa_stream * capture;
+	pa_stream * playback;
+	/* from the capture stream to the modem */
+	PulseaudioRing uplink;
+	/* from the modem to the playback stream */
+	PulseaudioRing downlink;
+	guint voice_source;
+	/* the scheduling of the I/O thread, to be restored */
+	gboolean realtime;
+	int realtime_policy;
+	struct sched_param realtime_param;
+	/* echo cancellation, noise suppression and gain control */
+	PulseaudioDSP * dsp;
+	/* from the playback stream to the DSP, as reference */
+	PulseaudioRing echo;
+	/* end to end, and as reported for each stream (in microseconds) */
+	gint capture_latency;
+	gint playback_latency;
+	pa_usec_t latency;
+	pa_usec_t latency_max;
+	uint64_t latency_total;
+	unsigned long latency_cnt;
+};
+
+
+/* constants */
+/* samples preloaded, as configured */
+static const PulseaudioSampleDefinition _pa_samples[] =
+{
+	{ "ringtone",		TRUE,	PULSEAUDIO_CLASS_RINGTONE	},
+	{ "notification",	FALSE,	PULSEAUDIO_CLASS_ALERT		},
+	{ "message",		FALSE,	PULSEAUDIO_CLASS_ALERT		}
+};
+
+/* playbacks, from the highest priority */
+static const PulseaudioClassDefinition _pa_classes[PULSEAUDIO_CLASS_COUNT] =
+{
+	{ 1,	0,	FALSE	},	/* looping on its own stream */
+	{ 1,	4,	FALSE	},	/* one after the other */
+	{ 2,	0,	TRUE	}	/* replacing the oldest */
+};
+
+/* memory allowed in the sample cache of the server (in kilobytes) */
+#define PULSEAUDIO_CACHE_SIZE	4096
+
+/* delay before publishing the statistics changed (in seconds) */
+#define PULSEAUDIO_STATS_INTERVAL	10
+
+/* buffered ahead when looping (in microseconds) */
+#define PULSEAUDIO_LOOP_LATENCY	40000
+
+/* delay before connecting again (in milliseconds) */
+#define PULSEAUDIO_RECONNECT	500
+#define PULSEAUDIO_RECONNECT_MAX	30000
+
+/* volume of the other streams when ringing or in a call */
+#define PULSEAUDIO_DUCK		0.2
+
+/* voice, in the format of pulseaudio.h */
+/* fragments exchanged with the server (in microseconds) */
+#define PULSEAUDIO_VOICE_FRAGMENT	10000
+/* buffered ahead for playback (in microseconds) */
+#define PULSEAUDIO_VOICE_LATENCY	20000
+/* received in advance before dropping (in milliseconds) */
+#define PULSEAUDIO_VOICE_BACKLOG	60
+/* frames held in each direction (a power of two) */
+#define PULSEAUDIO_VOICE_RING	4096
+/* priority of the I/O thread, where permitted */
+#define PULSEAUDIO_VOICE_PRIORITY	5
+
+/* echo tail cancelled (64 ms) */
+#define PULSEAUDIO_DSP_TAPS	512
+#define PULSEAUDIO_DSP_TAPS_MIN	64
+/* time allowed per packet (in microseconds) */
+#define PULSEAUDIO_DSP_BUDGET	2000
+/* packets in a row over the budget before shortening the tail, and within
+ * the budget before lengthening it again (10 s) */
+#define PULSEAUDIO_DSP_OVERRUNS	5
+#define PULSEAUDIO_DSP_WITHIN	500
+/* adaptation step and regularization of the filter */
+#define PULSEAUDIO_DSP_MU	0.5f
+#define PULSEAUDIO_DSP_DELTA	1.0e6f
+/* near end louder than this fraction of the far end: double talk */
+#define PULSEAUDIO_DSP_GEIGEL	0.5f
+/* attenuation at most, and over-subtraction of the noise */
+#define PULSEAUDIO_DSP_NS_FLOOR	0.1f
+#define PULSEAUDIO_DSP_NS_OVER	2.0f
+/* rise of the noise floor per packet */
+#define PULSEAUDIO_DSP_NS_RISE	1.002f
+/* level aimed at (about -18 dBFS) and the range of gain */
+#define PULSEAUDIO_DSP_AGC_TARGET	4000.0f
+#define PULSEAUDIO_DSP_AGC_MIN	0.5f
+#define PULSEAUDIO_DSP_AGC_MAX	8.0f
+
+/* vectorised with the compiler, unless asked otherwise */
+#if defined(__GNUC__) && !defined(PULSEAUDIO_DSP_SCALAR)
+typedef float PulseaudioVector __attribute__ ((vector_size(16)));
+# define PULSEAUDIO_DSP_VECTOR	(sizeof(PulseaudioVector) / sizeof(float))
+#endif
+
+static char const * _pa_routes[PULSEAUDIO_ROUTE_COUNT] =
+{
+	"volume_audio", "volume_headset", "volume_loudspeaker"
+};
+
 
 /* prototypes */
 /* plug-in */
 static Pulseaudio * _pa_init(PhonePluginHelper * helper);
 static void _pa_destroy(Pulseaudio * pa);
 static int _pa_event(Pulseaudio * pa, PhoneEvent * event);
+static void _pa_settings(Pulseaudio * pa);
 
 /* useful */
+static int _pa_command(Pulseaudio * pa, PulseaudioCommand * command);
+static int _pa_connect(Pulseaudio * pa);
 static void _pa_play(Pulseaudio * pa, char const * sound);
+static void _pa_retry(Pulseaudio * pa, PulseaudioCommandType type);
+
+/* routes */
+static PulseaudioRoute _pa_route_get(Pulseaudio * pa);
+static void _pa_route_send(Pulseaudio * pa);
+static void _pa_route_update(Pulseaudio * pa);
+static pa_volume_t _pa_route_volume(Pulseaudio * pa);
+
+/* dsp */
+static void _pa_dsp_axpy(float * y, float a, float const * x, size_t cnt);
+static void _pa_dsp_axpy_scalar(float * y, float a, float const * x,
+		size_t cnt);
+static void _pa_dsp_delete(PulseaudioDSP * dsp);
+static float _pa_dsp_dot(float const * a, float const * b, size_t cnt);
+static float _pa_dsp_dot_scalar(float const * a, float const * b, size_t cnt);
+static PulseaudioDSP * _pa_dsp_new(void);
+static void _pa_dsp_process(PulseaudioDSP * dsp, int16_t * frames,
+		int16_t const * reference, size_t cnt);
+static void _pa_dsp_reset(PulseaudioDSP * dsp);
+
+/* loop */
+static void _pa_loop_close(Pulseaudio * pa);
+static int _pa_loop_start(Pulseaudio * pa, PulseaudioSample * sample);
+static void _pa_loop_stop(Pulseaudio * pa);
+
+/* playbacks */
+static void _pa_playback_cancel(PulseaudioPlayback * playback);
+static size_t _pa_playback_count(Pulseaudio * pa, PulseaudioClass pclass,
+		gboolean queued);
+static void _pa_playback_delete(PulseaudioPlayback * playback);
+static PulseaudioPlayback * _pa_playback_find(Pulseaudio * pa,
+		uint32_t index);
+static gboolean _pa_playback_held(Pulseaudio * pa, PulseaudioClass pclass);
+static void _pa_playback_next(Pulseaudio * pa);
+static void _pa_playback_preempt(Pulseaudio * pa, PulseaudioClass pclass);
+static int _pa_playback_request(Pulseaudio * pa, char const * name,
+		PulseaudioClass pclass, gint64 requested);
+static void _pa_playback_start(PulseaudioPlayback * playback);
+
+/* rings */
+static guint _pa_ring_fill(PulseaudioRing * ring);
+static int _pa_ring_init(PulseaudioRing * ring, guint size);
+static guint _pa_ring_read(PulseaudioRing * ring, int16_t * frames, guint cnt);
+static void _pa_ring_reset(PulseaudioRing * ring);
+static guint _pa_ring_skip(PulseaudioRing * ring, guint cnt);
+static guint _pa_ring_write(PulseaudioRing * ring, int16_t const * frames,
+		guint cnt);
+
+/* samples */
+static int _pa_sample_decode(PulseaudioSample * sample);
+static void _pa_sample_evict(Pulseaudio * pa, PulseaudioSample * keep);
+static PulseaudioSample * _pa_sample_get(Pulseaudio * pa, char const * name);
+static void _pa_sample_play(PulseaudioSample * sample);
+static void _pa_sample_reset(PulseaudioSample * sample);
+static int _pa_sample_upload(PulseaudioSample * sample);
+
+/* stats */
+static void _pa_stats_add(PulseaudioHistogram * histogram, gint64 usec);
+static void _pa_stats_changed(Pulseaudio * pa);
+static void _pa_stats_issued(Pulseaudio * pa, gint64 requested);
+static void _pa_stats_print(Pulseaudio * pa, GString * str);
+static void _pa_stats_started(Pulseaudio * pa, gint64 requested,
+		gint64 latency);
+
+/* voice */
+static void _pa_voice_close(Pulseaudio * pa);
+static int _pa_voice_open(Pulseaudio * pa);
+static int _pa_voice_start(Pulseaudio * pa);
+static void _pa_voice_stop(Pulseaudio * pa);
+
+/* callbacks */
+static void _pa_on_command(pa_mainloop_api * mapi, pa_io_event * event,
+		int fd, pa_io_event_flags_t flags, void * data);
+static void _pa_on_context_state(pa_context * pac, void * data);
+static void _pa_on_decode(gpointer data, gpointer user_data);
+static void _pa_on_duck(pa_context * pac, pa_sink_input_info const * info,
+		int eol, void * data);
+static void _pa_on_loop_started(pa_stream * stream, void * data);
+static void _pa_on_loop_state(pa_stream * stream, void * data);
+static void _pa_on_loop_write(pa_stream * stream, size_t size, void * data);
+static void _pa_on_played(pa_context * pac, uint32_t index, void * data);
+static void _pa_on_reconnect(pa_mainloop_api * mapi, pa_time_event * event,
+		struct timeval const * tv, void * data);
+static gboolean _pa_on_retry(gpointer data);
+static void _pa_on_sample_state(pa_stream * stream, void * data);
+static void _pa_on_sample_write(pa_stream * stream, size_t size, void * data);
+static gboolean _pa_on_stats(gpointer data);
+static void _pa_on_subscribe(pa_context * pac,
+		pa_subscription_event_type_t type, uint32_t index, void * data);
+static void _pa_on_underflow(pa_stream * stream, void * data);
+static void _pa_on_update(pa_mainloop_api * mapi, pa_defer_event * event,
+		void * data);
+static void _pa_on_voice_read(pa_stream * stream, size_t size, void * data);
+static void _pa_on_voice_state(pa_stream * stream, void * data);
+static gboolean _pa_on_voice_timeout(gpointer data);
+static void _pa_on_voice_write(pa_stream * stream, size_t size, void * data);
 
 
 /* public */
@@ -67,7 +498,7 @@ PhonePluginDefinition plugin =
 	_pa_init,
 	_pa_destroy,
 	_pa_event,
-	NULL
+	_pa_settings
 };
 
 
@@ -78,6 +509,8 @@ static Pulseaudio * _pa_init(PhonePluginHelper * helper)
 {
 	Pulseaudio * pa;
 	pa_mainloop_api * mapi = NULL;
+	char const * p;
+	size_t i;
 
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s()\n", __func__);
@@ -88,22 +521,125 @@ static Pulseaudio * _pa_init(PhonePluginHelper * helper)
 	pa->source = 0;
 	pa->pam = pa_threaded_mainloop_new();
 	pa->pac = NULL;
-	pa->pao = NULL;
-	if(pa->pam == NULL)
+	pa->playbacks = NULL;
+	pa->commands_head = 0;
+	pa->commands_tail = 0;
+	pa->retry = 0;
+	pa->retry_route = FALSE;
+	pa->retry_voice = FALSE;
+	pa->wakeup[0] = -1;
+	pa->wakeup[1] = -1;
+	pa->wakeup_io = NULL;
+	pa->reconnect = NULL;
+	pa->reconnect_delay = PULSEAUDIO_RECONNECT;
+	pa->pending = NULL;
+	pa->loop_requested = 0;
+	memset(&pa->issued, 0, sizeof(pa->issued));
+	memset(&pa->started, 0, sizeof(pa->started));
+	pa->underruns = 0;
+	pa->stats_source = 0;
+	pa->samples = NULL;
+	pa->samples_cnt = 0;
+	pa->decoder = g_thread_pool_new(_pa_on_decode, pa, 1, FALSE, NULL);
+	pa->cached = 0;
+	pa->loop = NULL;
+	pa->loop_sample = NULL;
+	pa->loop_offset = 0;
+	for(i = 0; i < PULSEAUDIO_ROUTE_COUNT; i++)
+		if((p = helper->config_get(helper->phone, "pulseaudio",
+						_pa_routes[i])) == NULL
+				|| (pa->volumes[i] = strtod(p, NULL)) < 0.0
+				|| pa->volumes[i] > 1.0)
+			pa->volumes[i] = 1.0;
+	pa->calls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			NULL);
+	pa->call = FALSE;
+	pa->speaker = FALSE;
+	pa->route = PULSEAUDIO_ROUTE_AUDIO;
+	pa->volume = pa->volumes[pa->route];
+	pa->calling = FALSE;
+	pa->ringing = FALSE;
+	pa->update = NULL;
+	pa->ducking = FALSE;
+	pa->ducked = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			g_free);
+	pa->voice_modem = NULL;
+	pa->voice = FALSE;
+	pa->voice_open = FALSE;
+	pa->capture = NULL;
+	pa->playback = NULL;
+	memset(&pa->uplink, 0, sizeof(pa->uplink));
+	memset(&pa->downlink, 0, sizeof(pa->downlink));
+	pa->dsp = NULL;
+	memset(&pa->echo, 0, sizeof(pa->echo));
+	pa->voice_source = 0;
+	pa->realtime = FALSE;
+	pa->capture_latency = -1;
+	pa->playback_latency = -1;
+	/* the voice path is only bridged with the modem configured */
+	if((p = helper->config_get(helper->phone, "pulseaudio", "voice_modem"))
+			!= NULL
+			&& _pa_ring_init(&pa->uplink, PULSEAUDIO_VOICE_RING)
+			== 0
+			&& _pa_ring_init(&pa->downlink, PULSEAUDIO_VOICE_RING)
+			== 0)
+		pa->voice_modem = g_strdup(p);
+	/* optional, mostly useful for hands-free calls */
+	if(pa->voice_modem != NULL && (p = helper->config_get(helper->phone,
+					"pulseaudio", "voice_dsp")) != NULL
+			&& strtol(p, NULL, 10) != 0
+			&& _pa_ring_init(&pa->echo, PULSEAUDIO_VOICE_RING)
+			== 0)
+		pa->dsp = _pa_dsp_new();
+	pa->voice_request = ((p = helper->config_get(helper->phone,
+					"pulseaudio", "voice_request")) != NULL)
+		? strtoul(p, NULL, 10) : 0;
+	if((p = helper->config_get(helper->phone, "pulseaudio", "cache_size"))
+			== NULL || (pa->cache_size = strtoul(p, NULL, 10)) == 0)
+		pa->cache_size = PULSEAUDIO_CACHE_SIZE;
+	pa->cache_size *= 1024;
+	if(pa->pam == NULL || pa->decoder == NULL || pipe(pa->wakeup) != 0
+			|| (pa->samples = object_new(sizeof(*pa->samples)
+					* (sizeof(_pa_samples)
+						/ sizeof(*_pa_samples))))
+			== NULL)
 	{
 		_pa_destroy(pa);
 		error_set_code(1, "%s", "Could not initialize PulseAudio");
 		return NULL;
 	}
 	mapi = pa_threaded_mainloop_get_api(pa->pam);
-	/* XXX update the context name */
-	if((pa->pac = pa_context_new(mapi, PACKAGE)) == NULL)
+	if(_pa_connect(pa) != 0)
 	{
 		_pa_destroy(pa);
 		error_set_code(1, "%s", "Could not initialize PulseAudio");
 		return NULL;
 	}
-	pa_context_connect(pa->pac, NULL, 0, NULL);
+	if((pa->update = mapi->defer_new(mapi, _pa_on_update, pa)) != NULL)
+		mapi->defer_enable(pa->update, 0);
+	/* commands are handed over without locking */
+	for(i = 0; i < 2; i++)
+		fcntl(pa->wakeup[i], F_SETFL, fcntl(pa->wakeup[i], F_GETFL)
+				| O_NONBLOCK);
+	pa->wakeup_io = mapi->io_new(mapi, pa->wakeup[0], PA_IO_EVENT_INPUT,
+			_pa_on_command, pa);
+	/* decode the samples configured in the background */
+	for(i = 0; i < sizeof(_pa_samples) / sizeof(*_pa_samples); i++)
+	{
+		memset(&pa->samples[i], 0, sizeof(pa->samples[i]));
+		pa->samples[i].pa = pa;
+		pa->samples[i].name = _pa_samples[i].name;
+		pa->samples[i].loop = _pa_samples[i].loop;
+		pa->samples[i].pclass = _pa_samples[i].pclass;
+		pa->samples[i].state = PSS_NONE;
+		pa->samples_cnt++;
+		if((p = helper->config_get(helper->phone, "pulseaudio",
+						_pa_samples[i].name)) == NULL)
+			continue;
+		pa->samples[i].filename = g_strdup(p);
+		pa->samples[i].state = PSS_DECODING;
+		g_thread_pool_push(pa->decoder, &pa->samples[i], NULL);
+	}
 	pa_threaded_mainloop_start(pa->pam);
 	return pa;
 }
@@ -112,21 +648,85 @@ static Pulseaudio * _pa_init(PhonePluginHelper * helper)
 /* pa_destroy */
 static void _pa_destroy(Pulseaudio * pa)
 {
+	size_t i;
 #ifdef DEBUG
+	GString * str;
+
 	fprintf(stderr, "DEBUG: %s()\n", __func__);
+	str = g_string_new(NULL);
+	_pa_stats_print(pa, str);
+	fputs(str->str, stderr);
+	g_string_free(str, TRUE);
 #endif
 	if(pa->source != 0)
 		g_source_remove(pa->source);
-	if(pa->pao != NULL)
-		pa_operation_cancel(pa->pao);
+	if(pa->voice_source != 0)
+		g_source_remove(pa->voice_source);
+	if(pa->retry != 0)
+		g_source_remove(pa->retry);
+	/* wait for the samples being decoded */
+	if(pa->decoder != NULL)
+		g_thread_pool_free(pa->decoder, TRUE, TRUE);
+	if(pa->pam != NULL)
+		pa_threaded_mainloop_stop(pa->pam);
+	/* scheduled from the main loop of PulseAudio */
+	if(pa->stats_source != 0)
+		g_source_remove(pa->stats_source);
+	while(pa->playbacks != NULL)
+		_pa_playback_delete(pa->playbacks->data);
+	if(pa->loop != NULL)
+		_pa_loop_close(pa);
+	_pa_voice_close(pa);
+	if(pa->update != NULL)
+		pa_threaded_mainloop_get_api(pa->pam)->defer_free(pa->update);
+	if(pa->reconnect != NULL)
+		pa_threaded_mainloop_get_api(pa->pam)->time_free(
+				pa->reconnect);
+	if(pa->wakeup_io != NULL)
+		pa_threaded_mainloop_get_api(pa->pam)->io_free(pa->wakeup_io);
+	/* the commands left over */
+	for(; pa->commands_tail != pa->commands_head; pa->commands_tail++)
+		g_free(pa->commands[(guint)pa->commands_tail
+				% PULSEAUDIO_COMMANDS].sample);
+	for(i = 0; i < 2; i++)
+		if(pa->wakeup[i] >= 0)
+			close(pa->wakeup[i]);
+	g_slist_free_full(pa->pending, g_free);
+	for(i = 0; i < pa->samples_cnt; i++)
+	{
+		_pa_sample_reset(&pa->samples[i]);
+		g_free(pa->samples[i].filename);
+	}
+	if(pa->samples != NULL)
+		object_delete(pa->samples);
 	if(pa->pac != NULL)
+	{
+		/* do not connect again */
+		pa_context_set_state_callback(pa->pac, NULL, NULL);
+		pa_context_disconnect(pa->pac);
 		pa_context_unref(pa->pac);
-	pa_threaded_mainloop_free(pa->pam);
+	}
+	if(pa->pam != NULL)
+		pa_threaded_mainloop_free(pa->pam);
+	g_hash_table_destroy(pa->ducked);
+	g_hash_table_destroy(pa->calls);
+	g_free(pa->uplink.frames);
+	g_free(pa->downlink.frames);
+	g_free(pa->echo.frames);
+	if(pa->dsp != NULL)
+		_pa_dsp_delete(pa->dsp);
+	g_free(pa->voice_modem);
 	object_delete(pa);
 }
 
 
 /* pa_event */
+static void _event_modem(Pulseaudio * pa, ModemEvent * event);
+static void _event_modem_voice(Pulseaudio * pa, ModemEvent * event);
+static void _event_speaker(Pulseaudio * pa, gboolean speaker);
+static void _event_volume_get(Pulseaudio * pa, PhoneEvent * event);
+static void _event_volume_set(Pulseaudio * pa, double level);
+
 static int _pa_event(Pulseaudio * pa, PhoneEvent * event)
 {
 	switch(event->type)
@@ -137,28 +737,2192 @@ static int _pa_event(Pulseaudio * pa, PhoneEvent * event)
 		case PHONE_EVENT_TYPE_AUDIO_STOP:
 			_pa_play(pa, NULL);
 			break;
+		case PHONE_EVENT_TYPE_MODEM_EVENT:
+			_event_modem(pa, event->modem_event.event);
+			break;
+		case PHONE_EVENT_TYPE_SPEAKER_OFF:
+			_event_speaker(pa, FALSE);
+			break;
+		case PHONE_EVENT_TYPE_SPEAKER_ON:
+			_event_speaker(pa, TRUE);
+			break;
+		case PHONE_EVENT_TYPE_VOLUME_GET:
+			_event_volume_get(pa, event);
+			break;
+		case PHONE_EVENT_TYPE_VOLUME_SET:
+			_event_volume_set(pa, event->volume_set.level);
+			break;
 		default: /* not relevant */
 			break;
 	}
 	return 0;
 }
 
+static void _event_modem(Pulseaudio * pa, ModemEvent * event)
+{
+	PhonePluginHelper * helper = pa->helper;
+	char const * number;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean call = FALSE;
+	gboolean active = FALSE;
+
+	if(event->type == MODEM_EVENT_TYPE_UNSUPPORTED)
+	{
+		_event_modem_voice(pa, event);
+		return;
+	}
+	if(event->type != MODEM_EVENT_TYPE_CALL)
+		return;
+	/* another call may be waiting while one is active */
+	number = (event->call.number != NULL) ? event->call.number : "";
+	if(event->call.status == MODEM_CALL_STATUS_RINGING
+			|| event->call.status == MODEM_CALL_STATUS_ACTIVE)
+		g_hash_table_insert(pa->calls, g_strdup(number),
+				GINT_TO_POINTER(event->call.status));
+	else
+		g_hash_table_remove(pa->calls, number);
+	g_hash_table_iter_init(&iter, pa->calls);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		call = TRUE;
+		if(GPOINTER_TO_INT(value) == MODEM_CALL_STATUS_ACTIVE)
+			active = TRUE;
+	}
+	if(pa->call != call)
+	{
+		pa->call = call;
+		_pa_route_send(pa);
+	}
+	/* the voice path, as long as a call is answered */
+	if(active == FALSE)
+		_pa_voice_stop(pa);
+	else if(_pa_voice_start(pa) != 0)
+		helper->error(helper->phone, "Could not open the call audio",
+				1);
+}
+
+static void _event_modem_voice(Pulseaudio * pa, ModemEvent * event)
+{
+	if(pa->voice == FALSE || event->unsupported.modem == NULL
+			|| strcmp(event->unsupported.modem, pa->voice_modem)
+			!= 0
+			|| event->unsupported.request != pa->voice_request
+			|| event->unsupported.data == NULL)
+		return;
+	/* never wait for the playback: drop the audio instead */
+	_pa_ring_write(&pa->downlink, event->unsupported.data,
+			event->unsupported.size / sizeof(int16_t));
+}
+
+static void _event_speaker(Pulseaudio * pa, gboolean speaker)
+{
+	pa->speaker = speaker;
+	_pa_route_send(pa);
+}
+
+static void _event_volume_get(Pulseaudio * pa, PhoneEvent * event)
+{
+	event->volume_get.level = pa->volumes[_pa_route_get(pa)];
+}
+
+static void _event_volume_set(Pulseaudio * pa, double level)
+{
+	PhonePluginHelper * helper = pa->helper;
+	PulseaudioRoute route;
+	char buf[16];
+
+	level = (level < 0.0) ? 0.0 : ((level > 1.0) ? 1.0 : level);
+	route = _pa_route_get(pa);
+	pa->volumes[route] = level;
+	_pa_route_send(pa);
+	/* remember it for this route */
+	snprintf(buf, sizeof(buf), "%.2f", level);
+	helper->config_set(helper->phone, "pulseaudio", _pa_routes[route],
+			buf);
+}
+
+
+/* pa_settings */
+static void _pa_settings(Pulseaudio * pa)
+{
+	GtkWidget * dialog;
+	GString * str;
+
+	str = g_string_new(NULL);
+	/* on demand only */
+	pa_threaded_mainloop_lock(pa->pam);
+	_pa_stats_print(pa, str);
+	pa_threaded_mainloop_unlock(pa->pam);
+	dialog = gtk_message_dialog_new(NULL, 0, GTK_MESSAGE_INFO,
+			GTK_BUTTONS_CLOSE, "%s", "Latency");
+	gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+			"%s", str->str);
+	gtk_window_set_title(GTK_WINDOW(dialog), plugin.name);
+	gtk_dialog_run(GTK_DIALOG(dialog));
+	gtk_widget_destroy(dialog);
+	g_string_free(str, TRUE);
+}
+
+
+/* pa_command */
+static int _pa_command(Pulseaudio * pa, PulseaudioCommand * command)
+{
+	guint head = (guint)g_atomic_int_get(&pa->commands_head);
+	char c = 0;
+
+	/* from the main thread only */
+	command->time = g_get_monotonic_time();
+	if(head - (guint)g_atomic_int_get(&pa->commands_tail)
+			>= PULSEAUDIO_COMMANDS)
+	{
+		g_free(command->sample);
+		return -1;
+	}
+	pa->commands[head % PULSEAUDIO_COMMANDS] = *command;
+	/* published only once copied */
+	g_atomic_int_set(&pa->commands_head, (gint)(head + 1));
+	while(write(pa->wakeup[1], &c, sizeof(c)) != sizeof(c))
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			/* the pipe is full: already woken up */
+			break;
+		else if(errno != EINTR)
+		{
+			/* published already: apply it from here instead */
+			pa_threaded_mainloop_lock(pa->pam);
+			_pa_on_command(pa_threaded_mainloop_get_api(pa->pam),
+					pa->wakeup_io, pa->wakeup[0],
+					PA_IO_EVENT_INPUT, pa);
+			pa_threaded_mainloop_unlock(pa->pam);
+			break;
+		}
+	return 0;
+}
+
+
+/* pa_connect */
+static int _pa_connect(Pulseaudio * pa)
+{
+	pa_mainloop_api * mapi;
+	pa_context * pac;
+
+	mapi = pa_threaded_mainloop_get_api(pa->pam);
+	/* XXX update the context name */
+	if((pac = pa_context_new(mapi, PACKAGE)) == NULL)
+		return -1;
+	/* the previous context is only released once replaced */
+	if(pa->pac != NULL)
+	{
+		pa_context_set_state_callback(pa->pac, NULL, NULL);
+		pa_context_set_subscribe_callback(pa->pac, NULL, NULL);
+		pa_context_disconnect(pa->pac);
+		pa_context_unref(pa->pac);
+	}
+	pa->pac = pac;
+	pa_context_set_state_callback(pa->pac, _pa_on_context_state, pa);
+	pa_context_set_subscribe_callback(pa->pac, _pa_on_subscribe, pa);
+	/* failures are handled through the state callback */
+	pa_context_connect(pa->pac, NULL, PA_CONTEXT_NOFLAGS, NULL);
+	return 0;
+}
+
 
 /* pa_play */
 static void _pa_play(Pulseaudio * pa, char const * sample)
 {
+	PulseaudioCommand command;
+
 #ifdef DEBUG
 	fprintf(stderr, "DEBUG: %s(\"%s\")\n", __func__, sample);
 #endif
-	if(sample == NULL)
+	memset(&command, 0, sizeof(command));
+	command.type = PCT_PLAY;
+	command.sample = (sample != NULL) ? g_strdup(sample) : NULL;
+	if(_pa_command(pa, &command) != 0)
+		pa->helper->error(pa->helper->phone,
+				"Too many sounds requested", 1);
+}
+
+
+/* pa_retry */
+static void _pa_retry(Pulseaudio * pa, PulseaudioCommandType type)
+{
+	/* from the main thread, until the ring has room again */
+	if(type == PCT_ROUTE)
+		pa->retry_route = TRUE;
+	else if(type == PCT_VOICE)
+		pa->retry_voice = TRUE;
+	if(pa->retry == 0)
+		pa->retry = g_timeout_add(PULSEAUDIO_RETRY, _pa_on_retry, pa);
+}
+
+
+/* routes */
+/* pa_route_get */
+static PulseaudioRoute _pa_route_get(Pulseaudio * pa)
+{
+	/* as requested */
+	if(pa->call)
+		return pa->speaker ? PULSEAUDIO_ROUTE_LOUDSPEAKER
+			: PULSEAUDIO_ROUTE_HEADSET;
+	return PULSEAUDIO_ROUTE_AUDIO;
+}
+
+
+/* pa_route_send */
+static void _pa_route_send(Pulseaudio * pa)
+{
+	PulseaudioCommand command;
+
+	memset(&command, 0, sizeof(command));
+	command.type = PCT_ROUTE;
+	command.call = pa->call;
+	command.route = _pa_route_get(pa);
+	command.volume = pa->volumes[command.route];
+	if(_pa_command(pa, &command) != 0)
+		_pa_retry(pa, PCT_ROUTE);
+}
+
+
+/* pa_route_update */
+static void _pa_route_update(Pulseaudio * pa)
+{
+	/* from the main loop of PulseAudio */
+	/* coalesce the changes until the next iteration */
+	if(pa->update != NULL)
+		pa_threaded_mainloop_get_api(pa->pam)->defer_enable(pa->update,
+				1);
+}
+
+
+/* pa_route_volume */
+static pa_volume_t _pa_route_volume(Pulseaudio * pa)
+{
+	return pa_sw_volume_from_linear(pa->volume);
+}
+
+
+/* dsp */
+/* pa_dsp_axpy */
+static void _pa_dsp_axpy(float * y, float a, float const * x, size_t cnt)
+{
+#ifdef PULSEAUDIO_DSP_VECTOR
+	PulseaudioVector va = { a, a, a, a };
+	PulseaudioVector vx;
+	PulseaudioVector vy;
+	size_t i;
+
+	for(i = 0; i + PULSEAUDIO_DSP_VECTOR <= cnt;
+			i += PULSEAUDIO_DSP_VECTOR)
+	{
+		/* not necessarily aligned */
+		memcpy(&vx, &x[i], sizeof(vx));
+		memcpy(&vy, &y[i], sizeof(vy));
+		vy += va * vx;
+		memcpy(&y[i], &vy, sizeof(vy));
+	}
+	_pa_dsp_axpy_scalar(&y[i], a, &x[i], cnt - i);
+#else
+	_pa_dsp_axpy_scalar(y, a, x, cnt);
+#endif
+}
+
+
+/* pa_dsp_axpy_scalar */
+static void _pa_dsp_axpy_scalar(float * y, float a, float const * x,
+		size_t cnt)
+{
+	size_t i;
+
+	/* reference implementation */
+	for(i = 0; i < cnt; i++)
+		y[i] += a * x[i];
+}
+
+
+/* pa_dsp_delete */
+static void _pa_dsp_delete(PulseaudioDSP * dsp)
+{
+	g_free(dsp->taps);
+	g_free(dsp->history);
+	g_free(dsp->near);
+	object_delete(dsp);
+}
+
+
+/* pa_dsp_dot */
+static float _pa_dsp_dot(float const * a, float const * b, size_t cnt)
+{
+#ifdef PULSEAUDIO_DSP_VECTOR
+	PulseaudioVector sum = { 0.0f, 0.0f, 0.0f, 0.0f };
+	PulseaudioVector va;
+	PulseaudioVector vb;
+	float ret;
+	size_t i;
+
+	for(i = 0; i + PULSEAUDIO_DSP_VECTOR <= cnt;
+			i += PULSEAUDIO_DSP_VECTOR)
+	{
+		memcpy(&va, &a[i], sizeof(va));
+		memcpy(&vb, &b[i], sizeof(vb));
+		sum += va * vb;
+	}
+	ret = sum[0] + sum[1] + sum[2] + sum[3];
+	return ret + _pa_dsp_dot_scalar(&a[i], &b[i], cnt - i);
+#else
+	return _pa_dsp_dot_scalar(a, b, cnt);
+#endif
+}
+
+
+/* pa_dsp_dot_scalar */
+static float _pa_dsp_dot_scalar(float const * a, float const * b, size_t cnt)
+{
+	float ret = 0.0f;
+	size_t i;
+
+	/* reference implementation */
+	for(i = 0; i < cnt; i++)
+		ret += a[i] * b[i];
+	return ret;
+}
+
+
+/* pa_dsp_new */
+static PulseaudioDSP * _pa_dsp_new(void)
+{
+	PulseaudioDSP * dsp;
+
+	if((dsp = object_new(sizeof(*dsp))) == NULL)
+		return NULL;
+	dsp->taps = g_try_malloc(sizeof(*dsp->taps) * PULSEAUDIO_DSP_TAPS);
+	dsp->history = g_try_malloc(sizeof(*dsp->history)
+			* (PULSEAUDIO_DSP_TAPS - 1 + PULSEAUDIO_VOICE_PACKET));
+	dsp->near = g_try_malloc(sizeof(*dsp->near)
+			* PULSEAUDIO_VOICE_PACKET);
+	if(dsp->taps == NULL || dsp->history == NULL || dsp->near == NULL)
+	{
+		_pa_dsp_delete(dsp);
+		return NULL;
+	}
+	_pa_dsp_reset(dsp);
+	return dsp;
+}
+
+
+/* pa_dsp_process */
+static void _process_cancel(PulseaudioDSP * dsp, size_t cnt);
+static void _process_gain(PulseaudioDSP * dsp, int16_t * frames, size_t cnt);
+
+static void _pa_dsp_process(PulseaudioDSP * dsp, int16_t * frames,
+		int16_t const * reference, size_t cnt)
+{
+	gint64 start;
+	float * far = &dsp->history[PULSEAUDIO_DSP_TAPS - 1];
+	size_t taps_cnt;
+	size_t i;
+
+	start = g_get_monotonic_time();
+	cnt = MIN(cnt, PULSEAUDIO_VOICE_PACKET);
+	for(i = 0; i < cnt; i++)
+	{
+		far[i] = reference[i];
+		dsp->near[i] = frames[i];
+	}
+	_process_cancel(dsp, cnt);
+	_process_gain(dsp, frames, cnt);
+	memmove(dsp->history, &dsp->history[cnt], sizeof(*dsp->history)
+			* (PULSEAUDIO_DSP_TAPS - 1));
+	/* keep within the budget, trading the length of the echo tail */
+	if(g_get_monotonic_time() - start > PULSEAUDIO_DSP_BUDGET)
+	{
+		dsp->within = 0;
+		if(++dsp->overruns < PULSEAUDIO_DSP_OVERRUNS
+				|| dsp->taps_cnt <= PULSEAUDIO_DSP_TAPS_MIN)
+			return;
+		dsp->overruns = 0;
+		dsp->taps_cnt = max(dsp->taps_cnt / 2,
+				PULSEAUDIO_DSP_TAPS_MIN);
+	}
+	else
+	{
+		dsp->overruns = 0;
+		if(++dsp->within < PULSEAUDIO_DSP_WITHIN
+				|| dsp->taps_cnt >= PULSEAUDIO_DSP_TAPS)
+			return;
+		dsp->within = 0;
+		/* the taps added adapt from scratch */
+		taps_cnt = MIN(dsp->taps_cnt * 2, PULSEAUDIO_DSP_TAPS);
+		memset(&dsp->taps[PULSEAUDIO_DSP_TAPS - taps_cnt], 0,
+				sizeof(*dsp->taps)
+				* (taps_cnt - dsp->taps_cnt));
+		dsp->taps_cnt = taps_cnt;
+	}
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %lu taps\n", __func__,
+			(unsigned long)dsp->taps_cnt);
+#endif
+}
+
+static void _process_cancel(PulseaudioDSP * dsp, size_t cnt)
+{
+	float * taps = &dsp->taps[PULSEAUDIO_DSP_TAPS - dsp->taps_cnt];
+	float const * window;
+	float far_max = 0.0f;
+	float near_max = 0.0f;
+	gboolean adapt;
+	float power;
+	size_t i;
+
+	/* no adaptation during double talk (Geigel) */
+	for(i = PULSEAUDIO_DSP_TAPS - dsp->taps_cnt;
+			i < PULSEAUDIO_DSP_TAPS - 1 + cnt; i++)
+		far_max = max(far_max, fabsf(dsp->history[i]));
+	for(i = 0; i < cnt; i++)
+		near_max = max(near_max, fabsf(dsp->near[i]));
+	adapt = (far_max > 0.0f && near_max < far_max * PULSEAUDIO_DSP_GEIGEL)
+		? TRUE : FALSE;
+	/* normalized least mean squares */
+	for(i = 0; i < cnt; i++)
+	{
+		window = &dsp->history[PULSEAUDIO_DSP_TAPS - dsp->taps_cnt
+			+ i];
+		dsp->near[i] -= _pa_dsp_dot(taps, window, dsp->taps_cnt);
+		if(!adapt)
+			continue;
+		power = _pa_dsp_dot(window, window, dsp->taps_cnt);
+		_pa_dsp_axpy(taps, PULSEAUDIO_DSP_MU * dsp->near[i]
+				/ (power + PULSEAUDIO_DSP_DELTA), window,
+				dsp->taps_cnt);
+	}
+}
+
+static void _process_gain(PulseaudioDSP * dsp, int16_t * frames, size_t cnt)
+{
+	float energy;
+	float suppression;
+	float gain;
+	float from;
+	float to;
+	float f;
+	size_t i;
+
+	if(cnt == 0)
+		return;
+	energy = _pa_dsp_dot(dsp->near, dsp->near, cnt) / cnt;
+	/* noise suppression, following the floor of the energy */
+	if(dsp->noise <= 0.0f || energy < dsp->noise)
+		dsp->noise = energy;
+	else
+		dsp->noise *= PULSEAUDIO_DSP_NS_RISE;
+	suppression = 1.0f - PULSEAUDIO_DSP_NS_OVER * dsp->noise
+		/ (energy + 1.0f);
+	suppression = max(suppression, PULSEAUDIO_DSP_NS_FLOOR);
+	/* automatic gain control, only on speech */
+	gain = dsp->gain;
+	if(energy > dsp->noise * PULSEAUDIO_DSP_NS_OVER * 2.0f)
+	{
+		f = PULSEAUDIO_DSP_AGC_TARGET
+			/ (sqrtf(energy) * suppression + 1.0f);
+		f = MIN(max(f, PULSEAUDIO_DSP_AGC_MIN),
+				PULSEAUDIO_DSP_AGC_MAX);
+		/* lowered fast, raised slowly */
+		gain += (f < gain ? 0.5f : 0.05f) * (f - gain);
+	}
+	/* ramp over the packet to avoid clicks */
+	from = dsp->suppression * dsp->gain;
+	to = suppression * gain;
+	for(i = 0; i < cnt; i++)
+	{
+		f = dsp->near[i] * (from + (to - from) * i / cnt);
+		f = MIN(max(f, -32768.0f), 32767.0f);
+		frames[i] = f;
+	}
+	dsp->suppression = suppression;
+	dsp->gain = gain;
+}
+
+
+/* pa_dsp_reset */
+static void _pa_dsp_reset(PulseaudioDSP * dsp)
+{
+	memset(dsp->taps, 0, sizeof(*dsp->taps) * PULSEAUDIO_DSP_TAPS);
+	dsp->taps_cnt = PULSEAUDIO_DSP_TAPS;
+	dsp->overruns = 0;
+	dsp->within = 0;
+	memset(dsp->history, 0, sizeof(*dsp->history)
+			* (PULSEAUDIO_DSP_TAPS - 1 + PULSEAUDIO_VOICE_PACKET));
+	dsp->noise = 0.0f;
+	dsp->suppression = 1.0f;
+	dsp->gain = 1.0f;
+}
+
+
+/* loop */
+/* pa_loop_close */
+static void _pa_loop_close(Pulseaudio * pa)
+{
+	pa_stream_set_state_callback(pa->loop, NULL, NULL);
+	pa_stream_set_write_callback(pa->loop, NULL, NULL);
+	pa_stream_set_started_callback(pa->loop, NULL, NULL);
+	pa_stream_set_underflow_callback(pa->loop, NULL, NULL);
+	pa_stream_disconnect(pa->loop);
+	pa_stream_unref(pa->loop);
+	pa->loop = NULL;
+}
+
+
+/* pa_loop_start */
+static int _pa_loop_start(Pulseaudio * pa, PulseaudioSample * sample)
+{
+	pa_buffer_attr attr;
+	pa_cvolume volume;
+	pa_operation * pao;
+
+	if(pa->loop != NULL && pa->loop_sample != sample)
+		_pa_loop_close(pa);
+	pa->loop_sample = sample;
+	pa->ringing = TRUE;
+	_pa_route_update(pa);
+	_pa_playback_preempt(pa, sample->pclass);
+	if(pa->loop != NULL)
+	{
+		/* already filled again since stopped */
+		if((pao = pa_stream_cork(pa->loop, 0, NULL, NULL)) != NULL)
+			pa_operation_unref(pao);
+		return 0;
+	}
+	pa->loop_offset = 0;
+	if((pa->loop = pa_stream_new(pa->pac, sample->name, &sample->spec,
+					NULL)) == NULL)
+		return -1;
+	/* keep as little as possible in advance */
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = pa_usec_to_bytes(PULSEAUDIO_LOOP_LATENCY,
+			&sample->spec);
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = attr.tlength / 4;
+	attr.fragsize = (uint32_t)-1;
+	pa_stream_set_state_callback(pa->loop, _pa_on_loop_state, pa);
+	pa_stream_set_write_callback(pa->loop, _pa_on_loop_write, pa);
+	pa_stream_set_started_callback(pa->loop, _pa_on_loop_started, pa);
+	pa_stream_set_underflow_callback(pa->loop, _pa_on_underflow, pa);
+	pa_cvolume_set(&volume, sample->spec.channels, _pa_route_volume(pa));
+	/* with the timing information of the server */
+	if(pa_stream_connect_playback(pa->loop, NULL, &attr,
+				PA_STREAM_ADJUST_LATENCY
+				| PA_STREAM_INTERPOLATE_TIMING
+				| PA_STREAM_AUTO_TIMING_UPDATE, &volume, NULL)
+			!= 0)
+	{
+		pa_stream_unref(pa->loop);
+		pa->loop = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* pa_loop_stop */
+static void _pa_loop_stop(Pulseaudio * pa)
+{
+	pa_operation * pao;
+
+	if(pa->ringing)
 	{
-		/* cancel the current sample */
-		if(pa->pao != NULL)
-			pa_operation_cancel(pa->pao);
-		pa->pao = NULL;
+		pa->ringing = FALSE;
+		_pa_route_update(pa);
+		/* the alerts held meanwhile */
+		_pa_playback_next(pa);
+	}
+	if(pa->loop == NULL)
+		return;
+	/* not playing yet */
+	if(pa_stream_get_state(pa->loop) != PA_STREAM_READY)
+	{
+		_pa_loop_close(pa);
+		return;
+	}
+	/* stop at once, and fill again from the start */
+	pa->loop_offset = 0;
+	if((pao = pa_stream_cork(pa->loop, 1, NULL, NULL)) != NULL)
+		pa_operation_unref(pao);
+	if((pao = pa_stream_flush(pa->loop, NULL, NULL)) != NULL)
+		pa_operation_unref(pao);
+}
+
+
+/* playbacks */
+/* pa_playback_cancel */
+static void _pa_playback_cancel(PulseaudioPlayback * playback)
+{
+	Pulseaudio * pa = playback->pa;
+	pa_operation * pao;
+
+	if(playback->state == PPS_QUEUED)
+	{
+		_pa_playback_delete(playback);
+		return;
+	}
+	playback->cancelled = TRUE;
+	/* or else once started */
+	if(playback->state == PPS_PLAYING && (pao = pa_context_kill_sink_input(
+					pa->pac, playback->index, NULL, NULL))
+			!= NULL)
+		pa_operation_unref(pao);
+}
+
+
+/* pa_playback_count */
+static size_t _pa_playback_count(Pulseaudio * pa, PulseaudioClass pclass,
+		gboolean queued)
+{
+	size_t ret = 0;
+	PulseaudioPlayback * playback;
+	GSList * l;
+
+	for(l = pa->playbacks; l != NULL; l = l->next)
+	{
+		playback = l->data;
+		if(playback->pclass == pclass && !playback->cancelled
+				&& (playback->state == PPS_QUEUED) == queued)
+			ret++;
+	}
+	return ret;
+}
+
+
+/* pa_playback_delete */
+static void _pa_playback_delete(PulseaudioPlayback * playback)
+{
+	Pulseaudio * pa = playback->pa;
+
+	pa->playbacks = g_slist_remove(pa->playbacks, playback);
+	if(playback->pao != NULL)
+	{
+		pa_operation_cancel(playback->pao);
+		pa_operation_unref(playback->pao);
+	}
+	g_free(playback->name);
+	object_delete(playback);
+}
+
+
+/* pa_playback_find */
+static PulseaudioPlayback * _pa_playback_find(Pulseaudio * pa,
+		uint32_t index)
+{
+	PulseaudioPlayback * playback;
+	GSList * l;
+
+	for(l = pa->playbacks; l != NULL; l = l->next)
+	{
+		playback = l->data;
+		if(playback->state == PPS_PLAYING && playback->index == index)
+			return playback;
+	}
+	return NULL;
+}
+
+
+/* pa_playback_held */
+static gboolean _pa_playback_held(Pulseaudio * pa, PulseaudioClass pclass)
+{
+	PulseaudioPlayback * playback;
+	GSList * l;
+
+	/* by any higher priority */
+	if(pclass > PULSEAUDIO_CLASS_RINGTONE && pa->ringing)
+		return TRUE;
+	for(l = pa->playbacks; l != NULL; l = l->next)
+	{
+		playback = l->data;
+		if(playback->pclass < pclass && playback->state != PPS_QUEUED
+				&& !playback->cancelled)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+/* pa_playback_next */
+static void _pa_playback_next(Pulseaudio * pa)
+{
+	PulseaudioPlayback * playback;
+	GSList * l;
+	GSList * next;
+
+	if(pa->pac == NULL || pa_context_get_state(pa->pac)
+			!= PA_CONTEXT_READY)
+		return;
+	/* in the order requested, as room is made */
+	for(l = pa->playbacks; l != NULL; l = next)
+	{
+		next = l->next;
+		playback = l->data;
+		if(playback->state == PPS_QUEUED
+				&& !_pa_playback_held(pa, playback->pclass)
+				&& _pa_playback_count(pa, playback->pclass,
+					FALSE)
+				< _pa_classes[playback->pclass].limit)
+			_pa_playback_start(playback);
+	}
+}
+
+
+/* pa_playback_preempt */
+static void _pa_playback_preempt(Pulseaudio * pa, PulseaudioClass pclass)
+{
+	PulseaudioPlayback * playback;
+	GSList * l;
+
+	for(l = pa->playbacks; l != NULL; l = l->next)
+	{
+		playback = l->data;
+		if(playback->pclass > pclass && playback->state != PPS_QUEUED
+				&& _pa_classes[playback->pclass].preemptible)
+			_pa_playback_cancel(playback);
+	}
+}
+
+
+/* pa_playback_request */
+static int _pa_playback_request(Pulseaudio * pa, char const * name,
+		PulseaudioClass pclass, gint64 requested)
+{
+	PulseaudioClassDefinition const * definition = &_pa_classes[pclass];
+	PulseaudioPlayback * playback;
+	PulseaudioPlayback * oldest;
+	GSList * l;
+
+	if((playback = object_new(sizeof(*playback))) == NULL)
+		return -1;
+	playback->pa = pa;
+	playback->name = g_strdup(name);
+	playback->pclass = pclass;
+	playback->state = PPS_QUEUED;
+	playback->pao = NULL;
+	playback->index = PA_INVALID_INDEX;
+	playback->cancelled = FALSE;
+	playback->requested = requested;
+	if(_pa_playback_held(pa, pclass)
+			|| _pa_playback_count(pa, pclass, FALSE)
+			>= definition->limit)
+	{
+		if(_pa_playback_count(pa, pclass, TRUE) < definition->queue)
+		{
+			/* shaped, played in turn */
+			pa->playbacks = g_slist_append(pa->playbacks,
+					playback);
+			return 0;
+		}
+		if(!definition->preemptible || _pa_playback_held(pa, pclass))
+		{
+#ifdef DEBUG
+			fprintf(stderr, "DEBUG: %s(\"%s\") dropped\n",
+					__func__, name);
+#endif
+			_pa_playback_delete(playback);
+			return -1;
+		}
+		/* replace the oldest of the class */
+		for(l = pa->playbacks; l != NULL; l = l->next)
+		{
+			oldest = l->data;
+			if(oldest->pclass == pclass
+					&& oldest->state != PPS_QUEUED
+					&& !oldest->cancelled)
+			{
+				_pa_playback_cancel(oldest);
+				break;
+			}
+		}
+	}
+	pa->playbacks = g_slist_append(pa->playbacks, playback);
+	_pa_playback_start(playback);
+	return 0;
+}
+
+
+/* pa_playback_start */
+static void _pa_playback_start(PulseaudioPlayback * playback)
+{
+	Pulseaudio * pa = playback->pa;
+
+	/* over the lower priorities */
+	_pa_playback_preempt(pa, playback->pclass);
+	playback->state = PPS_STARTING;
+	if((playback->pao = pa_context_play_sample_with_proplist(pa->pac,
+					playback->name, NULL,
+					_pa_route_volume(pa), NULL,
+					_pa_on_played, playback)) == NULL)
+	{
+		_pa_playback_delete(playback);
+		return;
+	}
+	_pa_stats_issued(pa, playback->requested);
+}
+
+
+/* rings */
+/* pa_ring_fill */
+static guint _pa_ring_fill(PulseaudioRing * ring)
+{
+	return (guint)g_atomic_int_get(&ring->head)
+		- (guint)g_atomic_int_get(&ring->tail);
+}
+
+
+/* pa_ring_init */
+static int _pa_ring_init(PulseaudioRing * ring, guint size)
+{
+	/* the indexes wrap around with the size as a power of two */
+	if((ring->frames = g_try_malloc(sizeof(*ring->frames) * size))
+			== NULL)
+		return -1;
+	ring->size = size;
+	_pa_ring_reset(ring);
+	return 0;
+}
+
+
+/* pa_ring_read */
+static guint _pa_ring_read(PulseaudioRing * ring, int16_t * frames, guint cnt)
+{
+	guint tail = (guint)g_atomic_int_get(&ring->tail);
+	guint i;
+	guint n;
+
+	cnt = MIN(cnt, _pa_ring_fill(ring));
+	for(i = 0; i < cnt; i += n)
+	{
+		n = (tail + i) & (ring->size - 1);
+		n = MIN(cnt - i, ring->size - n);
+		memcpy(&frames[i], &ring->frames[(tail + i) & (ring->size - 1)],
+				n * sizeof(*frames));
+	}
+	g_atomic_int_set(&ring->tail, (gint)(tail + cnt));
+	return cnt;
+}
+
+
+/* pa_ring_reset */
+static void _pa_ring_reset(PulseaudioRing * ring)
+{
+	/* with neither end in use */
+	g_atomic_int_set(&ring->head, 0);
+	g_atomic_int_set(&ring->tail, 0);
+}
+
+
+/* pa_ring_skip */
+static guint _pa_ring_skip(PulseaudioRing * ring, guint cnt)
+{
+	guint tail = (guint)g_atomic_int_get(&ring->tail);
+
+	cnt = MIN(cnt, _pa_ring_fill(ring));
+	g_atomic_int_set(&ring->tail, (gint)(tail + cnt));
+	return cnt;
+}
+
+
+/* pa_ring_write */
+static guint _pa_ring_write(PulseaudioRing * ring, int16_t const * frames,
+		guint cnt)
+{
+	guint head = (guint)g_atomic_int_get(&ring->head);
+	guint i;
+	guint n;
+
+	if(ring->frames == NULL)
+		return 0;
+	cnt = MIN(cnt, ring->size - _pa_ring_fill(ring));
+	for(i = 0; i < cnt; i += n)
+	{
+		n = (head + i) & (ring->size - 1);
+		n = MIN(cnt - i, ring->size - n);
+		memcpy(&ring->frames[(head + i) & (ring->size - 1)], &frames[i],
+				n * sizeof(*frames));
+	}
+	/* published only once copied */
+	g_atomic_int_set(&ring->head, (gint)(head + cnt));
+	return cnt;
+}
+
+
+/* samples */
+/* pa_sample_decode */
+static uint16_t _decode_uint16(unsigned char const * p);
+static uint32_t _decode_uint32(unsigned char const * p);
+
+static int _pa_sample_decode(PulseaudioSample * sample)
+{
+	gchar * contents;
+	gsize length;
+	unsigned char const * p;
+	size_t offset;
+	uint32_t size;
+	uint16_t format = 0;
+	uint16_t bits = 0;
+	pa_sample_spec spec;
+	char const * data = NULL;
+	size_t data_size = 0;
+
+	if(g_file_get_contents(sample->filename, &contents, &length, NULL)
+			!= TRUE)
+		return -1;
+	p = (unsigned char const *)contents;
+	if(length < 12 || memcmp(p, "RIFF", 4) != 0
+			|| memcmp(&p[8], "WAVE", 4) != 0)
+	{
+		g_free(contents);
+		return -1;
+	}
+	memset(&spec, 0, sizeof(spec));
+	spec.format = PA_SAMPLE_INVALID;
+	for(offset = 12; offset + 8 <= length; offset += 8 + size + (size & 1))
+	{
+		size = _decode_uint32(&p[offset + 4]);
+		if(size > length - offset - 8)
+			size = length - offset - 8;
+		if(memcmp(&p[offset], "fmt ", 4) == 0 && size >= 16)
+		{
+			format = _decode_uint16(&p[offset + 8]);
+			spec.channels = _decode_uint16(&p[offset + 10]);
+			spec.rate = _decode_uint32(&p[offset + 12]);
+			bits = _decode_uint16(&p[offset + 22]);
+			/* WAVE_FORMAT_EXTENSIBLE */
+			if(format == 0xfffe && size >= 26)
+				format = _decode_uint16(&p[offset + 32]);
+		}
+		else if(memcmp(&p[offset], "data", 4) == 0)
+		{
+			data = &contents[offset + 8];
+			data_size = size;
+			break;
+		}
+	}
+	if(format == 1 && bits == 8)
+		spec.format = PA_SAMPLE_U8;
+	else if(format == 1 && bits == 16)
+		spec.format = PA_SAMPLE_S16LE;
+	else if(format == 1 && bits == 24)
+		spec.format = PA_SAMPLE_S24LE;
+	else if(format == 1 && bits == 32)
+		spec.format = PA_SAMPLE_S32LE;
+	else if(format == 3 && bits == 32)
+		spec.format = PA_SAMPLE_FLOAT32LE;
+	else if(format == 6 && bits == 8)
+		spec.format = PA_SAMPLE_ALAW;
+	else if(format == 7 && bits == 8)
+		spec.format = PA_SAMPLE_ULAW;
+	if(data == NULL || !pa_sample_spec_valid(&spec)
+			|| (data_size -= data_size % pa_frame_size(&spec)) == 0)
+	{
+		g_free(contents);
+		return -1;
+	}
+	/* the samples are uploaded as found in the file */
+	sample->contents = contents;
+	sample->spec = spec;
+	sample->data = data;
+	sample->size = data_size;
+	sample->written = 0;
+	return 0;
+}
+
+static uint16_t _decode_uint16(unsigned char const * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t _decode_uint32(unsigned char const * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/* pa_sample_evict */
+static void _pa_sample_evict(Pulseaudio * pa, PulseaudioSample * keep)
+{
+	PulseaudioSample * lru;
+	pa_operation * pao;
+	size_t i;
+
+	while(pa->cached > pa->cache_size)
+	{
+		/* look for the sample used the least recently */
+		for(i = 0, lru = NULL; i < pa->samples_cnt; i++)
+			if(pa->samples[i].state == PSS_CACHED
+					&& &pa->samples[i] != keep
+					&& (lru == NULL || pa->samples[i].used
+						< lru->used))
+				lru = &pa->samples[i];
+		if(lru == NULL)
+			break;
+#ifdef DEBUG
+		fprintf(stderr, "DEBUG: %s() \"%s\"\n", __func__, lru->name);
+#endif
+		if((pao = pa_context_remove_sample(pa->pac, lru->name, NULL,
+						NULL)) != NULL)
+			pa_operation_unref(pao);
+		pa->cached -= lru->size;
+		lru->state = PSS_NONE;
+	}
+}
+
+
+/* pa_sample_get */
+static PulseaudioSample * _pa_sample_get(Pulseaudio * pa, char const * name)
+{
+	size_t i;
+
+	for(i = 0; i < pa->samples_cnt; i++)
+		if(strcmp(pa->samples[i].name, name) == 0)
+			return &pa->samples[i];
+	return NULL;
+}
+
+
+/* pa_sample_play */
+static void _pa_sample_play(PulseaudioSample * sample)
+{
+	Pulseaudio * pa = sample->pa;
+
+	sample->play = FALSE;
+	if(sample->loop)
+	{
+		_pa_loop_start(pa, sample);
+		_pa_stats_issued(pa, sample->requested);
+		/* until the stream starts */
+		pa->loop_requested = sample->requested;
+	}
+	else
+		_pa_playback_request(pa, sample->name, sample->pclass,
+				sample->requested);
+	sample->requested = 0;
+}
+
+
+/* pa_sample_reset */
+static void _pa_sample_reset(PulseaudioSample * sample)
+{
+	if(sample->stream != NULL)
+	{
+		pa_stream_set_state_callback(sample->stream, NULL, NULL);
+		pa_stream_set_write_callback(sample->stream, NULL, NULL);
+		pa_stream_unref(sample->stream);
+	}
+	sample->stream = NULL;
+	g_free(sample->contents);
+	sample->contents = NULL;
+	sample->data = NULL;
+}
+
+
+/* pa_sample_upload */
+static int _pa_sample_upload(PulseaudioSample * sample)
+{
+	Pulseaudio * pa = sample->pa;
+
+	/* uploaded once connected otherwise */
+	if(pa_context_get_state(pa->pac) != PA_CONTEXT_READY)
+		return 0;
+	if((sample->stream = pa_stream_new(pa->pac, sample->name,
+					&sample->spec, NULL)) == NULL)
+		return -1;
+	pa_stream_set_state_callback(sample->stream, _pa_on_sample_state,
+			sample);
+	pa_stream_set_write_callback(sample->stream, _pa_on_sample_write,
+			sample);
+	if(pa_stream_connect_upload(sample->stream, sample->size) != 0)
+	{
+		_pa_sample_reset(sample);
+		return -1;
+	}
+	sample->state = PSS_UPLOADING;
+	return 0;
+}
+
+
+/* stats */
+/* pa_stats_add */
+static void _pa_stats_add(PulseaudioHistogram * histogram, gint64 usec)
+{
+	gint64 ms;
+	size_t i;
+
+	usec = max(usec, 0);
+	for(i = 0, ms = usec / 1000; ms > 0 && i < PULSEAUDIO_HISTOGRAM - 1;
+			i++, ms >>= 1);
+	histogram->buckets[i]++;
+	histogram->cnt++;
+	histogram->total += usec;
+	histogram->max = max(histogram->max, usec);
+}
+
+
+/* pa_stats_changed */
+static void _pa_stats_changed(Pulseaudio * pa)
+{
+	/* with the main loop locked, published from the main thread */
+	if(pa->stats_source == 0)
+		pa->stats_source = g_timeout_add_seconds(
+				PULSEAUDIO_STATS_INTERVAL, _pa_on_stats, pa);
+}
+
+
+/* pa_stats_issued */
+static void _pa_stats_issued(Pulseaudio * pa, gint64 requested)
+{
+	/* with the main loop locked */
+	if(requested == 0)
+		return;
+	_pa_stats_add(&pa->issued, g_get_monotonic_time() - requested);
+	_pa_stats_changed(pa);
+}
+
+
+/* pa_stats_print */
+static void _print_histogram(GString * str, char const * name,
+		PulseaudioHistogram * histogram);
+
+static void _pa_stats_print(Pulseaudio * pa, GString * str)
+{
+	/* with the main loop locked */
+	_print_histogram(str, "Issued", &pa->issued);
+	_print_histogram(str, "Started", &pa->started);
+	g_string_append_printf(str, "Underruns: %lu\n", pa->underruns);
+}
+
+static void _print_histogram(GString * str, char const * name,
+		PulseaudioHistogram * histogram)
+{
+	size_t i;
+
+	g_string_append_printf(str, "%s: %lu, %lu us average, %lu us max\n",
+			name, histogram->cnt, (histogram->cnt > 0)
+			? (unsigned long)(histogram->total / histogram->cnt)
+			: 0, (unsigned long)histogram->max);
+	for(i = 0; i < PULSEAUDIO_HISTOGRAM; i++)
+		if(histogram->buckets[i] > 0)
+			g_string_append_printf(str, "  %s%lu ms: %lu\n",
+					(i == PULSEAUDIO_HISTOGRAM - 1)
+					? ">= " : "< ", 1UL << i,
+					histogram->buckets[i]);
+}
+
+
+/* pa_stats_started */
+static void _pa_stats_started(Pulseaudio * pa, gint64 requested,
+		gint64 latency)
+{
+	/* with the main loop locked */
+	if(requested == 0)
+		return;
+	_pa_stats_add(&pa->started, g_get_monotonic_time() - requested
+			+ latency);
+	_pa_stats_changed(pa);
+}
+
+
+/* voice */
+/* pa_voice_close */
+static void _close_stream(pa_stream ** stream);
+
+static void _pa_voice_close(Pulseaudio * pa)
+{
+	/* with the main loop locked */
+	_close_stream(&pa->capture);
+	_close_stream(&pa->playback);
+	/* the I/O thread serves every other stream as well */
+	if(pa->realtime && pa_threaded_mainloop_in_thread(pa->pam))
+		pthread_setschedparam(pthread_self(), pa->realtime_policy,
+				&pa->realtime_param);
+	pa->realtime = FALSE;
+}
+
+static void _close_stream(pa_stream ** stream)
+{
+	if(*stream == NULL)
+		return;
+	pa_stream_set_state_callback(*stream, NULL, NULL);
+	pa_stream_set_read_callback(*stream, NULL, NULL);
+	pa_stream_set_write_callback(*stream, NULL, NULL);
+	pa_stream_set_underflow_callback(*stream, NULL, NULL);
+	pa_stream_disconnect(*stream);
+	pa_stream_unref(*stream);
+	*stream = NULL;
+}
+
+
+/* pa_voice_open */
+static int _pa_voice_open(Pulseaudio * pa)
+{
+	pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY
+		| PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+	pa_sample_spec spec;
+	pa_buffer_attr attr;
+	pa_cvolume volume;
+
+	/* from the main loop of PulseAudio, as the consumer */
+	_pa_ring_skip(&pa->downlink, _pa_ring_fill(&pa->downlink));
+	g_atomic_int_set(&pa->capture_latency, -1);
+	g_atomic_int_set(&pa->playback_latency, -1);
+	/* opened again once connected */
+	if(pa->capture != NULL || pa->pac == NULL
+			|| pa_context_get_state(pa->pac) != PA_CONTEXT_READY)
+		return 0;
+	spec.format = PA_SAMPLE_S16NE;
+	spec.rate = PULSEAUDIO_VOICE_RATE;
+	spec.channels = 1;
+	/* matched streams, exchanging small fragments */
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = (uint32_t)-1;
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.fragsize = pa_usec_to_bytes(PULSEAUDIO_VOICE_FRAGMENT, &spec);
+	if((pa->capture = pa_stream_new(pa->pac, "call capture", &spec, NULL))
+			== NULL)
+		return -1;
+	pa_stream_set_state_callback(pa->capture, _pa_on_voice_state, pa);
+	pa_stream_set_read_callback(pa->capture, _pa_on_voice_read, pa);
+	if(pa_stream_connect_record(pa->capture, NULL, &attr, flags) != 0)
+	{
+		_pa_voice_close(pa);
+		return -1;
+	}
+	attr.tlength = pa_usec_to_bytes(PULSEAUDIO_VOICE_LATENCY, &spec);
+	attr.minreq = attr.fragsize;
+	attr.fragsize = (uint32_t)-1;
+	if((pa->playback = pa_stream_new(pa->pac, "call playback", &spec,
+					NULL)) == NULL)
+	{
+		_pa_voice_close(pa);
+		return -1;
+	}
+	pa_stream_set_state_callback(pa->playback, _pa_on_voice_state, pa);
+	pa_stream_set_write_callback(pa->playback, _pa_on_voice_write, pa);
+	pa_stream_set_underflow_callback(pa->playback, _pa_on_underflow, pa);
+	pa_cvolume_set(&volume, spec.channels, _pa_route_volume(pa));
+	if(pa_stream_connect_playback(pa->playback, NULL, &attr, flags,
+				&volume, NULL) != 0)
+	{
+		_pa_voice_close(pa);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* pa_voice_start */
+static int _pa_voice_start(Pulseaudio * pa)
+{
+	PulseaudioCommand command;
+	int ret;
+
+	if(pa->voice_modem == NULL || pa->voice)
+		return 0;
+	/* drop what is left from the previous call, as the consumer */
+	_pa_ring_skip(&pa->uplink, _pa_ring_fill(&pa->uplink));
+	_pa_ring_skip(&pa->echo, _pa_ring_fill(&pa->echo));
+	if(pa->dsp != NULL)
+		_pa_dsp_reset(pa->dsp);
+	pa->latency = 0;
+	pa->latency_max = 0;
+	pa->latency_total = 0;
+	pa->latency_cnt = 0;
+	memset(&command, 0, sizeof(command));
+	command.type = PCT_VOICE;
+	command.call = TRUE;
+	if((ret = _pa_command(pa, &command)) != 0)
+		return ret;
+	pa->voice = TRUE;
+	pa->voice_source = g_timeout_add(PULSEAUDIO_VOICE_PTIME,
+			_pa_on_voice_timeout, pa);
+	return ret;
+}
+
+
+/* pa_voice_stop */
+static void _pa_voice_stop(Pulseaudio * pa)
+{
+	PulseaudioCommand command;
+
+	if(pa->voice == FALSE)
+		return;
+	if(pa->voice_source != 0)
+		g_source_remove(pa->voice_source);
+	pa->voice_source = 0;
+	pa->voice = FALSE;
+	memset(&command, 0, sizeof(command));
+	command.type = PCT_VOICE;
+	command.call = FALSE;
+	if(_pa_command(pa, &command) != 0)
+		_pa_retry(pa, PCT_VOICE);
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() latency %lu us average, %lu us max\n",
+			__func__, (pa->latency_cnt > 0) ? (unsigned long)(
+				pa->latency_total / pa->latency_cnt) : 0,
+			(unsigned long)pa->latency_max);
+#endif
+}
+
+
+/* callbacks */
+/* pa_on_command */
+static void _command_play(Pulseaudio * pa, char const * sample, gint64 time);
+
+static void _pa_on_command(pa_mainloop_api * mapi, pa_io_event * event,
+		int fd, pa_io_event_flags_t flags, void * data)
+{
+	Pulseaudio * pa = data;
+	PulseaudioCommand * command;
+	char buf[64];
+	guint tail;
+	(void) mapi;
+	(void) event;
+	(void) flags;
+
+	/* acknowledge the wakeups first, not to miss any */
+	while(read(fd, buf, sizeof(buf)) > 0);
+	for(tail = (guint)g_atomic_int_get(&pa->commands_tail);
+			tail != (guint)g_atomic_int_get(&pa->commands_head);
+			tail++)
+	{
+		command = &pa->commands[tail % PULSEAUDIO_COMMANDS];
+		switch(command->type)
+		{
+			case PCT_PLAY:
+				_command_play(pa, command->sample,
+						command->time);
+				g_free(command->sample);
+				break;
+			case PCT_ROUTE:
+				pa->calling = command->call;
+				pa->route = command->route;
+				pa->volume = command->volume;
+				_pa_route_update(pa);
+				break;
+			case PCT_VOICE:
+				if((pa->voice_open = command->call))
+					_pa_voice_open(pa);
+				else
+					_pa_voice_close(pa);
+				break;
+		}
+		/* the slot may be used again */
+		g_atomic_int_set(&pa->commands_tail, (gint)(tail + 1));
+	}
+}
+
+static void _command_play(Pulseaudio * pa, char const * sample, gint64 time)
+{
+	PulseaudioSample * s;
+	GSList * l;
+	GSList * next;
+	size_t i;
+
+	if(sample == NULL)
+	{
+		/* stop ringing and the feedback, the alerts go on */
+		_pa_loop_stop(pa);
+		for(i = 0; i < pa->samples_cnt; i++)
+			if(pa->samples[i].loop)
+				pa->samples[i].play = FALSE;
+		for(l = pa->playbacks; l != NULL; l = next)
+		{
+			next = l->next;
+			if(_pa_classes[((PulseaudioPlayback *)l->data)->pclass]
+					.preemptible)
+				_pa_playback_cancel(l->data);
+		}
+		g_slist_free_full(pa->pending, g_free);
+		pa->pending = NULL;
+	}
+	else if((s = _pa_sample_get(pa, sample)) == NULL)
+	{
+		/* assume the server knows about it */
+		if(pa->pac == NULL
+				|| pa_context_get_state(pa->pac)
+				!= PA_CONTEXT_READY)
+		{
+			/* played once connected */
+			if(g_slist_find_custom(pa->pending, sample,
+						(GCompareFunc)strcmp) == NULL)
+				pa->pending = g_slist_append(pa->pending,
+						g_strdup(sample));
+		}
+		else
+			_pa_playback_request(pa, sample,
+					PULSEAUDIO_CLASS_FEEDBACK, time);
+	}
+	else
+	{
+		s->used = g_get_monotonic_time();
+		/* measured until the audio starts */
+		s->requested = time;
+		/* looping samples are played from memory */
+		if(pa->pac != NULL && pa_context_get_state(pa->pac)
+				== PA_CONTEXT_READY
+				&& (s->state == PSS_CACHED || (s->loop
+						&& s->state == PSS_DECODED)))
+			_pa_sample_play(s);
+		else
+		{
+			/* it was evicted, or is not ready yet */
+			s->play = TRUE;
+			if(s->state == PSS_NONE && s->filename != NULL)
+			{
+				s->state = PSS_DECODING;
+				g_thread_pool_push(pa->decoder, s, NULL);
+			}
+		}
+	}
+}
+
+
+/* pa_on_context_state */
+static void _context_state_failed(Pulseaudio * pa);
+static void _context_state_ready(Pulseaudio * pa);
+
+static void _pa_on_context_state(pa_context * pac, void * data)
+{
+	Pulseaudio * pa = data;
+
+	switch(pa_context_get_state(pac))
+	{
+		case PA_CONTEXT_READY:
+			_context_state_ready(pa);
+			break;
+		case PA_CONTEXT_FAILED:
+		case PA_CONTEXT_TERMINATED:
+			_context_state_failed(pa);
+			break;
+		default:
+			break;
+	}
+}
+
+static void _context_state_failed(Pulseaudio * pa)
+{
+	pa_mainloop_api * mapi;
+	struct timeval tv;
+	GSList * l;
+	GSList * next;
+	size_t i;
+
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() %s, again in %u ms\n", __func__,
+			pa_strerror(pa_context_errno(pa->pac)),
+			pa->reconnect_delay);
+#endif
+	/* the playbacks queued are kept for the new context */
+	for(l = pa->playbacks; l != NULL; l = next)
+	{
+		next = l->next;
+		if(((PulseaudioPlayback *)l->data)->state != PPS_QUEUED)
+			_pa_playback_delete(l->data);
+	}
+	/* restarted with the new context if still ringing */
+	if(pa->loop != NULL)
+		_pa_loop_close(pa);
+	_pa_voice_close(pa);
+	/* the cache of the server is gone with it */
+	for(i = 0; i < pa->samples_cnt; i++)
+		if(pa->samples[i].state == PSS_CACHED)
+			pa->samples[i].state = PSS_NONE;
+	pa->cached = 0;
+	pa->ducking = FALSE;
+	g_hash_table_remove_all(pa->ducked);
+	if(pa->reconnect != NULL)
+		return;
+	/* the context is released from the timer */
+	mapi = pa_threaded_mainloop_get_api(pa->pam);
+	pa_gettimeofday(&tv);
+	pa_timeval_add(&tv, (pa_usec_t)pa->reconnect_delay * 1000);
+	pa->reconnect = mapi->time_new(mapi, &tv, _pa_on_reconnect, pa);
+	pa->reconnect_delay = MIN(pa->reconnect_delay * 2,
+			PULSEAUDIO_RECONNECT_MAX);
+}
+
+static void _context_state_ready(Pulseaudio * pa)
+{
+	pa_context * pac = pa->pac;
+	pa_operation * pao;
+	PulseaudioSample * sample;
+	GSList * l;
+	size_t i;
+
+	pa->reconnect_delay = PULSEAUDIO_RECONNECT;
+	/* to lower the new streams as well */
+	if((pao = pa_context_subscribe(pac, PA_SUBSCRIPTION_MASK_SINK_INPUT,
+					NULL, NULL)) != NULL)
+		pa_operation_unref(pao);
+	/* apply the changes made while connecting */
+	_pa_route_update(pa);
+	for(i = 0; i < pa->samples_cnt; i++)
+	{
+		sample = &pa->samples[i];
+		if(sample->state == PSS_DECODED)
+		{
+			if(sample->loop == FALSE)
+				_pa_sample_upload(sample);
+			else if(sample->play)
+				_pa_sample_play(sample);
+		}
+		else if(sample->state == PSS_CACHED && sample->play)
+			_pa_sample_play(sample);
+		else if(sample->state == PSS_NONE && sample->filename != NULL)
+		{
+			/* lost with the previous server */
+			sample->state = PSS_DECODING;
+			g_thread_pool_push(pa->decoder, sample, NULL);
+		}
+	}
+	/* resume ringing, or the call */
+	if(pa->ringing && pa->loop == NULL && pa->loop_sample != NULL)
+		_pa_loop_start(pa, pa->loop_sample);
+	if(pa->voice_open)
+		_pa_voice_open(pa);
+	/* the other samples requested meanwhile */
+	_pa_playback_next(pa);
+	for(l = pa->pending; l != NULL; l = l->next)
+		/* not measured, as delayed by the server */
+		_pa_playback_request(pa, l->data, PULSEAUDIO_CLASS_FEEDBACK,
+				0);
+	g_slist_free_full(pa->pending, g_free);
+	pa->pending = NULL;
+}
+
+
+/* pa_on_decode */
+static void _pa_on_decode(gpointer data, gpointer user_data)
+{
+	PulseaudioSample * sample = data;
+	Pulseaudio * pa = user_data;
+	int res;
+
+	res = _pa_sample_decode(sample);
+	pa_threaded_mainloop_lock(pa->pam);
+	if(res != 0)
+	{
+#ifdef DEBUG
+		fprintf(stderr, "DEBUG: %s() %s: Could not decode sample\n",
+				__func__, sample->filename);
+#endif
+		sample->state = PSS_NONE;
+		/* do not try again */
+		g_free(sample->filename);
+		sample->filename = NULL;
+	}
+	else
+	{
+		sample->state = PSS_DECODED;
+		if(sample->loop == FALSE)
+			_pa_sample_upload(sample);
+		else if(sample->play && pa_context_get_state(pa->pac)
+				== PA_CONTEXT_READY)
+			_pa_sample_play(sample);
+	}
+	pa_threaded_mainloop_unlock(pa->pam);
+}
+
+
+/* pa_on_duck */
+static void _pa_on_duck(pa_context * pac, pa_sink_input_info const * info,
+		int eol, void * data)
+{
+	Pulseaudio * pa = data;
+	pa_cvolume * volume;
+	pa_cvolume ducked;
+	pa_operation * pao;
+
+	if(eol != 0 || info == NULL || pa->ducking == FALSE)
+		return;
+	/* leave our own streams alone */
+	if(info->client == pa_context_get_index(pac)
+			|| g_hash_table_lookup(pa->ducked,
+				GUINT_TO_POINTER(info->index)) != NULL)
+		return;
+	if((volume = g_try_malloc(sizeof(*volume))) == NULL)
+		return;
+	*volume = info->volume;
+	g_hash_table_insert(pa->ducked, GUINT_TO_POINTER(info->index), volume);
+	pa_sw_cvolume_multiply_scalar(&ducked, volume,
+			pa_sw_volume_from_linear(PULSEAUDIO_DUCK));
+	if((pao = pa_context_set_sink_input_volume(pac, info->index, &ducked,
+					NULL, NULL)) != NULL)
+		pa_operation_unref(pao);
+}
+
+
+/* pa_on_loop_started */
+static void _pa_on_loop_started(pa_stream * stream, void * data)
+{
+	Pulseaudio * pa = data;
+	pa_usec_t latency;
+	int negative;
+
+	/* heard once through the buffers of the server */
+	if(pa_stream_get_latency(stream, &latency, &negative) != 0
+			|| negative)
+		latency = 0;
+	_pa_stats_started(pa, pa->loop_requested, latency);
+	pa->loop_requested = 0;
+}
+
+
+/* pa_on_loop_state */
+static void _pa_on_loop_state(pa_stream * stream, void * data)
+{
+	Pulseaudio * pa = data;
+
+	switch(pa_stream_get_state(stream))
+	{
+		case PA_STREAM_FAILED:
+		case PA_STREAM_TERMINATED:
+			/* created again when needed */
+			pa_stream_set_state_callback(stream, NULL, NULL);
+			pa_stream_set_write_callback(stream, NULL, NULL);
+			pa_stream_set_started_callback(stream, NULL, NULL);
+			pa_stream_set_underflow_callback(stream, NULL, NULL);
+			pa_stream_unref(stream);
+			if(pa->loop == stream)
+				pa->loop = NULL;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* pa_on_loop_write */
+static void _pa_on_loop_write(pa_stream * stream, size_t size, void * data)
+{
+	Pulseaudio * pa = data;
+	PulseaudioSample * sample = pa->loop_sample;
+	unsigned char * buf;
+	size_t len;
+	size_t i;
+	size_t n;
+
+	if(sample == NULL || sample->data == NULL || sample->size == 0)
+		return;
+	while(size > 0)
+	{
+		len = size;
+		if(pa_stream_begin_write(stream, (void **)&buf, &len) != 0
+				|| buf == NULL)
+			break;
+		len = MIN(len, size);
+		/* wrap around the samples decoded */
+		for(i = 0; i < len; i += n)
+		{
+			n = MIN(len - i, sample->size - pa->loop_offset);
+			memcpy(&buf[i], &sample->data[pa->loop_offset], n);
+			pa->loop_offset = (pa->loop_offset + n) % sample->size;
+		}
+		if(pa_stream_write(stream, buf, len, NULL, 0,
+					PA_SEEK_RELATIVE) != 0)
+			break;
+		size -= len;
+	}
+}
+
+
+/* pa_on_played */
+static void _pa_on_played(pa_context * pac, uint32_t index, void * data)
+{
+	PulseaudioPlayback * playback = data;
+	Pulseaudio * pa = playback->pa;
+	pa_operation * pao;
+
+	if(playback->pao != NULL)
+		pa_operation_unref(playback->pao);
+	playback->pao = NULL;
+	if(index == PA_INVALID_INDEX)
+	{
+		/* unknown to the server */
+		_pa_playback_delete(playback);
+		_pa_playback_next(pa);
+		return;
+	}
+	playback->state = PPS_PLAYING;
+	playback->index = index;
+	if(playback->cancelled)
+	{
+		/* removed from the list once stopped */
+		if((pao = pa_context_kill_sink_input(pac, index, NULL, NULL))
+				!= NULL)
+			pa_operation_unref(pao);
+	}
+	else
+		/* acknowledged once the server started playing it */
+		_pa_stats_started(pa, playback->requested, 0);
+}
+
+
+/* pa_on_reconnect */
+static void _pa_on_reconnect(pa_mainloop_api * mapi, pa_time_event * event,
+		struct timeval const * tv, void * data)
+{
+	Pulseaudio * pa = data;
+	(void) tv;
+
+	mapi->time_free(event);
+	pa->reconnect = NULL;
+	/* keeps the failed context if a new one cannot be created */
+	if(_pa_connect(pa) != 0)
+		_context_state_failed(pa);
+}
+
+
+/* pa_on_retry */
+static gboolean _pa_on_retry(gpointer data)
+{
+	Pulseaudio * pa = data;
+	PulseaudioCommand command;
+
+	pa->retry = 0;
+	if(pa->retry_route)
+	{
+		/* the current route, re-armed if still full */
+		pa->retry_route = FALSE;
+		_pa_route_send(pa);
+	}
+	/* unless the voice was started again meanwhile */
+	if(pa->retry_voice && pa->voice == FALSE)
+	{
+		pa->retry_voice = FALSE;
+		memset(&command, 0, sizeof(command));
+		command.type = PCT_VOICE;
+		command.call = FALSE;
+		if(_pa_command(pa, &command) != 0)
+			_pa_retry(pa, PCT_VOICE);
+	}
+	else
+		pa->retry_voice = FALSE;
+	return FALSE;
+}
+
+
+/* pa_on_sample_state */
+static void _pa_on_sample_state(pa_stream * stream, void * data)
+{
+	PulseaudioSample * sample = data;
+	Pulseaudio * pa = sample->pa;
+
+	switch(pa_stream_get_state(stream))
+	{
+		case PA_STREAM_TERMINATED:
+			/* the server keeps it from there */
+			_pa_sample_reset(sample);
+			sample->state = PSS_CACHED;
+			pa->cached += sample->size;
+			_pa_sample_evict(pa, sample);
+			if(sample->play)
+				_pa_sample_play(sample);
+			break;
+		case PA_STREAM_FAILED:
+			_pa_sample_reset(sample);
+			sample->state = PSS_NONE;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* pa_on_sample_write */
+static void _pa_on_sample_write(pa_stream * stream, size_t size, void * data)
+{
+	PulseaudioSample * sample = data;
+	void * buf;
+	size_t len;
+
+	while(size > 0 && sample->written < sample->size)
+	{
+		/* write straight into the memory shared with the server */
+		len = MIN(size, sample->size - sample->written);
+		if(pa_stream_begin_write(stream, &buf, &len) != 0
+				|| buf == NULL)
+			break;
+		len = MIN(len, sample->size - sample->written);
+		memcpy(buf, &sample->data[sample->written], len);
+		if(pa_stream_write(stream, buf, len, NULL, 0,
+					PA_SEEK_RELATIVE) != 0)
+			break;
+		sample->written += len;
+		size -= MIN(size, len);
+	}
+	if(sample->written == sample->size)
+	{
+		pa_stream_set_write_callback(stream, NULL, NULL);
+		pa_stream_finish_upload(stream);
+	}
+}
+
+
+/* pa_on_stats */
+static void _on_stats_histogram(Pulseaudio * pa, char const * variable,
+		PulseaudioHistogram * histogram);
+
+static gboolean _pa_on_stats(gpointer data)
+{
+	Pulseaudio * pa = data;
+	PhonePluginHelper * helper = pa->helper;
+	PulseaudioHistogram issued;
+	PulseaudioHistogram started;
+	unsigned long underruns;
+	char buf[32];
+
+	pa_threaded_mainloop_lock(pa->pam);
+	pa->stats_source = 0;
+	issued = pa->issued;
+	started = pa->started;
+	underruns = pa->underruns;
+	pa_threaded_mainloop_unlock(pa->pam);
+	_on_stats_histogram(pa, "stats_issued", &issued);
+	_on_stats_histogram(pa, "stats_started", &started);
+	snprintf(buf, sizeof(buf), "%lu", underruns);
+	helper->config_set(helper->phone, "pulseaudio", "stats_underruns",
+			buf);
+	return FALSE;
+}
+
+static void _on_stats_histogram(Pulseaudio * pa, char const * variable,
+		PulseaudioHistogram * histogram)
+{
+	PhonePluginHelper * helper = pa->helper;
+	GString * str;
+	size_t i;
+
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "%lu %lu %lu", histogram->cnt,
+			(histogram->cnt > 0)
+			? (unsigned long)(histogram->total / histogram->cnt)
+			: 0, (unsigned long)histogram->max);
+	for(i = 0; i < PULSEAUDIO_HISTOGRAM; i++)
+		g_string_append_printf(str, " %lu", histogram->buckets[i]);
+	helper->config_set(helper->phone, "pulseaudio", variable, str->str);
+	g_string_free(str, TRUE);
+}
+
+
+/* pa_on_subscribe */
+static void _pa_on_subscribe(pa_context * pac,
+		pa_subscription_event_type_t type, uint32_t index, void * data)
+{
+	Pulseaudio * pa = data;
+	PulseaudioPlayback * playback;
+	pa_operation * pao;
+
+	if((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK)
+			!= PA_SUBSCRIPTION_EVENT_SINK_INPUT)
+		return;
+	switch(type & PA_SUBSCRIPTION_EVENT_TYPE_MASK)
+	{
+		case PA_SUBSCRIPTION_EVENT_NEW:
+			if(pa->ducking && (pao = pa_context_get_sink_input_info(
+							pac, index, _pa_on_duck,
+							pa)) != NULL)
+				pa_operation_unref(pao);
+			break;
+		case PA_SUBSCRIPTION_EVENT_REMOVE:
+			g_hash_table_remove(pa->ducked,
+					GUINT_TO_POINTER(index));
+			/* make room for the next playback */
+			if((playback = _pa_playback_find(pa, index)) != NULL)
+			{
+				_pa_playback_delete(playback);
+				_pa_playback_next(pa);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* pa_on_underflow */
+static void _pa_on_underflow(pa_stream * stream, void * data)
+{
+	Pulseaudio * pa = data;
+	(void) stream;
+
+	pa->underruns++;
+	_pa_stats_changed(pa);
+}
+
+
+/* pa_on_update */
+static void _update_restore(gpointer key, gpointer value, gpointer data);
+
+static void _pa_on_update(pa_mainloop_api * mapi, pa_defer_event * event,
+		void * data)
+{
+	Pulseaudio * pa = data;
+	gboolean ducking = (pa->calling || pa->ringing) ? TRUE : FALSE;
+	pa_cvolume volume;
+	pa_operation * pao;
+
+	mapi->defer_enable(event, 0);
+	if(pa_context_get_state(pa->pac) != PA_CONTEXT_READY)
+		return;
+	/* the volume of the ringtone follows the route */
+	if(pa->loop != NULL && pa->loop_sample != NULL
+			&& pa_stream_get_state(pa->loop) == PA_STREAM_READY)
+	{
+		pa_cvolume_set(&volume, pa->loop_sample->spec.channels,
+				_pa_route_volume(pa));
+		if((pao = pa_context_set_sink_input_volume(pa->pac,
+						pa_stream_get_index(pa->loop),
+						&volume, NULL, NULL)) != NULL)
+			pa_operation_unref(pao);
+	}
+	/* and so does the voice */
+	if(pa->playback != NULL
+			&& pa_stream_get_state(pa->playback) == PA_STREAM_READY)
+	{
+		pa_cvolume_set(&volume, 1, _pa_route_volume(pa));
+		if((pao = pa_context_set_sink_input_volume(pa->pac,
+						pa_stream_get_index(
+							pa->playback), &volume,
+						NULL, NULL)) != NULL)
+			pa_operation_unref(pao);
+	}
+	if(ducking == pa->ducking)
+		return;
+	if((pa->ducking = ducking))
+	{
+		/* lower every other stream in a single request */
+		if((pao = pa_context_get_sink_input_info_list(pa->pac,
+						_pa_on_duck, pa)) != NULL)
+			pa_operation_unref(pao);
+	}
+	else
+	{
+		g_hash_table_foreach(pa->ducked, _update_restore, pa);
+		g_hash_table_remove_all(pa->ducked);
+	}
+}
+
+static void _update_restore(gpointer key, gpointer value, gpointer data)
+{
+	Pulseaudio * pa = data;
+	pa_operation * pao;
+
+	if((pao = pa_context_set_sink_input_volume(pa->pac,
+					GPOINTER_TO_UINT(key), value, NULL,
+					NULL)) != NULL)
+		pa_operation_unref(pao);
+}
+
+
+/* pa_on_voice_read */
+static void _pa_on_voice_read(pa_stream * stream, size_t size, void * data)
+{
+	Pulseaudio * pa = data;
+	void const * buf;
+	pa_usec_t latency;
+	int negative;
+
+	if(pa_stream_get_latency(stream, &latency, &negative) == 0)
+		g_atomic_int_set(&pa->capture_latency,
+				negative ? 0 : (gint)latency);
+
+	while(pa_stream_peek(stream, &buf, &size) == 0 && size > 0)
+	{
+		/* never wait for the modem: drop the audio instead */
+		if(buf != NULL)
+			_pa_ring_write(&pa->uplink, buf,
+					size / sizeof(int16_t));
+		pa_stream_drop(stream);
+	}
+}
+
+
+/* pa_on_voice_state */
+static void _voice_state_realtime(Pulseaudio * pa);
+
+static void _pa_on_voice_state(pa_stream * stream, void * data)
+{
+	Pulseaudio * pa = data;
+
+	switch(pa_stream_get_state(stream))
+	{
+		case PA_STREAM_READY:
+			_voice_state_realtime(pa);
+			break;
+		case PA_STREAM_FAILED:
+		case PA_STREAM_TERMINATED:
+#ifdef DEBUG
+			fprintf(stderr, "DEBUG: %s() %s\n", __func__,
+					pa_strerror(pa_context_errno(pa->pac)));
+#endif
+			/* both directions or none */
+			_pa_voice_close(pa);
+			break;
+		default:
+			break;
+	}
+}
+
+static void _voice_state_realtime(Pulseaudio * pa)
+{
+	struct sched_param param;
+
+	/* from the I/O thread, once per call */
+	if(pa->realtime || pthread_getschedparam(pthread_self(),
+				&pa->realtime_policy, &pa->realtime_param)
+			!= 0)
+		return;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = MIN(sched_get_priority_min(SCHED_FIFO)
+			+ PULSEAUDIO_VOICE_PRIORITY,
+			sched_get_priority_max(SCHED_FIFO));
+	if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		/* not permitted: keep the default scheduling */
+		return;
+	pa->realtime = TRUE;
+#ifdef DEBUG
+	fprintf(stderr, "DEBUG: %s() real-time scheduling\n", __func__);
+#endif
+}
+
+
+/* pa_on_voice_timeout */
+static guint _voice_timeout_delay(Pulseaudio * pa);
+static void _voice_timeout_latency(Pulseaudio * pa);
+
+static gboolean _pa_on_voice_timeout(gpointer data)
+{
+	Pulseaudio * pa = data;
+	PhonePluginHelper * helper = pa->helper;
+	int16_t frames[PULSEAUDIO_VOICE_PACKET];
+	int16_t reference[PULSEAUDIO_VOICE_PACKET];
+	ModemRequest request;
+	guint delay;
+	guint cnt;
+	guint pad;
+
+	/* forward the audio captured, a whole packet at a time */
+	while(_pa_ring_fill(&pa->uplink) >= PULSEAUDIO_VOICE_PACKET)
+	{
+		_pa_ring_read(&pa->uplink, frames, PULSEAUDIO_VOICE_PACKET);
+		if(pa->dsp != NULL)
+		{
+			/* against what was played as it was captured */
+			delay = _voice_timeout_delay(pa)
+				+ PULSEAUDIO_VOICE_PACKET;
+			pad = 0;
+			if((cnt = _pa_ring_fill(&pa->echo)) > delay)
+				_pa_ring_skip(&pa->echo, cnt - delay);
+			else
+				/* not played that long ago: silence */
+				pad = MIN(delay - cnt, PULSEAUDIO_VOICE_PACKET);
+			memset(reference, 0, sizeof(*reference) * pad);
+			cnt = _pa_ring_read(&pa->echo, &reference[pad],
+					PULSEAUDIO_VOICE_PACKET - pad);
+			memset(&reference[pad + cnt], 0, sizeof(reference)
+					- (pad + cnt) * sizeof(*reference));
+			_pa_dsp_process(pa->dsp, frames, reference,
+					PULSEAUDIO_VOICE_PACKET);
+		}
+		memset(&request, 0, sizeof(request));
+		request.type = MODEM_REQUEST_UNSUPPORTED;
+		request.unsupported.modem = pa->voice_modem;
+		request.unsupported.request = pa->voice_request;
+		request.unsupported.arg = frames;
+		request.unsupported.size = sizeof(frames);
+		helper->request(helper->phone, &request);
+	}
+	_voice_timeout_latency(pa);
+	return TRUE;
+}
+
+static guint _voice_timeout_delay(Pulseaudio * pa)
+{
+	gint capture;
+	gint playback;
+	guint ret;
+
+	/* from the speaker back to the packet read from the microphone */
+	if((capture = g_atomic_int_get(&pa->capture_latency)) < 0
+			|| (playback = g_atomic_int_get(
+					&pa->playback_latency)) < 0)
+		/* no timing information yet */
+		return PULSEAUDIO_VOICE_PACKET;
+	ret = (guint)(((gint64)capture + playback) * PULSEAUDIO_VOICE_RATE
+			/ 1000000);
+	/* the frames captured since were played later */
+	ret += _pa_ring_fill(&pa->uplink);
+	return MIN(ret, PULSEAUDIO_VOICE_RING / 2);
+}
+
+static void _voice_timeout_latency(Pulseaudio * pa)
+{
+	gint capture;
+	gint playback;
+	guint cnt;
+
+	/* as reported from the main loop of PulseAudio */
+	if((capture = g_atomic_int_get(&pa->capture_latency)) < 0
+			|| (playback = g_atomic_int_get(
+					&pa->playback_latency)) < 0)
+		/* no timing information yet */
+		return;
+	/* from the microphone to the modem, and back to the speaker */
+	cnt = _pa_ring_fill(&pa->uplink) + _pa_ring_fill(&pa->downlink);
+	pa->latency = (pa_usec_t)capture + playback
+		+ (pa_usec_t)cnt * 1000000 / PULSEAUDIO_VOICE_RATE;
+	pa->latency_max = max(pa->latency_max, pa->latency);
+	pa->latency_total += pa->latency;
+	pa->latency_cnt++;
+}
+
+
+/* pa_on_voice_write */
+static void _pa_on_voice_write(pa_stream * stream, size_t size, void * data)
+{
+	Pulseaudio * pa = data;
+	guint backlog = PULSEAUDIO_VOICE_RATE * PULSEAUDIO_VOICE_BACKLOG
+		/ 1000;
+	size_t frame = pa_frame_size(pa_stream_get_sample_spec(stream));
+	pa_usec_t latency;
+	int negative;
+	int16_t * buf;
+	size_t len;
+	guint cnt;
+
+	if(pa_stream_get_latency(stream, &latency, &negative) == 0)
+		g_atomic_int_set(&pa->playback_latency,
+				negative ? 0 : (gint)latency);
+	/* catch up rather than let the latency grow */
+	if((cnt = _pa_ring_fill(&pa->downlink)) > backlog)
+		_pa_ring_skip(&pa->downlink, cnt - backlog);
+	while(size > 0)
+	{
+		len = size;
+		if(pa_stream_begin_write(stream, (void **)&buf, &len) != 0
+				|| buf == NULL)
+			break;
+		/* only whole frames can be written */
+		if((len = MIN(len, size) / frame * frame) == 0)
+		{
+			pa_stream_cancel_write(stream);
+			break;
+		}
+		cnt = _pa_ring_read(&pa->downlink, buf, len / sizeof(*buf));
+		/* silence until the modem catches up */
+		memset(&buf[cnt], 0, len - cnt * sizeof(*buf));
+		/* as reference for the echo cancellation */
+		if(pa->dsp != NULL)
+			_pa_ring_write(&pa->echo, buf, len / sizeof(*buf));
+		if(pa_stream_write(stream, buf, len, NULL, 0,
+					PA_SEEK_RELATIVE) != 0)
+			break;
+		size -= len;
 	}
-	else if(pa->pao == NULL)
-		/* FIXME apply the proper volume */
-		pa->pao = pa_context_play_sample(pa->pac, sample, NULL,
-				PA_VOLUME_NORM, NULL, NULL);
 }
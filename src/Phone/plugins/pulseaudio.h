@@ -0,0 +1,49 @@
+/* $Id$ */
+/* Copyright (c) 2026 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+#ifndef DESKTOP_PHONE_PLUGINS_PULSEAUDIO_H
+# define DESKTOP_PHONE_PLUGINS_PULSEAUDIO_H
+
+
+/* Pulseaudio */
+/* constants */
+/* The voice of the calls is exchanged with the modem plug-in named by the
+ * "voice_modem" variable of the "pulseaudio" section, with the number set as
+ * "voice_request" there:
+ * - the audio captured is sent as MODEM_REQUEST_UNSUPPORTED requests, with
+ *   one packet of PULSEAUDIO_VOICE_PACKET frames as arg, and its size in bytes
+ *   as size;
+ * - the audio to play back is expected as MODEM_EVENT_TYPE_UNSUPPORTED events,
+ *   with the same request, and any number of whole frames as data.
+ * The frames are 16-bit signed integers in host byte order, in mono, and only
+ * exchanged while a call is established. */
+# define PULSEAUDIO_VOICE_RATE	8000
+/* frames sent to the modem at once (in milliseconds) */
+# define PULSEAUDIO_VOICE_PTIME	20
+/* frames per packet */
+# define PULSEAUDIO_VOICE_PACKET	(PULSEAUDIO_VOICE_RATE \
+		* PULSEAUDIO_VOICE_PTIME / 1000)
+
+/* The latency of the sounds played is published as variables of the
+ * "pulseaudio" section, ten seconds after it changed at most:
+ * - "stats_issued", from the event to the sound sent to the server;
+ * - "stats_started", from the event to the sound heard;
+ *   as the count, the average and the maximum (in microseconds), then the
+ *   counts below 1, 2, 4 ms and so on, the last one for the longest;
+ * - "stats_underruns", as the number of underruns of the playback. */
+
+#endif /* !DESKTOP_PHONE_PLUGINS_PULSEAUDIO_H */
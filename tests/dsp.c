@@ -0,0 +1,107 @@
+/* $Id$ */
+/* Copyright (c) 2026 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+/* the DSP is private to the Pulseaudio plug-in */
+#include "../src/Phone/plugins/pulseaudio.c"
+
+
+/* dsp */
+/* private */
+/* constants */
+/* not a multiple of the vectors, to go through the remainder too */
+#define DSP_COUNT	(PULSEAUDIO_DSP_TAPS + 3)
+/* relative to the sum of the magnitudes, as the order of the sums differs */
+#define DSP_EPSILON	1.0e-5
+
+
+/* prototypes */
+static int _dsp_axpy(size_t cnt, float const * x, float const * y);
+static int _dsp_dot(size_t cnt, float const * a, float const * b);
+
+
+/* functions */
+/* dsp_axpy */
+static int _dsp_axpy(size_t cnt, float const * x, float const * y)
+{
+	float vector[DSP_COUNT];
+	float scalar[DSP_COUNT];
+	float const a = 0.25f;
+	double error = 0.0;
+	size_t i;
+
+	memcpy(vector, y, sizeof(*y) * cnt);
+	memcpy(scalar, y, sizeof(*y) * cnt);
+	_pa_dsp_axpy(vector, a, x, cnt);
+	_pa_dsp_axpy_scalar(scalar, a, x, cnt);
+	for(i = 0; i < cnt; i++)
+		error = max(error, fabs((double)vector[i] - scalar[i])
+				/ (fabs(a * x[i]) + fabs(y[i]) + 1.0));
+	printf("axpy, %lu: %s\n", (unsigned long)cnt,
+			(error <= DSP_EPSILON) ? "OK" : "FAILED");
+	return (error <= DSP_EPSILON) ? 0 : -1;
+}
+
+
+/* dsp_dot */
+static int _dsp_dot(size_t cnt, float const * a, float const * b)
+{
+	float vector;
+	float scalar;
+	double norm = 1.0;
+	double error;
+	size_t i;
+
+	vector = _pa_dsp_dot(a, b, cnt);
+	scalar = _pa_dsp_dot_scalar(a, b, cnt);
+	for(i = 0; i < cnt; i++)
+		norm += fabs((double)a[i] * b[i]);
+	error = fabs((double)vector - scalar) / norm;
+	printf("dot, %lu: %g %g: %s\n", (unsigned long)cnt, vector, scalar,
+			(error <= DSP_EPSILON) ? "OK" : "FAILED");
+	return (error <= DSP_EPSILON) ? 0 : -1;
+}
+
+
+/* public */
+/* functions */
+/* main */
+int main(void)
+{
+	int ret = 0;
+	static const size_t counts[] = { 0, 1, 3, 4, 5, 64, DSP_COUNT };
+	float a[DSP_COUNT];
+	float b[DSP_COUNT];
+	size_t i;
+
+#ifdef PULSEAUDIO_DSP_VECTOR
+	printf("vectors of %lu\n", (unsigned long)PULSEAUDIO_DSP_VECTOR);
+#else
+	printf("scalar only\n");
+#endif
+	/* like the samples captured */
+	srand(0);
+	for(i = 0; i < DSP_COUNT; i++)
+	{
+		a[i] = (rand() % 65536) - 32768;
+		b[i] = (rand() % 65536) - 32768;
+	}
+	for(i = 0; i < sizeof(counts) / sizeof(*counts); i++)
+		if(_dsp_dot(counts[i], a, b) != 0
+				|| _dsp_axpy(counts[i], a, b) != 0)
+			ret = 1;
+	return ret;
+}
@@ -0,0 +1,166 @@
+/* $Id$ */
+/* Copyright (c) 2026 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+/* the history is private to the Purple modem plug-in */
+#include <glib/gstdio.h>
+#include "../src/Phone/modems/purple.c"
+
+
+/* history */
+/* private */
+/* constants */
+#define HISTORY_NUMBER	"alice"
+
+
+/* variables */
+static time_t _history_dates[16];
+static size_t _history_dates_cnt;
+
+
+/* prototypes */
+static int _history_check(Purple * purple, char const * what, time_t before,
+		size_t count, time_t const * expected, size_t expected_cnt);
+
+static int _history_error(Modem * modem, char const * message, int ret);
+static void _history_event(Modem * modem, ModemEvent * event);
+
+
+/* functions */
+/* history_check */
+static int _history_check(Purple * purple, char const * what, time_t before,
+		size_t count, time_t const * expected, size_t expected_cnt)
+{
+	PurpleModemHistory history;
+	size_t i;
+
+	history.number = HISTORY_NUMBER;
+	history.before = before;
+	history.count = count;
+	_history_dates_cnt = 0;
+	if(_purple_history_page(purple, &history) != 0)
+		return -1;
+	printf("%s:", what);
+	for(i = 0; i < _history_dates_cnt; i++)
+		printf(" %ld", (long)_history_dates[i]);
+	if(_history_dates_cnt != expected_cnt
+			|| memcmp(_history_dates, expected, sizeof(*expected)
+				* expected_cnt) != 0)
+	{
+		printf(": FAILED\n");
+		return -1;
+	}
+	printf(": OK\n");
+	return 0;
+}
+
+
+/* history_error */
+static int _history_error(Modem * modem, char const * message, int ret)
+{
+	(void) modem;
+
+	fprintf(stderr, "%s: %s\n", "history", message);
+	return ret;
+}
+
+
+/* history_event */
+static void _history_event(Modem * modem, ModemEvent * event)
+{
+	(void) modem;
+
+	if(event->type != MODEM_EVENT_TYPE_MESSAGE
+			|| _history_dates_cnt >= G_N_ELEMENTS(_history_dates))
+		return;
+	_history_dates[_history_dates_cnt++] = event->message.date;
+}
+
+
+/* public */
+/* functions */
+/* main */
+int main(void)
+{
+	int ret = 0;
+	/* the messages are not logged in chronological order */
+	static const time_t logged[] = { 10, 30, 20, 50, 40 };
+	static const time_t latest[] = { 30, 40, 50 };
+	static const time_t before[] = { 10, 20 };
+	char path[] = "/tmp/history.XXXXXX";
+	ModemPluginHelper helper;
+	Purple purple;
+	GDir * dir;
+	char const * name;
+	gchar * filename;
+	gchar * p;
+	size_t i;
+
+	if(g_mkdtemp(path) == NULL)
+		return _history_error(NULL, "Could not create a directory", 2);
+	purple_util_set_user_dir(path);
+	memset(&helper, 0, sizeof(helper));
+	helper.error = _history_error;
+	helper.event = _history_event;
+	memset(&purple, 0, sizeof(purple));
+	purple.helper = &helper;
+	purple.history_fd = -1;
+	if(_purple_history_open(&purple) != 0)
+		ret = _history_error(NULL, "Could not open the history", 2);
+	for(i = 0; ret == 0 && i < G_N_ELEMENTS(logged); i++)
+		if(_purple_history_write(&purple, PURPLE_LOG_IM,
+					PURPLE_MESSAGE_RECV, HISTORY_NUMBER,
+					NULL, logged[i], "message") < 0
+				|| _purple_history_write(&purple,
+					PURPLE_LOG_IM, PURPLE_MESSAGE_SEND,
+					"bob", NULL, logged[i] + 5,
+					"message") < 0)
+			ret = _history_error(NULL, "Could not log", 2);
+	/* from the active segment, then once sealed */
+	if(ret == 0 && (_history_check(&purple, "active", 0, 3, latest,
+					G_N_ELEMENTS(latest)) != 0
+				|| _history_check(&purple, "active, before",
+					30, 10, before, G_N_ELEMENTS(before))
+				!= 0))
+		ret = 1;
+	if(ret == 0 && _history_seal(&purple) != 0)
+		ret = _history_error(NULL, "Could not seal the history", 2);
+	if(ret == 0 && (_history_check(&purple, "sealed", 0, 3, latest,
+					G_N_ELEMENTS(latest)) != 0
+				|| _history_check(&purple, "sealed, before",
+					30, 10, before, G_N_ELEMENTS(before))
+				!= 0))
+		ret = 1;
+	_purple_history_close(&purple);
+	filename = g_build_filename(path, "logs", "phone", NULL);
+	if((dir = g_dir_open(filename, 0, NULL)) != NULL)
+	{
+		while((name = g_dir_read_name(dir)) != NULL)
+		{
+			p = g_build_filename(filename, name, NULL);
+			g_unlink(p);
+			g_free(p);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(filename);
+	g_free(filename);
+	filename = g_build_filename(path, "logs", NULL);
+	g_rmdir(filename);
+	g_free(filename);
+	g_rmdir(path);
+	return ret;
+}
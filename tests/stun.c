@@ -0,0 +1,865 @@
+/* $Id$ */
+/* Copyright (c) 2026 Pierre Pronchery <khorben@defora.org> */
+/* This file is part of DeforaOS Desktop Integration */
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+
+/* stun */
+/* a STUN and TURN server (RFC 5389, RFC 5766) standing in for the real ones,
+ * to test the ICE support of the Sofia modem plug-in on a single host: point
+ * its "stun_servers" and "turn_server" settings to the address served */
+/* private */
+/* constants */
+#define PROGNAME		"stun"
+
+#define STUN_PORT		3478
+#define STUN_COOKIE		0x2112a442
+#define STUN_REALM		"stun"
+#define STUN_ALLOCATIONS	16
+#define STUN_PERMISSIONS	8
+/* in seconds */
+#define STUN_ALLOCATION_LIFETIME	600
+#define STUN_PERMISSION_LIFETIME	300
+/* messages */
+#define STUN_BINDING		0x0001
+#define STUN_ALLOCATE		0x0003
+#define STUN_REFRESH		0x0004
+#define STUN_PERMISSION		0x0008
+#define STUN_SEND_INDICATION	0x0016
+#define STUN_DATA_INDICATION	0x0017
+#define STUN_SUCCESS		0x0100
+#define STUN_ERROR		0x0110
+/* attributes */
+#define STUN_USERNAME		0x0006
+#define STUN_MESSAGE_INTEGRITY	0x0008
+#define STUN_ERROR_CODE		0x0009
+#define STUN_LIFETIME		0x000d
+#define STUN_XOR_PEER_ADDRESS	0x0012
+#define STUN_DATA		0x0013
+#define STUN_REALM_ATTRIBUTE	0x0014
+#define STUN_NONCE		0x0015
+#define STUN_XOR_RELAYED_ADDRESS	0x0016
+#define STUN_REQUESTED_TRANSPORT	0x0019
+#define STUN_XOR_MAPPED_ADDRESS	0x0020
+#define STUN_FINGERPRINT	0x8028
+
+
+/* types */
+typedef struct _StunMessage
+{
+	unsigned char buf[2048];
+	size_t len;
+} StunMessage;
+
+typedef struct _StunPermission
+{
+	struct in_addr addr;
+	time_t expires;
+} StunPermission;
+
+typedef struct _StunAllocation
+{
+	int fd;
+	struct sockaddr_in client;
+	struct sockaddr_in relayed;
+	time_t expires;
+	StunPermission permissions[STUN_PERMISSIONS];
+} StunAllocation;
+
+typedef struct _Stun
+{
+	int fd;
+	struct sockaddr_in addr;
+
+	/* long-term credentials, if any */
+	char const * username;
+	char const * password;
+	unsigned char key[16];
+	char nonce[17];
+
+	StunAllocation allocations[STUN_ALLOCATIONS];
+} Stun;
+
+
+/* prototypes */
+static int _stun(char const * address, unsigned int port,
+		char const * username, char const * password);
+
+static int _error(char const * message, int ret);
+static int _usage(void);
+
+/* messages */
+static void _message_address(unsigned char * buf,
+		struct sockaddr_in const * sa);
+static int _message_address_get(unsigned char const * buf, size_t size,
+		struct sockaddr_in * sa);
+static int _message_attribute(StunMessage * message, uint16_t type,
+		void const * data, size_t size);
+static void _message_error(StunMessage * message, unsigned int code,
+		char const * reason);
+static unsigned char const * _message_find(unsigned char const * buf,
+		size_t len, uint16_t type, size_t * size);
+static void _message_fingerprint(StunMessage * message);
+static void _message_init(StunMessage * message, uint16_t type,
+		unsigned char const * id);
+static void _message_integrity(StunMessage * message,
+		unsigned char const * key, size_t keylen);
+static void _message_length(StunMessage * message, size_t length);
+static uint32_t _message_uint32_get(unsigned char const * buf);
+static void _message_uint32(unsigned char * buf, uint32_t value);
+static int _message_verify(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen);
+
+
+/* functions */
+/* stun */
+static int _stun_allocate(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from, StunMessage * reply);
+static int _stun_authenticate(Stun * stun, unsigned char const * buf,
+		size_t len, StunMessage * reply);
+static StunAllocation * _stun_allocation(Stun * stun,
+		struct sockaddr_in const * client);
+static void _stun_expire(Stun * stun);
+static int _stun_permission(Stun * stun, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from,
+		StunMessage * reply);
+static int _stun_refresh(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from, StunMessage * reply);
+static void _stun_relay(Stun * stun, StunAllocation * allocation);
+static void _stun_request(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from);
+static void _stun_send(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from);
+
+static int _stun(char const * address, unsigned int port,
+		char const * username, char const * password)
+{
+	Stun stun;
+	struct pollfd pfd[1 + STUN_ALLOCATIONS];
+	StunAllocation * allocations[1 + STUN_ALLOCATIONS];
+	nfds_t cnt;
+	unsigned char buf[2048];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	ssize_t len;
+	size_t i;
+	gchar * p;
+	GChecksum * checksum;
+	gsize keylen = sizeof(stun.key);
+
+	memset(&stun, 0, sizeof(stun));
+	stun.addr.sin_family = AF_INET;
+	stun.addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, address, &stun.addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "%s: %s: %s\n", PROGNAME, address,
+				"Invalid address");
+		return -1;
+	}
+	if((stun.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return -_error("socket", 1);
+	if(bind(stun.fd, (struct sockaddr *)&stun.addr, sizeof(stun.addr))
+			!= 0)
+	{
+		close(stun.fd);
+		return -_error(address, 1);
+	}
+	if(username != NULL)
+	{
+		stun.username = username;
+		stun.password = (password != NULL) ? password : "";
+		p = g_strdup_printf("%s:%s:%s", stun.username, STUN_REALM,
+				stun.password);
+		checksum = g_checksum_new(G_CHECKSUM_MD5);
+		g_checksum_update(checksum, (guchar *)p, strlen(p));
+		g_checksum_get_digest(checksum, stun.key, &keylen);
+		g_checksum_free(checksum);
+		g_free(p);
+		snprintf(stun.nonce, sizeof(stun.nonce), "%08x%08x",
+				g_random_int(), g_random_int());
+	}
+	for(i = 0; i < STUN_ALLOCATIONS; i++)
+		stun.allocations[i].fd = -1;
+	printf("%s: Listening on %s:%u\n", PROGNAME, address, port);
+	for(;;)
+	{
+		fflush(stdout);
+		pfd[0].fd = stun.fd;
+		pfd[0].events = POLLIN;
+		allocations[0] = NULL;
+		for(i = 0, cnt = 1; i < STUN_ALLOCATIONS; i++)
+			if(stun.allocations[i].fd >= 0)
+			{
+				pfd[cnt].fd = stun.allocations[i].fd;
+				pfd[cnt].events = POLLIN;
+				allocations[cnt++] = &stun.allocations[i];
+			}
+		if(poll(pfd, cnt, 1000) < 0)
+			break;
+		_stun_expire(&stun);
+		for(i = 1; i < cnt; i++)
+			if((pfd[i].revents & POLLIN)
+					&& allocations[i]->fd >= 0)
+				_stun_relay(&stun, allocations[i]);
+		if(!(pfd[0].revents & POLLIN))
+			continue;
+		fromlen = sizeof(from);
+		if((len = recvfrom(stun.fd, buf, sizeof(buf), 0,
+						(struct sockaddr *)&from,
+						&fromlen)) < 20
+				|| from.sin_family != AF_INET
+				|| (buf[0] & 0xc0) != 0
+				|| _message_uint32_get(&buf[4]) != STUN_COOKIE)
+			continue;
+		_stun_request(&stun, buf, len, &from);
+	}
+	_error("poll", 1);
+	for(i = 0; i < STUN_ALLOCATIONS; i++)
+		if(stun.allocations[i].fd >= 0)
+			close(stun.allocations[i].fd);
+	close(stun.fd);
+	return -1;
+}
+
+static int _stun_allocate(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from, StunMessage * reply)
+{
+	StunAllocation * allocation;
+	unsigned char const * value;
+	size_t size;
+	socklen_t addrlen;
+	unsigned char address[8];
+	unsigned char lifetime[4];
+	size_t i;
+
+	if(_stun_allocation(stun, from) != NULL)
+	{
+		_message_error(reply, 437, "Allocation Mismatch");
+		return -1;
+	}
+	if((value = _message_find(buf, len, STUN_REQUESTED_TRANSPORT, &size))
+			== NULL || size != 4)
+	{
+		_message_error(reply, 400, "Bad Request");
+		return -1;
+	}
+	if(value[0] != IPPROTO_UDP)
+	{
+		_message_error(reply, 442, "Unsupported Transport Protocol");
+		return -1;
+	}
+	for(i = 0; i < STUN_ALLOCATIONS; i++)
+		if(stun->allocations[i].fd < 0)
+			break;
+	if(i == STUN_ALLOCATIONS)
+	{
+		_message_error(reply, 486, "Allocation Quota Reached");
+		return -1;
+	}
+	allocation = &stun->allocations[i];
+	memset(allocation, 0, sizeof(*allocation));
+	/* relay on the same address, on any port */
+	allocation->relayed = stun->addr;
+	allocation->relayed.sin_port = 0;
+	addrlen = sizeof(allocation->relayed);
+	if((allocation->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+			|| bind(allocation->fd, (struct sockaddr *)
+				&allocation->relayed,
+				sizeof(allocation->relayed)) != 0
+			|| getsockname(allocation->fd, (struct sockaddr *)
+				&allocation->relayed, &addrlen) != 0)
+	{
+		_error("relay", 1);
+		if(allocation->fd >= 0)
+			close(allocation->fd);
+		allocation->fd = -1;
+		_message_error(reply, 508, "Insufficient Capacity");
+		return -1;
+	}
+	allocation->client = *from;
+	allocation->expires = time(NULL) + STUN_ALLOCATION_LIFETIME;
+	_message_address(address, &allocation->relayed);
+	_message_attribute(reply, STUN_XOR_RELAYED_ADDRESS, address,
+			sizeof(address));
+	_message_address(address, from);
+	_message_attribute(reply, STUN_XOR_MAPPED_ADDRESS, address,
+			sizeof(address));
+	_message_uint32(lifetime, STUN_ALLOCATION_LIFETIME);
+	_message_attribute(reply, STUN_LIFETIME, lifetime, sizeof(lifetime));
+	printf("%s: %s:%u: Allocated %s:%u\n", PROGNAME,
+			inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+			inet_ntoa(allocation->relayed.sin_addr),
+			ntohs(allocation->relayed.sin_port));
+	return 0;
+}
+
+static int _stun_authenticate(Stun * stun, unsigned char const * buf,
+		size_t len, StunMessage * reply)
+{
+	unsigned char const * value;
+	size_t size;
+
+	if(stun->username == NULL)
+		return 0;
+	if(_message_find(buf, len, STUN_MESSAGE_INTEGRITY, &size) == NULL)
+	{
+		/* challenge the client */
+		_message_error(reply, 401, "Unauthorized");
+		_message_attribute(reply, STUN_REALM_ATTRIBUTE, STUN_REALM,
+				strlen(STUN_REALM));
+		_message_attribute(reply, STUN_NONCE, stun->nonce,
+				strlen(stun->nonce));
+		return -1;
+	}
+	if((value = _message_find(buf, len, STUN_USERNAME, &size)) == NULL
+			|| size != strlen(stun->username)
+			|| memcmp(value, stun->username, size) != 0
+			|| _message_verify(buf, len, stun->key,
+				sizeof(stun->key)) != 0)
+	{
+		_message_error(reply, 401, "Unauthorized");
+		return -1;
+	}
+	if((value = _message_find(buf, len, STUN_NONCE, &size)) == NULL
+			|| size != strlen(stun->nonce)
+			|| memcmp(value, stun->nonce, size) != 0)
+	{
+		_message_error(reply, 438, "Stale Nonce");
+		_message_attribute(reply, STUN_REALM_ATTRIBUTE, STUN_REALM,
+				strlen(STUN_REALM));
+		_message_attribute(reply, STUN_NONCE, stun->nonce,
+				strlen(stun->nonce));
+		return -1;
+	}
+	return 0;
+}
+
+static StunAllocation * _stun_allocation(Stun * stun,
+		struct sockaddr_in const * client)
+{
+	size_t i;
+
+	for(i = 0; i < STUN_ALLOCATIONS; i++)
+		if(stun->allocations[i].fd >= 0
+				&& stun->allocations[i].client.sin_addr.s_addr
+				== client->sin_addr.s_addr
+				&& stun->allocations[i].client.sin_port
+				== client->sin_port)
+			return &stun->allocations[i];
+	return NULL;
+}
+
+static void _stun_expire(Stun * stun)
+{
+	time_t now = time(NULL);
+	StunAllocation * allocation;
+	size_t i;
+
+	for(i = 0; i < STUN_ALLOCATIONS; i++)
+	{
+		allocation = &stun->allocations[i];
+		if(allocation->fd < 0 || now < allocation->expires)
+			continue;
+		printf("%s: %s:%u: Expired %s:%u\n", PROGNAME,
+				inet_ntoa(allocation->client.sin_addr),
+				ntohs(allocation->client.sin_port),
+				inet_ntoa(allocation->relayed.sin_addr),
+				ntohs(allocation->relayed.sin_port));
+		close(allocation->fd);
+		allocation->fd = -1;
+	}
+}
+
+static int _stun_permission(Stun * stun, unsigned char const * buf,
+		size_t len, struct sockaddr_in const * from,
+		StunMessage * reply)
+{
+	StunAllocation * allocation;
+	StunPermission * permission = NULL;
+	unsigned char const * value;
+	size_t size;
+	struct sockaddr_in peer;
+	time_t now = time(NULL);
+	size_t i;
+
+	if((allocation = _stun_allocation(stun, from)) == NULL)
+	{
+		_message_error(reply, 437, "Allocation Mismatch");
+		return -1;
+	}
+	if((value = _message_find(buf, len, STUN_XOR_PEER_ADDRESS, &size))
+			== NULL || _message_address_get(value, size, &peer)
+			!= 0)
+	{
+		_message_error(reply, 400, "Bad Request");
+		return -1;
+	}
+	/* renew the permission, or replace an expired one */
+	for(i = 0; i < STUN_PERMISSIONS; i++)
+		if(allocation->permissions[i].addr.s_addr
+				== peer.sin_addr.s_addr)
+		{
+			permission = &allocation->permissions[i];
+			break;
+		}
+		else if(permission == NULL
+				&& allocation->permissions[i].expires <= now)
+			permission = &allocation->permissions[i];
+	if(permission == NULL)
+	{
+		_message_error(reply, 508, "Insufficient Capacity");
+		return -1;
+	}
+	permission->addr = peer.sin_addr;
+	permission->expires = now + STUN_PERMISSION_LIFETIME;
+	printf("%s: %s:%u: Permission for %s\n", PROGNAME,
+			inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+			inet_ntoa(peer.sin_addr));
+	return 0;
+}
+
+static int _stun_refresh(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from, StunMessage * reply)
+{
+	StunAllocation * allocation;
+	unsigned char const * value;
+	size_t size;
+	uint32_t lifetime = STUN_ALLOCATION_LIFETIME;
+	unsigned char data[4];
+
+	if((allocation = _stun_allocation(stun, from)) == NULL)
+	{
+		_message_error(reply, 437, "Allocation Mismatch");
+		return -1;
+	}
+	if((value = _message_find(buf, len, STUN_LIFETIME, &size)) != NULL
+			&& size == 4)
+		lifetime = MIN(_message_uint32_get(value),
+				STUN_ALLOCATION_LIFETIME);
+	_message_uint32(data, lifetime);
+	_message_attribute(reply, STUN_LIFETIME, data, sizeof(data));
+	printf("%s: %s:%u: Refreshed %s:%u for %us\n", PROGNAME,
+			inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+			inet_ntoa(allocation->relayed.sin_addr),
+			ntohs(allocation->relayed.sin_port), lifetime);
+	/* a lifetime of zero releases the allocation */
+	allocation->expires = time(NULL) + lifetime;
+	if(lifetime == 0)
+	{
+		close(allocation->fd);
+		allocation->fd = -1;
+	}
+	return 0;
+}
+
+static void _stun_relay(Stun * stun, StunAllocation * allocation)
+{
+	unsigned char buf[1500];
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	ssize_t len;
+	StunMessage message;
+	unsigned char id[12];
+	unsigned char address[8];
+	time_t now = time(NULL);
+	size_t i;
+
+	if((len = recvfrom(allocation->fd, buf, sizeof(buf), 0,
+					(struct sockaddr *)&from, &fromlen))
+			< 0 || from.sin_family != AF_INET)
+		return;
+	/* only from the peers allowed */
+	for(i = 0; i < STUN_PERMISSIONS; i++)
+		if(allocation->permissions[i].addr.s_addr
+				== from.sin_addr.s_addr
+				&& allocation->permissions[i].expires > now)
+			break;
+	if(i == STUN_PERMISSIONS)
+		return;
+	for(i = 0; i < sizeof(id); i++)
+		id[i] = g_random_int_range(0, 256);
+	_message_init(&message, STUN_DATA_INDICATION, id);
+	_message_address(address, &from);
+	if(_message_attribute(&message, STUN_XOR_PEER_ADDRESS, address,
+				sizeof(address)) != 0
+			|| _message_attribute(&message, STUN_DATA, buf, len)
+			!= 0)
+		return;
+	sendto(stun->fd, message.buf, message.len, 0,
+			(struct sockaddr *)&allocation->client,
+			sizeof(allocation->client));
+}
+
+static void _stun_request(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from)
+{
+	uint16_t type = (buf[0] << 8) | buf[1];
+	StunMessage reply;
+	unsigned char address[8];
+	int res = 0;
+
+	if(type == STUN_SEND_INDICATION)
+	{
+		_stun_send(stun, buf, len, from);
+		return;
+	}
+	_message_init(&reply, type | STUN_SUCCESS, &buf[8]);
+	switch(type)
+	{
+		case STUN_BINDING:
+			_message_address(address, from);
+			_message_attribute(&reply, STUN_XOR_MAPPED_ADDRESS,
+					address, sizeof(address));
+			break;
+		case STUN_ALLOCATE:
+			if((res = _stun_authenticate(stun, buf, len, &reply))
+					== 0)
+				res = _stun_allocate(stun, buf, len, from,
+						&reply);
+			break;
+		case STUN_REFRESH:
+			if((res = _stun_authenticate(stun, buf, len, &reply))
+					== 0)
+				res = _stun_refresh(stun, buf, len, from,
+						&reply);
+			break;
+		case STUN_PERMISSION:
+			if((res = _stun_authenticate(stun, buf, len, &reply))
+					== 0)
+				res = _stun_permission(stun, buf, len, from,
+						&reply);
+			break;
+		default:
+			/* ignore the other methods and classes */
+			return;
+	}
+	if(res != 0)
+		reply.buf[1] |= STUN_ERROR & 0xff;
+	else if(type != STUN_BINDING && stun->username != NULL)
+		_message_integrity(&reply, stun->key, sizeof(stun->key));
+	_message_fingerprint(&reply);
+	sendto(stun->fd, reply.buf, reply.len, 0, (struct sockaddr const *)from,
+			sizeof(*from));
+}
+
+static void _stun_send(Stun * stun, unsigned char const * buf, size_t len,
+		struct sockaddr_in const * from)
+{
+	StunAllocation * allocation;
+	unsigned char const * value;
+	size_t size;
+	struct sockaddr_in peer;
+	time_t now = time(NULL);
+	size_t i;
+
+	if((allocation = _stun_allocation(stun, from)) == NULL
+			|| (value = _message_find(buf, len,
+					STUN_XOR_PEER_ADDRESS, &size)) == NULL
+			|| _message_address_get(value, size, &peer) != 0
+			|| (value = _message_find(buf, len, STUN_DATA, &size))
+			== NULL)
+		return;
+	/* only to the peers allowed */
+	for(i = 0; i < STUN_PERMISSIONS; i++)
+		if(allocation->permissions[i].addr.s_addr
+				== peer.sin_addr.s_addr
+				&& allocation->permissions[i].expires > now)
+			break;
+	if(i == STUN_PERMISSIONS)
+		return;
+	sendto(allocation->fd, value, size, 0, (struct sockaddr *)&peer,
+			sizeof(peer));
+}
+
+
+/* error */
+static int _error(char const * message, int ret)
+{
+	fputs(PROGNAME ": ", stderr);
+	perror(message);
+	return ret;
+}
+
+
+/* usage */
+static int _usage(void)
+{
+	fprintf(stderr, "Usage: %s [-a address][-p port]"
+			"[-u username -w password]\n"
+"  -a	Address to listen on (default: 127.0.0.1)\n"
+"  -p	Port to listen on (default: %u)\n"
+"  -u	Username required to relay\n"
+"  -w	Password required to relay\n", PROGNAME, STUN_PORT);
+	return 1;
+}
+
+
+/* messages */
+/* message_address */
+static void _message_address(unsigned char * buf,
+		struct sockaddr_in const * sa)
+{
+	uint16_t port = ntohs(sa->sin_port) ^ (STUN_COOKIE >> 16);
+
+	/* XOR-MAPPED-ADDRESS, IPv4 */
+	buf[0] = 0;
+	buf[1] = 0x01;
+	buf[2] = port >> 8;
+	buf[3] = port & 0xff;
+	_message_uint32(&buf[4], ntohl(sa->sin_addr.s_addr) ^ STUN_COOKIE);
+}
+
+
+/* message_address_get */
+static int _message_address_get(unsigned char const * buf, size_t size,
+		struct sockaddr_in * sa)
+{
+	uint16_t port;
+
+	if(size != 8 || buf[1] != 0x01)
+		return -1;
+	port = ((buf[2] << 8) | buf[3]) ^ (STUN_COOKIE >> 16);
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons(port);
+	sa->sin_addr.s_addr = htonl(_message_uint32_get(&buf[4])
+			^ STUN_COOKIE);
+	return 0;
+}
+
+
+/* message_attribute */
+static int _message_attribute(StunMessage * message, uint16_t type,
+		void const * data, size_t size)
+{
+	size_t padded = (size + 3) & ~3;
+	unsigned char * p;
+
+	if(message->len + 4 + padded > sizeof(message->buf))
+		return -1;
+	p = &message->buf[message->len];
+	p[0] = type >> 8;
+	p[1] = type & 0xff;
+	p[2] = size >> 8;
+	p[3] = size & 0xff;
+	if(size > 0)
+		memcpy(&p[4], data, size);
+	memset(&p[4 + size], 0, padded - size);
+	message->len += 4 + padded;
+	_message_length(message, message->len - 20);
+	return 0;
+}
+
+
+/* message_error */
+static void _message_error(StunMessage * message, unsigned int code,
+		char const * reason)
+{
+	unsigned char buf[128];
+	size_t len = strlen(reason);
+
+	if(len > sizeof(buf) - 4)
+		len = sizeof(buf) - 4;
+	buf[0] = 0;
+	buf[1] = 0;
+	buf[2] = code / 100;
+	buf[3] = code % 100;
+	memcpy(&buf[4], reason, len);
+	_message_attribute(message, STUN_ERROR_CODE, buf, 4 + len);
+}
+
+
+/* message_find */
+static unsigned char const * _message_find(unsigned char const * buf,
+		size_t len, uint16_t type, size_t * size)
+{
+	size_t i;
+	uint16_t t;
+	size_t s;
+
+	for(i = 20; i + 4 <= len; i += 4 + ((s + 3) & ~3))
+	{
+		t = (buf[i] << 8) | buf[i + 1];
+		s = (buf[i + 2] << 8) | buf[i + 3];
+		if(i + 4 + s > len)
+			break;
+		if(t == type)
+		{
+			*size = s;
+			return &buf[i + 4];
+		}
+	}
+	return NULL;
+}
+
+
+/* message_fingerprint */
+static void _message_fingerprint(StunMessage * message)
+{
+	uint32_t crc = 0xffffffff;
+	unsigned char value[4];
+	size_t i;
+	unsigned int j;
+
+	/* the length includes the attribute itself */
+	_message_length(message, message->len - 20 + 8);
+	for(i = 0; i < message->len; i++)
+	{
+		crc ^= message->buf[i];
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	_message_uint32(value, ~crc ^ 0x5354554e);
+	_message_attribute(message, STUN_FINGERPRINT, value, sizeof(value));
+}
+
+
+/* message_init */
+static void _message_init(StunMessage * message, uint16_t type,
+		unsigned char const * id)
+{
+	message->buf[0] = type >> 8;
+	message->buf[1] = type & 0xff;
+	_message_uint32(&message->buf[4], STUN_COOKIE);
+	memcpy(&message->buf[8], id, 12);
+	message->len = 20;
+	_message_length(message, 0);
+}
+
+
+/* message_integrity */
+static void _message_integrity(StunMessage * message,
+		unsigned char const * key, size_t keylen)
+{
+	GHmac * hmac;
+	unsigned char digest[20];
+	gsize size = sizeof(digest);
+
+	/* the length includes the attribute itself */
+	_message_length(message, message->len - 20 + 4 + sizeof(digest));
+	hmac = g_hmac_new(G_CHECKSUM_SHA1, key, keylen);
+	g_hmac_update(hmac, message->buf, message->len);
+	g_hmac_get_digest(hmac, digest, &size);
+	g_hmac_unref(hmac);
+	_message_attribute(message, STUN_MESSAGE_INTEGRITY, digest,
+			sizeof(digest));
+}
+
+
+/* message_length */
+static void _message_length(StunMessage * message, size_t length)
+{
+	message->buf[2] = length >> 8;
+	message->buf[3] = length & 0xff;
+}
+
+
+/* message_uint32 */
+static void _message_uint32(unsigned char * buf, uint32_t value)
+{
+	buf[0] = value >> 24;
+	buf[1] = (value >> 16) & 0xff;
+	buf[2] = (value >> 8) & 0xff;
+	buf[3] = value & 0xff;
+}
+
+
+/* message_uint32_get */
+static uint32_t _message_uint32_get(unsigned char const * buf)
+{
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8)
+		| buf[3];
+}
+
+
+/* message_verify */
+static int _message_verify(unsigned char const * buf, size_t len,
+		unsigned char const * key, size_t keylen)
+{
+	StunMessage message;
+	unsigned char const * value;
+	size_t size;
+	size_t offset;
+	GHmac * hmac;
+	unsigned char digest[20];
+	gsize dsize = sizeof(digest);
+
+	if((value = _message_find(buf, len, STUN_MESSAGE_INTEGRITY, &size))
+			== NULL || size != sizeof(digest))
+		return -1;
+	/* the digest covers everything up to the attribute */
+	if((offset = value - 4 - buf) > sizeof(message.buf))
+		return -1;
+	memcpy(message.buf, buf, offset);
+	message.len = offset;
+	_message_length(&message, offset - 20 + 4 + sizeof(digest));
+	hmac = g_hmac_new(G_CHECKSUM_SHA1, key, keylen);
+	g_hmac_update(hmac, message.buf, message.len);
+	g_hmac_get_digest(hmac, digest, &dsize);
+	g_hmac_unref(hmac);
+	return (memcmp(digest, value, sizeof(digest)) == 0) ? 0 : -1;
+}
+
+
+/* public */
+/* functions */
+/* main */
+int main(int argc, char * argv[])
+{
+	int o;
+	char const * address = "127.0.0.1";
+	unsigned int port = STUN_PORT;
+	char const * username = NULL;
+	char const * password = NULL;
+	char * p;
+
+	while((o = getopt(argc, argv, "a:p:u:w:")) != -1)
+		switch(o)
+		{
+			case 'a':
+				address = optarg;
+				break;
+			case 'p':
+				port = strtoul(optarg, &p, 10);
+				if(optarg[0] == '\0' || *p != '\0'
+						|| port == 0 || port > 65535)
+					return _usage();
+				break;
+			case 'u':
+				username = optarg;
+				break;
+			case 'w':
+				password = optarg;
+				break;
+			default:
+				return _usage();
+		}
+	if(optind != argc)
+		return _usage();
+	return (_stun(address, port, username, password) == 0) ? 0 : 2;
+}